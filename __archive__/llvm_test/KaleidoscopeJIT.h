@@ -16,6 +16,7 @@
 
 #include "llvm/ADT/iterator_range.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
@@ -27,6 +28,7 @@
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Mangler.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include <algorithm>
@@ -45,7 +47,7 @@ public:
   SimpleCompiler compileModule;
 
   KaleidoscopeJIT()
-      : TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
+      : TM(selectHostTarget()), DL(TM->createDataLayout()),
         ObjectLayer([]() { return std::make_shared<SectionMemoryManager>(); }),
         CompileLayer(ObjectLayer, SimpleCompiler(*TM)), compileModule(*TM) {
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
@@ -53,6 +55,21 @@ public:
 
   TargetMachine &getTargetMachine() { return *TM; }
 
+  /// Select the target of the host CPU with all its features, rather than
+  /// the baseline of its architecture, so that the code generated, vectorized
+  /// code in particular, uses the whole instruction set.
+  static TargetMachine *selectHostTarget() {
+    std::vector<std::string> Features;
+    StringMap<bool> HostFeatures;
+    if (sys::getHostCPUFeatures(HostFeatures))
+      for (auto &Feature : HostFeatures)
+        Features.push_back((Feature.second ? "+" : "-") + Feature.first().str());
+    return EngineBuilder()
+      .setMCPU(sys::getHostCPUName())
+      .setMAttrs(Features)
+      .selectTarget();
+  }
+
   SimpleCompiler::CompileResult addModule(Module* M) {
     // We need a memory manager to allocate memory and resolve symbols for this
     // new module. Create one that resolves symbols by looking back into the
@@ -68,6 +85,26 @@ public:
     return compileModule(*M);
   }
 
+  /// Compile and load a module, its symbols being then available to
+  /// findSymbol.
+  ModuleHandleT addModule(std::unique_ptr<Module> M) {
+    auto H = cantFail(CompileLayer.addModule(std::move(M), createResolver()));
+
+    ModuleHandles.push_back(H);
+    return H;
+  }
+
+  /// Load an object compiled by the client, its symbols being then available
+  /// to findSymbol. Objects loaded together can refer to each other.
+  ModuleHandleT addObject(SimpleCompiler::CompileResult Obj) {
+    auto H = cantFail(ObjectLayer.addObject(
+        std::make_shared<SimpleCompiler::CompileResult>(std::move(Obj)),
+        createResolver()));
+
+    ModuleHandles.push_back(H);
+    return H;
+  }
+
   void removeModule(ModuleHandleT H) {
     ModuleHandles.erase(find(ModuleHandles, H));
     cantFail(CompileLayer.removeModule(H));
@@ -78,6 +115,17 @@ public:
   }
 
 private:
+  // Resolve symbols by looking back into the JIT.
+  std::shared_ptr<JITSymbolResolver> createResolver() {
+    return createLambdaResolver(
+        [&](const std::string &Name) {
+          if (auto Sym = findMangledSymbol(Name))
+            return Sym;
+          return JITSymbol(nullptr);
+        },
+        [](const std::string &S) { return nullptr; });
+  }
+
   std::string mangle(const std::string &Name) {
     std::string MangledName;
     {
@@ -41,10 +41,13 @@ public:
   virtual llvm::Function *codegen(BuildContext& context) override;
 };
 
+/// FibFunctionAST - fib on double, or on i64 to avoid the float<->int
+/// arithmetic of the toy language.
 class FibFunctionAST : public IFunctionHandle {
 public:
   std::string name;
-  FibFunctionAST(std::string _name) { this->name = _name; }
+  bool integer;
+  FibFunctionAST(std::string _name, bool _integer = false) { this->name = _name; this->integer = _integer; }
   virtual const std::string& getName() const { return this->name; }
   virtual llvm::Function *codegen(BuildContext& context) override;
 };
@@ -92,8 +95,9 @@ class MDCustomLocation : public MDNode {
 Function *FibFunctionAST::codegen(BuildContext& context) {
   // Transfer ownership of the prototype to the FunctionProtos map, but keep a
   // reference to it for use below.
-  std::vector<Type *> Doubles(1, Type::getDoubleTy(TheContext));
-  FunctionType *FT = FunctionType::get(Type::getDoubleTy(TheContext), Doubles, false);
+  Type *ValueTy = this->integer ? Type::getInt64Ty(TheContext) : Type::getDoubleTy(TheContext);
+  std::vector<Type *> Args(1, ValueTy);
+  FunctionType *FT = FunctionType::get(ValueTy, Args, false);
 
   Function *TheFunction = Function::Create(FT, Function::ExternalLinkage, this->getName() + "$impl", context.module);
   if (!TheFunction) return nullptr;
@@ -101,13 +105,15 @@ Function *FibFunctionAST::codegen(BuildContext& context) {
 
 
   SmallVector<Metadata *, 8> EltTys;
-  DIType *DI_DblTy = context.DI_builder->createBasicType("double", 64, dwarf::DW_ATE_float);
-  EltTys.push_back(DI_DblTy);
-  EltTys.push_back(DI_DblTy);
+  DIType *DI_ValueTy = this->integer
+    ? context.DI_builder->createBasicType("i64", 64, dwarf::DW_ATE_signed)
+    : context.DI_builder->createBasicType("double", 64, dwarf::DW_ATE_float);
+  EltTys.push_back(DI_ValueTy);
+  EltTys.push_back(DI_ValueTy);
   DISubroutineType* DI_func_type = context.DI_builder->createSubroutineType(context.DI_builder->getOrCreateTypeArray(EltTys));
 
 
-  DISubprogram* DI_func = context.DI_builder->createFunction(context.DI_scope, "fib", StringRef(), context.DI_file, 42, DI_func_type,
+  DISubprogram* DI_func = context.DI_builder->createFunction(context.DI_scope, this->getName(), StringRef(), context.DI_file, 42, DI_func_type,
     false /* internal linkage */, true /* definition */, 42, DINode::FlagPrototyped, false);
   TheFunction->setSubprogram(DI_func);
 
@@ -120,8 +126,8 @@ Function *FibFunctionAST::codegen(BuildContext& context) {
   ArgX->setName("x");
 
   // Get pointers to the constants.
-  Value *One = ConstantFP::get(Type::getDoubleTy(TheContext), 1);
-  Value *Two = ConstantFP::get(Type::getDoubleTy(TheContext), 2);
+  Value *One = this->integer ? ConstantInt::get(ValueTy, 1) : ConstantFP::get(ValueTy, 1);
+  Value *Two = this->integer ? ConstantInt::get(ValueTy, 2) : ConstantFP::get(ValueTy, 2);
 
   // Create the true_block.
   BasicBlock *RetBB = BasicBlock::Create(TheContext, "return", TheFunction);
@@ -129,7 +135,9 @@ Function *FibFunctionAST::codegen(BuildContext& context) {
   BasicBlock* RecurseBB = BasicBlock::Create(TheContext, "recurse", TheFunction);
 
   // Create the "if (arg <= 2) goto exitbb"
-  Instruction *CondInst = new FCmpInst(*BB, FCmpInst::FCMP_OLE, ArgX, Two, "cond");
+  Instruction *CondInst = this->integer
+    ? (Instruction*)new ICmpInst(*BB, ICmpInst::ICMP_SLE, ArgX, Two, "cond")
+    : (Instruction*)new FCmpInst(*BB, FCmpInst::FCMP_OLE, ArgX, Two, "cond");
   BranchInst::Create(RetBB, RecurseBB, CondInst, BB);
 
 
@@ -138,18 +146,21 @@ Function *FibFunctionAST::codegen(BuildContext& context) {
   // Create: ret int 1
   ReturnInst::Create(TheContext, One, RetBB);
 
+  Instruction::BinaryOps SubOp = this->integer ? Instruction::Sub : Instruction::FSub;
+  Instruction::BinaryOps AddOp = this->integer ? Instruction::Add : Instruction::FAdd;
+
   // create fib(x-1)
-  Instruction *Sub = BinaryOperator::CreateFSub(ArgX, One, "arg", RecurseBB);
+  Instruction *Sub = BinaryOperator::Create(SubOp, ArgX, One, "arg", RecurseBB);
   CallInst *CallFibX1 = CallInst::Create(TheFunction, Sub, "fibx1", RecurseBB);
   CallFibX1->setTailCall();
 
   // create fib(x-2)
-  Sub = BinaryOperator::CreateFSub(ArgX, Two, "arg", RecurseBB);
+  Sub = BinaryOperator::Create(SubOp, ArgX, Two, "arg", RecurseBB);
   CallInst *CallFibX2 = CallInst::Create(TheFunction, Sub, "fibx2", RecurseBB);
   CallFibX2->setTailCall();
 
   // fib(x-1)+fib(x-2)
-  Instruction *Sum = BinaryOperator::CreateFAdd(CallFibX1, CallFibX2,
+  Instruction *Sum = BinaryOperator::Create(AddOp, CallFibX1, CallFibX2,
     "addresult", RecurseBB);
 
   // Create the return instruction and add it to the basic block
@@ -226,6 +237,26 @@ int main() {
 
   printf("=> %lg, %lg\n", fib(40), r1);
 
+  // The same on i64: integer compare and arithmetic, no FP conversions.
+  FibFunctionAST* fib_i64_AST = new FibFunctionAST("fib_i64", true);
+  BuildContext fib_i64_build(TheJIT->createModule("fib_i64 module"));
+  fib_i64_build.buildFunction(fib_i64_AST);
+  TheJIT->compileModule(fib_i64_build.module);
+  fib_i64_build.finalize();
+
+  auto fib_i64_Sym = TheJIT->findSymbol("fib_i64$impl");
+  int64_t(*fib_i64)(int64_t) = (int64_t(*)(int64_t))(intptr_t)cantFail(fib_i64_Sym.getAddress());
+
+  c.Start();
+  double r3 = fib(40);
+  printf("fib(40) double: time %g\n", c.GetDiffFloat(Chrono::MS));
+
+  c.Start();
+  int64_t r4 = fib_i64(40);
+  printf("fib(40) i64: time %g\n", c.GetDiffFloat(Chrono::MS));
+
+  printf("=> %lg, %lld\n", r3, (long long)r4);
+
   getchar();
   return 0;
 }
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Smoke checks of the toy driver modes: run each input with the flags of its
+# mode and compare the output, errors included, with the expected one.
+#
+# usage: run.sh path/to/toy
+toy=${1:?usage: run.sh path/to/toy}
+dir=$(dirname "$0")
+failed=0
+
+check() {
+  expected=$1; shift
+  if "$toy" "$@" 2>&1 | diff -u "$dir/$expected" - > /dev/null; then
+    echo "ok      $*"
+  else
+    echo "FAILED  $*"
+    "$toy" "$@" 2>&1 | diff -u "$dir/$expected" -
+    failed=1
+  fi
+}
+
+# Memoization
+check memo.expected -tiered -auto-memo -memo-stats "$dir/memo.ks"
+
+# Tiering: interpreted, compiled at once, and compiled within a loop
+check tiers.expected -tiered -jit-threshold=1000 "$dir/tiers.ks"
+check tiers.expected -tiered -jit-threshold=0 "$dir/tiers.ks"
+check tiers.expected -tiered -jit-threshold=3 "$dir/tiers.ks"
+check tiers.expected -tiered -opt -jit-threshold=3 "$dir/tiers.ks"
+
+# Batch compile, on the pool and on one thread
+check batch.expected -batch "$dir/batch.ks"
+check batch.expected -batch -threads=1 "$dir/batch.ks"
+check batch.expected -batch -opt "$dir/batch.ks"
+
+exit $failed
@@ -1,21 +1,50 @@
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/Analysis/BasicAliasAnalysis.h"
 #include "llvm/Analysis/Passes.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/DIBuilder.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/ValueHandle.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Vectorize.h"
+#include <atomic>
 #include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <map>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 #include "KaleidoscopeJIT.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TOY_LEXER_SSE2 1
+#include <emmintrin.h>
+#endif
+
 
 using namespace llvm;
 using namespace llvm::orc;
@@ -88,24 +117,32 @@ namespace {
   class PrototypeAST;
   class ExprAST;
 }
-static LLVMContext TheContext;
-static IRBuilder<> Builder(TheContext);
+// The code generation state is per thread: in batch mode, each worker
+// generates code in its own context and module.
+static thread_local LLVMContext TheContext;
+static thread_local IRBuilder<> Builder(TheContext);
 struct DebugInfo {
   DICompileUnit *TheCU;
   DIType *DblTy;
+  DIType *Int64Ty;
+  DIType *ArrayTy;
   std::vector<DIScope *> LexicalBlocks;
 
   void emitLocation(ExprAST *AST);
   DIType *getDoubleTy();
-} KSDbgInfo;
+  DIType *getInt64Ty();
+  DIType *getArrayTy();
+  DIType *getType(Type *Ty);
+};
+static thread_local DebugInfo KSDbgInfo;
 
 struct SourceLocation {
   int Line;
   int Col;
 };
 static SourceLocation CurLoc;
-static SourceLocation LexLoc = { 1, 0 };
-const char* curChar = "# Compute the x'th fibonacci number.\n\
+
+static const char *DefaultSource = "# Compute the x'th fibonacci number.\n\
 def fib(x)\n\
 if x < 3 then\n\
   1\n\
@@ -114,111 +151,399 @@ fib(x - 1) + fib(x - 2)\n\
 \n\
 # This expression will compute the 40th number.\n\
 fib(10)";
-static int advance() {
-  int LastChar = *curChar;
-  if (LastChar)curChar++;
 
-  if (LastChar == '\n' || LastChar == '\r') {
-    LexLoc.Line++;
-    LexLoc.Col = 0;
-  }
-  else
-    LexLoc.Col++;
-  return LastChar;
+/// The lexer works over the whole input at once: a file is mmapped (or read
+/// in a single buffer) and tokens are views into it. The buffer is always
+/// null-terminated, the null character being the end of input.
+static std::unique_ptr<MemoryBuffer> LexBuffer;
+static const char *LexPtr;
+static const char *LexEnd;
+static const char *LexLineStart;
+static int LexLine = 1;
+
+static void setLexerInput(std::unique_ptr<MemoryBuffer> Buffer) {
+  LexBuffer = std::move(Buffer);
+  LexPtr = LexLineStart = LexBuffer->getBufferStart();
+  LexEnd = LexBuffer->getBufferEnd();
+  LexLine = 1;
 }
 
-static std::string IdentifierStr; // Filled in if tok_identifier
+static StringRef IdentifierStr; // Filled in if tok_identifier
 static double NumVal;             // Filled in if tok_number
 
-/// gettok - Return the next token from standard input.
-static int gettok() {
-  static int LastChar = ' ';
-
-  // Skip any whitespace.
-  while (isspace(LastChar))
-    LastChar = advance();
-
-  CurLoc = LexLoc;
-
-  if (isalpha(LastChar)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
-    IdentifierStr = LastChar;
-    while (isalnum((LastChar = advance())))
-      IdentifierStr += LastChar;
-
-    if (IdentifierStr == "def")
-      return tok_def;
-    if (IdentifierStr == "extern")
-      return tok_extern;
-    if (IdentifierStr == "if")
-      return tok_if;
-    if (IdentifierStr == "then")
-      return tok_then;
-    if (IdentifierStr == "else")
-      return tok_else;
-    if (IdentifierStr == "for")
-      return tok_for;
-    if (IdentifierStr == "in")
-      return tok_in;
-    if (IdentifierStr == "binary")
-      return tok_binary;
-    if (IdentifierStr == "unary")
-      return tok_unary;
-    if (IdentifierStr == "var")
-      return tok_var;
-    return tok_identifier;
-  }
-
-  if (isdigit(LastChar) || LastChar == '.') { // Number: [0-9.]+
-    std::string NumStr;
-    do {
-      NumStr += LastChar;
-      LastChar = advance();
-    } while (isdigit(LastChar) || LastChar == '.');
-
-    NumVal = strtod(NumStr.c_str(), nullptr);
-    return tok_number;
+//===----------------------------------------------------------------------===//
+// Character class scanning, 16 bytes at a time when SSE2 is available.
+//===----------------------------------------------------------------------===//
+
+static inline bool isSpaceChar(char C) {
+  return C == ' ' || (unsigned char)(C - '\t') <= '\r' - '\t';
+}
+
+static inline bool isIdentChar(char C) {
+  return (unsigned char)((C | 0x20) - 'a') < 26 || (unsigned char)(C - '0') < 10;
+}
+
+#ifdef TOY_LEXER_SSE2
+/// Mask of the bytes in [Lo, Lo + Count] (unsigned wrap-around compare).
+static inline __m128i inRange(__m128i V, char Lo, char Count) {
+  __m128i Offset = _mm_sub_epi8(V, _mm_set1_epi8(Lo));
+  return _mm_cmpeq_epi8(_mm_subs_epu8(Offset, _mm_set1_epi8(Count)),
+                        _mm_setzero_si128());
+}
+#endif
+
+/// Skip whitespace from LexPtr, keeping the line count and line start.
+static void skipSpaces() {
+#ifdef TOY_LEXER_SSE2
+  while (LexPtr + 16 <= LexEnd) {
+    __m128i V = _mm_loadu_si128((const __m128i *)LexPtr);
+    __m128i Space = _mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8(' ')),
+                                 inRange(V, '\t', '\r' - '\t'));
+    unsigned SpaceMask = _mm_movemask_epi8(Space);
+    unsigned NewLines =
+        _mm_movemask_epi8(_mm_cmpeq_epi8(V, _mm_set1_epi8('\n')));
+    unsigned Length = SpaceMask == 0xFFFF
+                          ? 16
+                          : countTrailingZeros(~SpaceMask & 0xFFFF);
+    NewLines &= (1u << Length) - 1;
+    if (NewLines) {
+      LexLine += countPopulation(NewLines);
+      LexLineStart = LexPtr + (31 - countLeadingZeros(NewLines)) + 1;
+    }
+    LexPtr += Length;
+    if (Length < 16)
+      return;
+  }
+#endif
+  for (; LexPtr < LexEnd && isSpaceChar(*LexPtr); LexPtr++) {
+    if (*LexPtr == '\n') {
+      LexLine++;
+      LexLineStart = LexPtr + 1;
+    }
+  }
+}
+
+/// Return the end of the identifier characters starting at Ptr.
+static const char *scanIdentifier(const char *Ptr) {
+#ifdef TOY_LEXER_SSE2
+  while (Ptr + 16 <= LexEnd) {
+    __m128i V = _mm_loadu_si128((const __m128i *)Ptr);
+    __m128i Alpha = inRange(_mm_or_si128(V, _mm_set1_epi8(0x20)), 'a', 25);
+    __m128i Digit = inRange(V, '0', 9);
+    unsigned Mask = _mm_movemask_epi8(_mm_or_si128(Alpha, Digit));
+    if (Mask != 0xFFFF)
+      return Ptr + countTrailingZeros(~Mask & 0xFFFF);
+    Ptr += 16;
   }
+#endif
+  while (Ptr < LexEnd && isIdentChar(*Ptr))
+    Ptr++;
+  return Ptr;
+}
 
-  if (LastChar == '#') {
-    // Comment until end of line.
-    do
-      LastChar = advance();
-    while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
+/// Return the end of the line starting at Ptr, on its '\n' or '\r'.
+static const char *scanLineEnd(const char *Ptr) {
+#ifdef TOY_LEXER_SSE2
+  while (Ptr + 16 <= LexEnd) {
+    __m128i V = _mm_loadu_si128((const __m128i *)Ptr);
+    unsigned Mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(V, _mm_set1_epi8('\n')),
+                     _mm_cmpeq_epi8(V, _mm_set1_epi8('\r'))));
+    if (Mask)
+      return Ptr + countTrailingZeros(Mask);
+    Ptr += 16;
+  }
+#endif
+  while (Ptr < LexEnd && *Ptr != '\n' && *Ptr != '\r')
+    Ptr++;
+  return Ptr;
+}
+
+/// Parse a [0-9.]+ token the way strtod does (it stops on a second '.'), with
+/// an exact fast path for the common short literals.
+static double parseNumber(StringRef Str) {
+  static const double Pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                 1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  uint64_t Mantissa = 0;
+  int Digits = 0, FracDigits = 0;
+  bool Dot = false, Exact = true;
+  for (char C : Str) {
+    if (C == '.') {
+      if (Dot)
+        break;
+      Dot = true;
+      continue;
+    }
+    if (++Digits > 15) {
+      Exact = false;
+      break;
+    }
+    Mantissa = Mantissa * 10 + (C - '0');
+    FracDigits += Dot;
+  }
+  if (Exact && Digits > 0)
+    return (double)Mantissa / Pow10[FracDigits];
+
+  SmallString<64> Copy(Str);
+  return strtod(Copy.c_str(), nullptr);
+}
 
-    if (LastChar != EOF)
-      return gettok();
+/// gettok - Return the next token from the input buffer.
+static int gettok() {
+  while (true) {
+    skipSpaces();
+    if (LexPtr >= LexEnd || *LexPtr != '#')
+      break;
+    // Comment until end of line.
+    LexPtr = scanLineEnd(LexPtr);
   }
 
-  // Check for end of file.  Don't eat the EOF.
-  if (LastChar == EOF)
+  CurLoc = {LexLine, (int)(LexPtr - LexLineStart) + 1};
+
+  // Check for end of file.
+  if (LexPtr >= LexEnd || *LexPtr == 0)
     return tok_eof;
 
+  const char *TokStart = LexPtr;
+  char C = *LexPtr;
+
+  if (isalpha((unsigned char)C)) { // identifier: [a-zA-Z][a-zA-Z0-9]*
+    LexPtr = scanIdentifier(LexPtr + 1);
+    IdentifierStr = StringRef(TokStart, LexPtr - TokStart);
+    return StringSwitch<int>(IdentifierStr)
+        .Case("def", tok_def)
+        .Case("extern", tok_extern)
+        .Case("if", tok_if)
+        .Case("then", tok_then)
+        .Case("else", tok_else)
+        .Case("for", tok_for)
+        .Case("in", tok_in)
+        .Case("binary", tok_binary)
+        .Case("unary", tok_unary)
+        .Case("var", tok_var)
+        .Default(tok_identifier);
+  }
+
+  if (isdigit((unsigned char)C) || C == '.') { // Number: [0-9.]+
+    do
+      LexPtr++;
+    while (LexPtr < LexEnd && (isdigit((unsigned char)*LexPtr) || *LexPtr == '.'));
+    NumVal = parseNumber(StringRef(TokStart, LexPtr - TokStart));
+    return tok_number;
+  }
+
   // Otherwise, just return the character as its ascii value.
-  int ThisChar = LastChar;
-  LastChar = advance();
-  return ThisChar;
+  LexPtr++;
+  return (unsigned char)C;
 }
 
 //===----------------------------------------------------------------------===//
 // Abstract Syntax Tree (aka Parse Tree)
 //===----------------------------------------------------------------------===//
+
+/// Symbol - An interned identifier, as a dense index in the symbol table.
+typedef unsigned Symbol;
+
+/// SymbolTable - Interns identifiers, so that names are compared and looked up
+/// as integers. Symbols live for the whole session, unlike the AST nodes.
+///
+/// Only the parser interns symbols, but names can be read from other threads
+/// meanwhile: they are stored in segments of doubling size which never move.
+class SymbolTable {
+  static const unsigned FirstSegmentBits = 10;
+
+  StringMap<Symbol> Ids;
+  std::atomic<StringRef *> Segments[32] = {};
+  unsigned NumNames = 0;
+
+  static unsigned getSegment(Symbol S) {
+    return Log2_32((S >> FirstSegmentBits) + 1);
+  }
+  static Symbol getSegmentStart(unsigned Segment) {
+    return ((1u << Segment) - 1) << FirstSegmentBits;
+  }
+
+public:
+  ~SymbolTable() {
+    for (auto &Segment : Segments)
+      delete[] Segment.load();
+  }
+
+  Symbol intern(StringRef Name) {
+    auto It = Ids.try_emplace(Name, NumNames);
+    if (It.second) {
+      unsigned Segment = getSegment(NumNames);
+      StringRef *Names = Segments[Segment].load(std::memory_order_relaxed);
+      if (!Names) {
+        Names = new StringRef[(1u << Segment) << FirstSegmentBits];
+        Segments[Segment].store(Names, std::memory_order_release);
+      }
+      Names[NumNames - getSegmentStart(Segment)] = It.first->first();
+      NumNames++;
+    }
+    return It.first->second;
+  }
+
+  StringRef getName(Symbol S) const {
+    unsigned Segment = getSegment(S);
+    return Segments[Segment].load(std::memory_order_acquire)
+        [S - getSegmentStart(Segment)];
+  }
+  unsigned size() const { return NumNames; }
+};
+static SymbolTable Symbols;
+
+/// ASTContext - Owns the expression nodes of the top-level item being parsed.
+/// Nodes are bump-allocated and never destroyed one by one: the whole tree is
+/// released at once by reset() after codegen. The heap allocation mode gives
+/// each node its own allocation instead, to benchmark the two.
+class ASTContext {
+  BumpPtrAllocator Arena;
+  std::vector<void *> HeapNodes;
+  bool OnHeap = false;
+
+public:
+  ASTContext() = default;
+  ASTContext(ASTContext &&) = default;
+  ~ASTContext() { reset(); }
+
+  void setHeapAllocation(bool Enable) {
+    reset();
+    OnHeap = Enable;
+  }
+
+  void *allocate(size_t Size, size_t Align) {
+    if (OnHeap) {
+      HeapNodes.push_back(::operator new(Size));
+      return HeapNodes.back();
+    }
+    return Arena.Allocate(Size, Align);
+  }
+
+  template <typename T, typename... ArgsT> T *create(ArgsT &&... Args) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "AST nodes are released without being destroyed");
+    return new (allocate(sizeof(T), alignof(T)))
+        T(std::forward<ArgsT>(Args)...);
+  }
+
+  template <typename T> ArrayRef<T> copyArray(ArrayRef<T> Elts) {
+    if (Elts.empty())
+      return ArrayRef<T>();
+    T *Copy = static_cast<T *>(allocate(sizeof(T) * Elts.size(), alignof(T)));
+    std::uninitialized_copy(Elts.begin(), Elts.end(), Copy);
+    return ArrayRef<T>(Copy, Elts.size());
+  }
+
+  void reset() {
+    for (void *Node : HeapNodes)
+      ::operator delete(Node);
+    HeapNodes.clear();
+    Arena.Reset();
+  }
+};
+static ASTContext TheAST;
+
+/// ScopedEnvironment - The bindings of the variables in scope, in a flat array
+/// indexed by symbol. Binding a variable saves the one it shadows on an undo
+/// stack, and leaving a scope unwinds the stack down to the scope mark, so
+/// entering and leaving scopes costs O(1) per variable.
+template <typename T> class ScopedEnvironment {
+  std::vector<T> Bindings;
+  std::vector<std::pair<Symbol, T>> Shadowed;
+  std::vector<size_t> ScopeMarks;
+
+public:
+  T lookup(Symbol S) const { return S < Bindings.size() ? Bindings[S] : T(); }
+
+  void bind(Symbol S, T Value) {
+    if (S >= Bindings.size())
+      Bindings.resize(std::max<size_t>(S + 1, Bindings.size() * 2), T());
+    Shadowed.push_back({S, Bindings[S]});
+    Bindings[S] = Value;
+  }
+
+  void pushScope() { ScopeMarks.push_back(Shadowed.size()); }
+
+  void popScope() {
+    unwind(ScopeMarks.back());
+    ScopeMarks.pop_back();
+  }
+
+  /// Drop all the scopes, including the ones left open by a codegen error.
+  void clear() {
+    unwind(0);
+    ScopeMarks.clear();
+  }
+
+private:
+  void unwind(size_t Mark) {
+    while (Shadowed.size() > Mark) {
+      Bindings[Shadowed.back().first] = Shadowed.back().second;
+      Shadowed.pop_back();
+    }
+  }
+};
+
+/// ValueType - The types of toy values. Arguments, results and variables are
+/// double unless annotated; expressions take the type of their operands.
+/// Arrays are contiguous doubles, passed as a (pointer, length) pair.
+enum ValueType : uint8_t { VT_Double, VT_Int64, VT_Array };
+
+static const char *getTypeName(ValueType Ty) {
+  switch (Ty) {
+  case VT_Double:
+    return "double";
+  case VT_Int64:
+    return "i64";
+  case VT_Array:
+    return "array";
+  }
+  llvm_unreachable("unknown value type");
+}
+
 namespace {
 
   raw_ostream &indent(raw_ostream &O, int size) {
     return O << std::string(size, ' ');
   }
 
-  /// ExprAST - Base class for all expression nodes.
+  /// ExprAST - Base class for all expression nodes. Nodes have no vtable:
+  /// codegen() and dump() dispatch on the node kind.
   class ExprAST {
+  public:
+    enum ExprKind : uint8_t {
+      EK_Number,
+      EK_Variable,
+      EK_Unary,
+      EK_Binary,
+      EK_Call,
+      EK_If,
+      EK_For,
+      EK_Var,
+      EK_Array,
+      EK_Length,
+      EK_Index,
+      EK_Seq
+    };
+
+  private:
+    const ExprKind Kind;
     SourceLocation Loc;
 
+  protected:
+    ExprAST(ExprKind Kind, SourceLocation Loc = CurLoc)
+      : Kind(Kind), Loc(Loc) {}
+
   public:
-    ExprAST(SourceLocation Loc = CurLoc) : Loc(Loc) {}
-    virtual ~ExprAST() {}
-    virtual Value *codegen() = 0;
+    ExprKind getKind() const { return Kind; }
+    SourceLocation getLoc() const { return Loc; }
+    Value *codegen();
     int getLine() const { return Loc.Line; }
     int getCol() const { return Loc.Col; }
-    virtual raw_ostream &dump(raw_ostream &out, int ind) {
+    raw_ostream &dump(raw_ostream &out, int ind);
+    raw_ostream &dumpLoc(raw_ostream &out) {
       return out << ':' << getLine() << ':' << getCol() << '\n';
     }
   };
@@ -228,38 +553,47 @@ namespace {
     double Val;
 
   public:
-    NumberExprAST(double Val) : Val(Val) {}
-    raw_ostream &dump(raw_ostream &out, int ind) override {
-      return ExprAST::dump(out << Val, ind);
+    NumberExprAST(double Val, SourceLocation Loc = CurLoc)
+      : ExprAST(EK_Number, Loc), Val(Val) {}
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Number; }
+    double getValue() const { return Val; }
+    raw_ostream &dump(raw_ostream &out, int ind) {
+      return dumpLoc(out << Val);
     }
-    Value *codegen() override;
+    Value *codegen();
   };
 
   /// VariableExprAST - Expression class for referencing a variable, like "a".
   class VariableExprAST : public ExprAST {
-    std::string Name;
+    Symbol Name;
 
   public:
-    VariableExprAST(SourceLocation Loc, const std::string &Name)
-      : ExprAST(Loc), Name(Name) {}
-    const std::string &getName() const { return Name; }
-    Value *codegen() override;
-    raw_ostream &dump(raw_ostream &out, int ind) override {
-      return ExprAST::dump(out << Name, ind);
+    VariableExprAST(SourceLocation Loc, Symbol Name)
+      : ExprAST(EK_Variable, Loc), Name(Name) {}
+    static bool classof(const ExprAST *E) {
+      return E->getKind() == EK_Variable;
+    }
+    Symbol getName() const { return Name; }
+    Value *codegen();
+    raw_ostream &dump(raw_ostream &out, int ind) {
+      return dumpLoc(out << Symbols.getName(Name));
     }
   };
 
   /// UnaryExprAST - Expression class for a unary operator.
   class UnaryExprAST : public ExprAST {
     char Opcode;
-    std::unique_ptr<ExprAST> Operand;
+    ExprAST *Operand;
 
   public:
-    UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
-      : Opcode(Opcode), Operand(std::move(Operand)) {}
-    Value *codegen() override;
-    raw_ostream &dump(raw_ostream &out, int ind) override {
-      ExprAST::dump(out << "unary" << Opcode, ind);
+    UnaryExprAST(char Opcode, ExprAST *Operand, SourceLocation Loc = CurLoc)
+      : ExprAST(EK_Unary, Loc), Opcode(Opcode), Operand(Operand) {}
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Unary; }
+    char getOpcode() const { return Opcode; }
+    ExprAST *getOperand() const { return Operand; }
+    Value *codegen();
+    raw_ostream &dump(raw_ostream &out, int ind) {
+      dumpLoc(out << "unary" << Opcode);
       Operand->dump(out, ind + 1);
       return out;
     }
@@ -268,15 +602,18 @@ namespace {
   /// BinaryExprAST - Expression class for a binary operator.
   class BinaryExprAST : public ExprAST {
     char Op;
-    std::unique_ptr<ExprAST> LHS, RHS;
+    ExprAST *LHS, *RHS;
 
   public:
-    BinaryExprAST(SourceLocation Loc, char Op, std::unique_ptr<ExprAST> LHS,
-      std::unique_ptr<ExprAST> RHS)
-      : ExprAST(Loc), Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-    Value *codegen() override;
-    raw_ostream &dump(raw_ostream &out, int ind) override {
-      ExprAST::dump(out << "binary" << Op, ind);
+    BinaryExprAST(SourceLocation Loc, char Op, ExprAST *LHS, ExprAST *RHS)
+      : ExprAST(EK_Binary, Loc), Op(Op), LHS(LHS), RHS(RHS) {}
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Binary; }
+    char getOp() const { return Op; }
+    ExprAST *getLHS() const { return LHS; }
+    ExprAST *getRHS() const { return RHS; }
+    Value *codegen();
+    raw_ostream &dump(raw_ostream &out, int ind) {
+      dumpLoc(out << "binary" << Op);
       LHS->dump(indent(out, ind) << "LHS:", ind + 1);
       RHS->dump(indent(out, ind) << "RHS:", ind + 1);
       return out;
@@ -285,34 +622,93 @@ namespace {
 
   /// CallExprAST - Expression class for function calls.
   class CallExprAST : public ExprAST {
-    std::string Callee;
-    std::vector<std::unique_ptr<ExprAST>> Args;
+    Symbol Callee;
+    ArrayRef<ExprAST *> Args;
 
   public:
-    CallExprAST(SourceLocation Loc, const std::string &Callee,
-      std::vector<std::unique_ptr<ExprAST>> Args)
-      : ExprAST(Loc), Callee(Callee), Args(std::move(Args)) {}
-    Value *codegen() override;
-    raw_ostream &dump(raw_ostream &out, int ind) override {
-      ExprAST::dump(out << "call " << Callee, ind);
-      for (const auto &Arg : Args)
+    CallExprAST(SourceLocation Loc, Symbol Callee, ArrayRef<ExprAST *> Args)
+      : ExprAST(EK_Call, Loc), Callee(Callee), Args(Args) {}
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Call; }
+    Symbol getCallee() const { return Callee; }
+    ArrayRef<ExprAST *> getArgs() const { return Args; }
+    Value *codegen();
+    raw_ostream &dump(raw_ostream &out, int ind) {
+      dumpLoc(out << "call " << Symbols.getName(Callee));
+      for (ExprAST *Arg : Args)
         Arg->dump(indent(out, ind + 1), ind + 1);
       return out;
     }
   };
 
+  /// ArrayExprAST - Expression class for array(length), a new array of
+  /// doubles set to 0.0.
+  class ArrayExprAST : public ExprAST {
+    ExprAST *Length;
+
+  public:
+    ArrayExprAST(SourceLocation Loc, ExprAST *Length)
+      : ExprAST(EK_Array, Loc), Length(Length) {}
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Array; }
+    ExprAST *getLength() const { return Length; }
+    Value *codegen();
+    raw_ostream &dump(raw_ostream &out, int ind) {
+      dumpLoc(out << "array");
+      Length->dump(indent(out, ind) << "Length:", ind + 1);
+      return out;
+    }
+  };
+
+  /// LengthExprAST - Expression class for len(array).
+  class LengthExprAST : public ExprAST {
+    ExprAST *Array;
+
+  public:
+    LengthExprAST(SourceLocation Loc, ExprAST *Array)
+      : ExprAST(EK_Length, Loc), Array(Array) {}
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Length; }
+    ExprAST *getArray() const { return Array; }
+    Value *codegen();
+    raw_ostream &dump(raw_ostream &out, int ind) {
+      dumpLoc(out << "len");
+      Array->dump(indent(out, ind) << "Array:", ind + 1);
+      return out;
+    }
+  };
+
+  /// IndexExprAST - Expression class for array[index], which reads an element
+  /// or, as the destination of '=', writes it.
+  class IndexExprAST : public ExprAST {
+    ExprAST *Array, *Index;
+
+  public:
+    IndexExprAST(SourceLocation Loc, ExprAST *Array, ExprAST *Index)
+      : ExprAST(EK_Index, Loc), Array(Array), Index(Index) {}
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Index; }
+    ExprAST *getArray() const { return Array; }
+    ExprAST *getIndex() const { return Index; }
+    Value *codegen();
+    raw_ostream &dump(raw_ostream &out, int ind) {
+      dumpLoc(out << "index");
+      Array->dump(indent(out, ind) << "Array:", ind + 1);
+      Index->dump(indent(out, ind) << "Index:", ind + 1);
+      return out;
+    }
+  };
+
   /// IfExprAST - Expression class for if/then/else.
   class IfExprAST : public ExprAST {
-    std::unique_ptr<ExprAST> Cond, Then, Else;
+    ExprAST *Cond, *Then, *Else;
 
   public:
-    IfExprAST(SourceLocation Loc, std::unique_ptr<ExprAST> Cond,
-      std::unique_ptr<ExprAST> Then, std::unique_ptr<ExprAST> Else)
-      : ExprAST(Loc), Cond(std::move(Cond)), Then(std::move(Then)),
-      Else(std::move(Else)) {}
-    Value *codegen() override;
-    raw_ostream &dump(raw_ostream &out, int ind) override {
-      ExprAST::dump(out << "if", ind);
+    IfExprAST(SourceLocation Loc, ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+      : ExprAST(EK_If, Loc), Cond(Cond), Then(Then), Else(Else) {}
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_If; }
+    ExprAST *getCond() const { return Cond; }
+    ExprAST *getThen() const { return Then; }
+    ExprAST *getElse() const { return Else; }
+    Value *codegen();
+    raw_ostream &dump(raw_ostream &out, int ind) {
+      dumpLoc(out << "if");
       Cond->dump(indent(out, ind) << "Cond:", ind + 1);
       Then->dump(indent(out, ind) << "Then:", ind + 1);
       Else->dump(indent(out, ind) << "Else:", ind + 1);
@@ -322,64 +718,191 @@ namespace {
 
   /// ForExprAST - Expression class for for/in.
   class ForExprAST : public ExprAST {
-    std::string VarName;
-    std::unique_ptr<ExprAST> Start, End, Step, Body;
+    Symbol VarName;
+    ValueType VarType;
+    ExprAST *Start, *End, *Step, *Body;
 
   public:
-    ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
-      std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
-      std::unique_ptr<ExprAST> Body)
-      : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-      Step(std::move(Step)), Body(std::move(Body)) {}
-    Value *codegen() override;
-    raw_ostream &dump(raw_ostream &out, int ind) override {
-      ExprAST::dump(out << "for", ind);
+    ForExprAST(Symbol VarName, ValueType VarType, ExprAST *Start,
+      ExprAST *End, ExprAST *Step, ExprAST *Body, SourceLocation Loc = CurLoc)
+      : ExprAST(EK_For, Loc), VarName(VarName), VarType(VarType),
+      Start(Start), End(End), Step(Step), Body(Body) {}
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_For; }
+    Symbol getVarName() const { return VarName; }
+    ValueType getVarType() const { return VarType; }
+    ExprAST *getStart() const { return Start; }
+    ExprAST *getEnd() const { return End; }
+    ExprAST *getStep() const { return Step; }
+    ExprAST *getBody() const { return Body; }
+    Value *codegen();
+    Value *codegenBoundsCheck(unsigned Var,
+      SmallVectorImpl<IndexExprAST *> &Accesses);
+    bool codegenLoop(unsigned Var, BasicBlock *LoopBB, BasicBlock *AfterBB,
+      bool Vectorize);
+    raw_ostream &dump(raw_ostream &out, int ind) {
+      dumpLoc(out << "for " << getTypeName(VarType));
       Start->dump(indent(out, ind) << "Cond:", ind + 1);
       End->dump(indent(out, ind) << "End:", ind + 1);
-      Step->dump(indent(out, ind) << "Step:", ind + 1);
+      if (Step)
+        Step->dump(indent(out, ind) << "Step:", ind + 1);
       Body->dump(indent(out, ind) << "Body:", ind + 1);
       return out;
     }
   };
 
+  /// VarBinding - One 'type name = init' of a var/in expression, Init may be
+  /// null.
+  struct VarBinding {
+    Symbol Name;
+    ExprAST *Init;
+    ValueType Type;
+  };
+
   /// VarExprAST - Expression class for var/in
   class VarExprAST : public ExprAST {
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
-    std::unique_ptr<ExprAST> Body;
+    ArrayRef<VarBinding> VarNames;
+    ExprAST *Body;
 
   public:
-    VarExprAST(
-      std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
-      std::unique_ptr<ExprAST> Body)
-      : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
-    Value *codegen() override;
-    raw_ostream &dump(raw_ostream &out, int ind) override {
-      ExprAST::dump(out << "var", ind);
-      for (const auto &NamedVar : VarNames)
-        NamedVar.second->dump(indent(out, ind) << NamedVar.first << ':', ind + 1);
+    VarExprAST(ArrayRef<VarBinding> VarNames, ExprAST *Body,
+      SourceLocation Loc = CurLoc)
+      : ExprAST(EK_Var, Loc), VarNames(VarNames), Body(Body) {}
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Var; }
+    ArrayRef<VarBinding> getVarNames() const { return VarNames; }
+    ExprAST *getBody() const { return Body; }
+    Value *codegen();
+    raw_ostream &dump(raw_ostream &out, int ind) {
+      dumpLoc(out << "var");
+      for (const VarBinding &NamedVar : VarNames)
+        if (NamedVar.Init)
+          NamedVar.Init->dump(indent(out, ind)
+                                << getTypeName(NamedVar.Type) << ' '
+                                << Symbols.getName(NamedVar.Name) << ':',
+                              ind + 1);
       Body->dump(indent(out, ind) << "Body:", ind + 1);
       return out;
     }
   };
 
+  /// SeqExprAST - Expressions evaluated in order, for the value of the last
+  /// one. Not produced by the parser: constant folding builds it when
+  /// unrolling loops.
+  class SeqExprAST : public ExprAST {
+    ArrayRef<ExprAST *> Exprs;
+
+  public:
+    SeqExprAST(ArrayRef<ExprAST *> Exprs, SourceLocation Loc)
+      : ExprAST(EK_Seq, Loc), Exprs(Exprs) {}
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Seq; }
+    ArrayRef<ExprAST *> getExprs() const { return Exprs; }
+    Value *codegen();
+    raw_ostream &dump(raw_ostream &out, int ind) {
+      dumpLoc(out << "seq");
+      for (ExprAST *E : Exprs)
+        E->dump(indent(out, ind + 1), ind + 1);
+      return out;
+    }
+  };
+
+  Value *ExprAST::codegen() {
+    switch (Kind) {
+    case EK_Number:
+      return cast<NumberExprAST>(this)->codegen();
+    case EK_Variable:
+      return cast<VariableExprAST>(this)->codegen();
+    case EK_Unary:
+      return cast<UnaryExprAST>(this)->codegen();
+    case EK_Binary:
+      return cast<BinaryExprAST>(this)->codegen();
+    case EK_Call:
+      return cast<CallExprAST>(this)->codegen();
+    case EK_If:
+      return cast<IfExprAST>(this)->codegen();
+    case EK_For:
+      return cast<ForExprAST>(this)->codegen();
+    case EK_Var:
+      return cast<VarExprAST>(this)->codegen();
+    case EK_Array:
+      return cast<ArrayExprAST>(this)->codegen();
+    case EK_Length:
+      return cast<LengthExprAST>(this)->codegen();
+    case EK_Index:
+      return cast<IndexExprAST>(this)->codegen();
+    case EK_Seq:
+      return cast<SeqExprAST>(this)->codegen();
+    }
+    llvm_unreachable("unknown expression kind");
+  }
+
+  raw_ostream &ExprAST::dump(raw_ostream &out, int ind) {
+    switch (Kind) {
+    case EK_Number:
+      return cast<NumberExprAST>(this)->dump(out, ind);
+    case EK_Variable:
+      return cast<VariableExprAST>(this)->dump(out, ind);
+    case EK_Unary:
+      return cast<UnaryExprAST>(this)->dump(out, ind);
+    case EK_Binary:
+      return cast<BinaryExprAST>(this)->dump(out, ind);
+    case EK_Call:
+      return cast<CallExprAST>(this)->dump(out, ind);
+    case EK_If:
+      return cast<IfExprAST>(this)->dump(out, ind);
+    case EK_For:
+      return cast<ForExprAST>(this)->dump(out, ind);
+    case EK_Var:
+      return cast<VarExprAST>(this)->dump(out, ind);
+    case EK_Array:
+      return cast<ArrayExprAST>(this)->dump(out, ind);
+    case EK_Length:
+      return cast<LengthExprAST>(this)->dump(out, ind);
+    case EK_Index:
+      return cast<IndexExprAST>(this)->dump(out, ind);
+    case EK_Seq:
+      return cast<SeqExprAST>(this)->dump(out, ind);
+    }
+    llvm_unreachable("unknown expression kind");
+  }
+
   /// PrototypeAST - This class represents the "prototype" for a function,
   /// which captures its name, and its argument names (thus implicitly the number
   /// of arguments the function takes), as well as if it is an operator.
+  /// Prototypes outlive the AST context: they are kept in FunctionProtos to
+  /// declare the function in the following modules.
   class PrototypeAST {
     std::string Name;
-    std::vector<std::string> Args;
+    std::vector<Symbol> Args;
+    std::vector<ValueType> ArgTypes;
+    ValueType ResultType;
     bool IsOperator;
+    bool Pure = false;   // Set once the body is analyzed, see isPureFunction.
+    bool Memo = false;   // Results are cached in a memo table.
     unsigned Precedence; // Precedence if a binary op.
     int Line;
 
   public:
     PrototypeAST(SourceLocation Loc, const std::string &Name,
-      std::vector<std::string> Args, bool IsOperator = false,
-      unsigned Prec = 0)
-      : Name(Name), Args(std::move(Args)), IsOperator(IsOperator),
-      Precedence(Prec), Line(Loc.Line) {}
+      std::vector<Symbol> Args, std::vector<ValueType> ArgTypes,
+      ValueType ResultType, bool IsOperator = false, unsigned Prec = 0)
+      : Name(Name), Args(std::move(Args)), ArgTypes(std::move(ArgTypes)),
+      ResultType(ResultType), IsOperator(IsOperator), Precedence(Prec),
+      Line(Loc.Line) {}
     Function *codegen();
     const std::string &getName() const { return Name; }
+    ArrayRef<Symbol> getArgs() const { return Args; }
+    ArrayRef<ValueType> getArgTypes() const { return ArgTypes; }
+    ValueType getResultType() const { return ResultType; }
+
+    /// isTyped - Whether the signature is not all double.
+    bool isTyped() const {
+      return ResultType != VT_Double ||
+        any_of(ArgTypes, [](ValueType Ty) { return Ty != VT_Double; });
+    }
+
+    /// hasArrays - Whether the function takes or returns arrays.
+    bool hasArrays() const {
+      return ResultType == VT_Array || is_contained(ArgTypes, VT_Array);
+    }
 
     bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
     bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
@@ -391,18 +914,25 @@ namespace {
 
     unsigned getBinaryPrecedence() const { return Precedence; }
     int getLine() const { return Line; }
+
+    bool isPure() const { return Pure; }
+    void setPure(bool P) { Pure = P; }
+    bool isMemo() const { return Memo; }
+    void setMemo(bool M) { Memo = M; }
   };
 
   /// FunctionAST - This class represents a function definition itself.
+  /// The body is owned by the AST context.
   class FunctionAST {
     std::unique_ptr<PrototypeAST> Proto;
-    std::unique_ptr<ExprAST> Body;
+    ExprAST *Body;
 
   public:
-    FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-      std::unique_ptr<ExprAST> Body)
-      : Proto(std::move(Proto)), Body(std::move(Body)) {}
+    FunctionAST(std::unique_ptr<PrototypeAST> Proto, ExprAST *Body)
+      : Proto(std::move(Proto)), Body(Body) {}
     Function *codegen();
+    const PrototypeAST &getProto() const { return *Proto; }
+    ExprAST *getBody() const { return Body; }
     raw_ostream &dump(raw_ostream &out, int ind) {
       indent(out, ind) << "FunctionAST\n";
       ++ind;
@@ -423,8 +953,8 @@ static int CurTok;
 static int getNextToken() { return CurTok = gettok(); }
 
 /// BinopPrecedence - This holds the precedence for each binary operator that is
-/// defined.
-static std::map<char, int> BinopPrecedence;
+/// defined, 0 for the others.
+static int BinopPrecedence[256];
 
 /// GetTokPrecedence - Get the precedence of the pending binary operator token.
 static int GetTokPrecedence() {
@@ -439,7 +969,7 @@ static int GetTokPrecedence() {
 }
 
 /// LogError* - These are little helper functions for error handling.
-std::unique_ptr<ExprAST> LogError(const char *Str) {
+ExprAST *LogError(const char *Str) {
   fprintf(stderr, "Error: %s\n", Str);
   return nullptr;
 }
@@ -449,17 +979,54 @@ std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
   return nullptr;
 }
 
-static std::unique_ptr<ExprAST> ParseExpression();
+std::unique_ptr<FunctionAST> LogErrorF(const char *Str) {
+  LogError(Str);
+  return nullptr;
+}
+
+static ExprAST *ParseExpression();
+static ExprAST *foldConstants(ExprAST *Body);
+static bool isPureFunction(const PrototypeAST &P, ExprAST *Body);
+static bool keepsPurity(const PrototypeAST &P);
+static bool isMemoCandidate(const PrototypeAST &P, ExprAST *Body);
+
+/// parseTypeName - Whether Word names a type, which is then stored in Ty.
+static bool parseTypeName(StringRef Word, ValueType &Ty) {
+  if (Word == "double")
+    Ty = VT_Double;
+  else if (Word == "i64")
+    Ty = VT_Int64;
+  else if (Word == "array")
+    Ty = VT_Array;
+  else
+    return false;
+  return true;
+}
+
+/// typedname ::= type? identifier
+/// A type name is an annotation only when followed by an identifier, so that
+/// 'double', 'i64' and 'array' remain valid names. CurTok is the first
+/// identifier.
+static Symbol ParseTypedName(ValueType &Ty) {
+  StringRef Name = IdentifierStr;
+  getNextToken(); // eat identifier.
+  Ty = VT_Double;
+  if (CurTok == tok_identifier && parseTypeName(Name, Ty)) {
+    Name = IdentifierStr;
+    getNextToken(); // eat identifier.
+  }
+  return Symbols.intern(Name);
+}
 
 /// numberexpr ::= number
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-  auto Result = llvm::make_unique<NumberExprAST>(NumVal);
+static ExprAST *ParseNumberExpr() {
+  auto Result = TheAST.create<NumberExprAST>(NumVal);
   getNextToken(); // consume the number
-  return std::move(Result);
+  return Result;
 }
 
 /// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExprAST> ParseParenExpr() {
+static ExprAST *ParseParenExpr() {
   getNextToken(); // eat (.
   auto V = ParseExpression();
   if (!V)
@@ -471,26 +1038,43 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
   return V;
 }
 
+/// indexexpr ::= '[' expression ']'
+static ExprAST *ParseIndexExpr(ExprAST *Array) {
+  SourceLocation IndexLoc = CurLoc;
+  getNextToken(); // eat [.
+  auto Index = ParseExpression();
+  if (!Index)
+    return nullptr;
+
+  if (CurTok != ']')
+    return LogError("expected ']'");
+  getNextToken(); // eat ].
+  return TheAST.create<IndexExprAST>(IndexLoc, Array, Index);
+}
+
 /// identifierexpr
-///   ::= identifier
-///   ::= identifier '(' expression* ')'
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-  std::string IdName = IdentifierStr;
+///   ::= identifier indexexpr?
+///   ::= identifier '(' expression* ')' indexexpr?
+/// The calls of 'array' and 'len' are the builtin array operations.
+static ExprAST *ParseIdentifierExpr() {
+  Symbol IdName = Symbols.intern(IdentifierStr);
 
   SourceLocation LitLoc = CurLoc;
 
   getNextToken(); // eat identifier.
 
-  if (CurTok != '(') // Simple variable ref.
-    return llvm::make_unique<VariableExprAST>(LitLoc, IdName);
+  if (CurTok != '(') { // Simple variable ref.
+    auto Var = TheAST.create<VariableExprAST>(LitLoc, IdName);
+    return CurTok == '[' ? ParseIndexExpr(Var) : Var;
+  }
 
   // Call.
   getNextToken(); // eat (
-  std::vector<std::unique_ptr<ExprAST>> Args;
+  SmallVector<ExprAST *, 8> Args;
   if (CurTok != ')') {
     while (1) {
       if (auto Arg = ParseExpression())
-        Args.push_back(std::move(Arg));
+        Args.push_back(Arg);
       else
         return nullptr;
 
@@ -506,11 +1090,25 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
   // Eat the ')'.
   getNextToken();
 
-  return llvm::make_unique<CallExprAST>(LitLoc, IdName, std::move(Args));
+  ExprAST *Call;
+  StringRef Callee = Symbols.getName(IdName);
+  if (Callee == "array" || Callee == "len") {
+    if (Args.size() != 1)
+      return LogError("array() and len() take one argument");
+    if (Callee == "array")
+      Call = TheAST.create<ArrayExprAST>(LitLoc, Args[0]);
+    else
+      Call = TheAST.create<LengthExprAST>(LitLoc, Args[0]);
+  }
+  else {
+    Call = TheAST.create<CallExprAST>(LitLoc, IdName,
+      TheAST.copyArray<ExprAST *>(Args));
+  }
+  return CurTok == '[' ? ParseIndexExpr(Call) : Call;
 }
 
 /// ifexpr ::= 'if' expression 'then' expression 'else' expression
-static std::unique_ptr<ExprAST> ParseIfExpr() {
+static ExprAST *ParseIfExpr() {
   SourceLocation IfLoc = CurLoc;
 
   getNextToken(); // eat the if.
@@ -537,19 +1135,20 @@ static std::unique_ptr<ExprAST> ParseIfExpr() {
   if (!Else)
     return nullptr;
 
-  return llvm::make_unique<IfExprAST>(IfLoc, std::move(Cond), std::move(Then),
-    std::move(Else));
+  return TheAST.create<IfExprAST>(IfLoc, Cond, Then, Else);
 }
 
-/// forexpr ::= 'for' identifier '=' expr ',' expr (',' expr)? 'in' expression
-static std::unique_ptr<ExprAST> ParseForExpr() {
+/// forexpr ::= 'for' typedname '=' expr ',' expr (',' expr)? 'in' expression
+static ExprAST *ParseForExpr() {
   getNextToken(); // eat the for.
 
   if (CurTok != tok_identifier)
     return LogError("expected identifier after for");
 
-  std::string IdName = IdentifierStr;
-  getNextToken(); // eat identifier.
+  ValueType VarType;
+  Symbol IdName = ParseTypedName(VarType);
+  if (VarType == VT_Array)
+    return LogError("expected a number variable after for");
 
   if (CurTok != '=')
     return LogError("expected '=' after for");
@@ -567,7 +1166,7 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
     return nullptr;
 
   // The step value is optional.
-  std::unique_ptr<ExprAST> Step;
+  ExprAST *Step = nullptr;
   if (CurTok == ',') {
     getNextToken();
     Step = ParseExpression();
@@ -583,27 +1182,26 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
   if (!Body)
     return nullptr;
 
-  return llvm::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End),
-    std::move(Step), std::move(Body));
+  return TheAST.create<ForExprAST>(IdName, VarType, Start, End, Step, Body);
 }
 
-/// varexpr ::= 'var' identifier ('=' expression)?
-//                    (',' identifier ('=' expression)?)* 'in' expression
-static std::unique_ptr<ExprAST> ParseVarExpr() {
+/// varexpr ::= 'var' typedname ('=' expression)?
+//                    (',' typedname ('=' expression)?)* 'in' expression
+static ExprAST *ParseVarExpr() {
   getNextToken(); // eat the var.
 
-  std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+  SmallVector<VarBinding, 4> VarNames;
 
   // At least one variable name is required.
   if (CurTok != tok_identifier)
     return LogError("expected identifier after var");
 
   while (1) {
-    std::string Name = IdentifierStr;
-    getNextToken(); // eat identifier.
+    ValueType Type;
+    Symbol Name = ParseTypedName(Type);
 
     // Read the optional initializer.
-    std::unique_ptr<ExprAST> Init = nullptr;
+    ExprAST *Init = nullptr;
     if (CurTok == '=') {
       getNextToken(); // eat the '='.
 
@@ -612,7 +1210,7 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
         return nullptr;
     }
 
-    VarNames.push_back(std::make_pair(Name, std::move(Init)));
+    VarNames.push_back({Name, Init, Type});
 
     // End of var list, exit loop.
     if (CurTok != ',')
@@ -632,7 +1230,8 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
   if (!Body)
     return nullptr;
 
-  return llvm::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+  return TheAST.create<VarExprAST>(TheAST.copyArray<VarBinding>(VarNames),
+    Body);
 }
 
 /// primary
@@ -642,7 +1241,7 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
 ///   ::= ifexpr
 ///   ::= forexpr
 ///   ::= varexpr
-static std::unique_ptr<ExprAST> ParsePrimary() {
+static ExprAST *ParsePrimary() {
   switch (CurTok) {
   default:
     return LogError("unknown token when expecting an expression");
@@ -664,7 +1263,7 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
 /// unary
 ///   ::= primary
 ///   ::= '!' unary
-static std::unique_ptr<ExprAST> ParseUnary() {
+static ExprAST *ParseUnary() {
   // If the current token is not an operator, it must be a primary expr.
   if (!isascii(CurTok) || CurTok == '(' || CurTok == ',')
     return ParsePrimary();
@@ -673,14 +1272,13 @@ static std::unique_ptr<ExprAST> ParseUnary() {
   int Opc = CurTok;
   getNextToken();
   if (auto Operand = ParseUnary())
-    return llvm::make_unique<UnaryExprAST>(Opc, std::move(Operand));
+    return TheAST.create<UnaryExprAST>(Opc, Operand);
   return nullptr;
 }
 
 /// binoprhs
 ///   ::= ('+' unary)*
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-  std::unique_ptr<ExprAST> LHS) {
+static ExprAST *ParseBinOpRHS(int ExprPrec, ExprAST *LHS) {
   // If this is a binop, find its precedence.
   while (1) {
     int TokPrec = GetTokPrecedence();
@@ -704,32 +1302,31 @@ static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
     // the pending operator take RHS as its LHS.
     int NextPrec = GetTokPrecedence();
     if (TokPrec < NextPrec) {
-      RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
+      RHS = ParseBinOpRHS(TokPrec + 1, RHS);
       if (!RHS)
         return nullptr;
     }
 
     // Merge LHS/RHS.
-    LHS = llvm::make_unique<BinaryExprAST>(BinLoc, BinOp, std::move(LHS),
-      std::move(RHS));
+    LHS = TheAST.create<BinaryExprAST>(BinLoc, BinOp, LHS, RHS);
   }
 }
 
 /// expression
 ///   ::= unary binoprhs
 ///
-static std::unique_ptr<ExprAST> ParseExpression() {
+static ExprAST *ParseExpression() {
   auto LHS = ParseUnary();
   if (!LHS)
     return nullptr;
 
-  return ParseBinOpRHS(0, std::move(LHS));
+  return ParseBinOpRHS(0, LHS);
 }
 
 /// prototype
-///   ::= id '(' id* ')'
-///   ::= binary LETTER number? (id, id)
-///   ::= unary LETTER (id)
+///   ::= 'memo'? type? id '(' typedname* ')'
+///   ::= 'memo'? type? binary LETTER number? (typedname, typedname)
+///   ::= 'memo'? type? unary LETTER (typedname)
 static std::unique_ptr<PrototypeAST> ParsePrototype() {
   std::string FnName;
 
@@ -738,11 +1335,35 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
   unsigned Kind = 0; // 0 = identifier, 1 = unary, 2 = binary.
   unsigned BinaryPrecedence = 30;
 
+  // The memo attribute, unless 'memo' is the function name itself.
+  bool Memo = false;
+  if (CurTok == tok_identifier && IdentifierStr == "memo") {
+    getNextToken(); // eat memo.
+    if (CurTok == '(')
+      FnName = "memo";
+    else
+      Memo = true;
+  }
+
+  // The result type, unless the type name is the function name itself.
+  ValueType ResultType = VT_Double;
+  if (FnName.empty() && CurTok == tok_identifier &&
+      parseTypeName(IdentifierStr, ResultType)) {
+    StringRef Word = IdentifierStr;
+    getNextToken(); // eat the type.
+    if (CurTok == '(') {
+      FnName = Word.str();
+      ResultType = VT_Double;
+    }
+  }
+
   switch (CurTok) {
   default:
+    if (!FnName.empty())
+      break; // Already read.
     return LogErrorP("Expected function name in prototype");
   case tok_identifier:
-    FnName = IdentifierStr;
+    FnName = IdentifierStr.str();
     Kind = 0;
     getNextToken();
     break;
@@ -777,9 +1398,13 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
   if (CurTok != '(')
     return LogErrorP("Expected '(' in prototype");
 
-  std::vector<std::string> ArgNames;
-  while (getNextToken() == tok_identifier)
-    ArgNames.push_back(IdentifierStr);
+  std::vector<Symbol> ArgNames;
+  std::vector<ValueType> ArgTypes;
+  getNextToken(); // eat '('.
+  while (CurTok == tok_identifier) {
+    ArgTypes.push_back(VT_Double);
+    ArgNames.push_back(ParseTypedName(ArgTypes.back()));
+  }
   if (CurTok != ')')
     return LogErrorP("Expected ')' in prototype");
 
@@ -790,30 +1415,44 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
   if (Kind && ArgNames.size() != Kind)
     return LogErrorP("Invalid number of operands for operator");
 
-  return llvm::make_unique<PrototypeAST>(FnLoc, FnName, ArgNames, Kind != 0,
-    BinaryPrecedence);
+  auto Proto = llvm::make_unique<PrototypeAST>(FnLoc, FnName, ArgNames,
+    ArgTypes, ResultType, Kind != 0, BinaryPrecedence);
+  Proto->setMemo(Memo);
+  return Proto;
 }
 
 /// definition ::= 'def' prototype expression
+/// A memo function must be pure, see isPureFunction.
 static std::unique_ptr<FunctionAST> ParseDefinition() {
   getNextToken(); // eat def.
   auto Proto = ParsePrototype();
   if (!Proto)
     return nullptr;
 
-  if (auto E = ParseExpression())
-    return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E));
-  return nullptr;
+  ExprAST *E = ParseExpression();
+  if (!E)
+    return nullptr;
+  E = foldConstants(E);
+
+  Proto->setPure(isPureFunction(*Proto, E));
+  if (Proto->isMemo() && !Proto->isPure())
+    return LogErrorF("memo function is not pure");
+  if (!keepsPurity(*Proto))
+    return LogErrorF("pure function redefined as impure");
+  if (isMemoCandidate(*Proto, E))
+    Proto->setMemo(true);
+  return llvm::make_unique<FunctionAST>(std::move(Proto), E);
 }
 
 /// toplevelexpr ::= expression
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+static std::unique_ptr<FunctionAST>
+ParseTopLevelExpr(const std::string &Name = "__anon_expr") {
   SourceLocation FnLoc = CurLoc;
   if (auto E = ParseExpression()) {
     // Make an anonymous proto.
-    auto Proto = llvm::make_unique<PrototypeAST>(FnLoc, "__anon_expr",
-      std::vector<std::string>());
-    return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+    auto Proto = llvm::make_unique<PrototypeAST>(FnLoc, Name,
+      std::vector<Symbol>(), std::vector<ValueType>(), VT_Double);
+    return llvm::make_unique<FunctionAST>(std::move(Proto), foldConstants(E));
   }
   return nullptr;
 }
@@ -821,14 +1460,366 @@ static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
 /// external ::= 'extern' prototype
 static std::unique_ptr<PrototypeAST> ParseExtern() {
   getNextToken(); // eat extern.
-  return ParsePrototype();
+  auto Proto = ParsePrototype();
+  if (Proto && Proto->isMemo())
+    return LogErrorP("memo applies to definitions only");
+  if (Proto && !keepsPurity(*Proto))
+    return LogErrorP("pure function redeclared as extern");
+  return Proto;
+}
+
+//===----------------------------------------------------------------------===//
+// Constant Folding
+//===----------------------------------------------------------------------===//
+
+// Run on each parsed function before codegen or interpretation, so that
+// constant code never reaches the IR. It folds the builtin operators on
+// constants with the codegen semantics, substitutes the variables bound to a
+// constant and never assigned, drops the dead branch of constant conditions,
+// and unrolls the for loops with a small constant trip count.
+//
+// Constants are doubles, and operations on i64 values are folded only while
+// the i64 and double arithmetic agree, that is for integer values below 2^53.
+
+static bool FoldConstants = true;
+static const unsigned MaxUnrollTripCount = 8;
+static const unsigned MaxUnrolledNodes = 256;
+
+/// ConstantValues - The variables known to hold a constant. Variables which
+/// are not constant are bound to null, to shadow the outer ones.
+static ScopedEnvironment<NumberExprAST *> ConstantValues;
+
+/// isTrue - FCmpONE against 0.0: false for 0.0 and NaN.
+static bool isTrue(double V) { return V < 0.0 || V > 0.0; }
+
+/// MaxExactInt - 2^53, the bound of the integers exact in a double.
+static const double MaxExactInt = 9007199254740992.0;
+
+static bool isIntegral(double V) { return V == std::trunc(V); }
+
+static NumberExprAST *getConstant(ExprAST *E) {
+  return dyn_cast_or_null<NumberExprAST>(E);
+}
+
+/// convertConstant - The constant V assigned to a variable of type Ty, which
+/// truncates it toward zero for i64. Null if V is null or out of the exact
+/// range, and for arrays.
+static NumberExprAST *convertConstant(NumberExprAST *V, ValueType Ty) {
+  if (!V || Ty == VT_Double)
+    return V;
+  if (Ty == VT_Array)
+    return nullptr;
+  double Int = std::trunc(V->getValue());
+  if (!(std::fabs(Int) < MaxExactInt))
+    return nullptr;
+  if (Int == V->getValue())
+    return V;
+  return TheAST.create<NumberExprAST>(Int, V->getLoc());
+}
+
+/// forEachChild - Call Fn on the direct subexpressions of E.
+template <typename FnT> static void forEachChild(ExprAST *E, FnT Fn) {
+  switch (E->getKind()) {
+  case ExprAST::EK_Number:
+  case ExprAST::EK_Variable:
+    return;
+  case ExprAST::EK_Unary:
+    return Fn(cast<UnaryExprAST>(E)->getOperand());
+  case ExprAST::EK_Binary:
+    Fn(cast<BinaryExprAST>(E)->getLHS());
+    return Fn(cast<BinaryExprAST>(E)->getRHS());
+  case ExprAST::EK_Call:
+    for (ExprAST *Arg : cast<CallExprAST>(E)->getArgs())
+      Fn(Arg);
+    return;
+  case ExprAST::EK_If:
+    Fn(cast<IfExprAST>(E)->getCond());
+    Fn(cast<IfExprAST>(E)->getThen());
+    return Fn(cast<IfExprAST>(E)->getElse());
+  case ExprAST::EK_For: {
+    auto *F = cast<ForExprAST>(E);
+    Fn(F->getStart());
+    Fn(F->getEnd());
+    if (F->getStep())
+      Fn(F->getStep());
+    return Fn(F->getBody());
+  }
+  case ExprAST::EK_Var:
+    for (const VarBinding &Var : cast<VarExprAST>(E)->getVarNames())
+      if (Var.Init)
+        Fn(Var.Init);
+    return Fn(cast<VarExprAST>(E)->getBody());
+  case ExprAST::EK_Array:
+    return Fn(cast<ArrayExprAST>(E)->getLength());
+  case ExprAST::EK_Length:
+    return Fn(cast<LengthExprAST>(E)->getArray());
+  case ExprAST::EK_Index:
+    Fn(cast<IndexExprAST>(E)->getArray());
+    return Fn(cast<IndexExprAST>(E)->getIndex());
+  case ExprAST::EK_Seq:
+    for (ExprAST *Sub : cast<SeqExprAST>(E)->getExprs())
+      Fn(Sub);
+    return;
+  }
+}
+
+/// isAssigned - Whether E may assign the variable Name.
+static bool isAssigned(Symbol Name, ExprAST *E) {
+  if (auto *B = dyn_cast<BinaryExprAST>(E))
+    if (B->getOp() == '=')
+      if (auto *LHS = dyn_cast<VariableExprAST>(B->getLHS()))
+        if (LHS->getName() == Name)
+          return true;
+  bool Assigned = false;
+  forEachChild(E, [&](ExprAST *Sub) {
+    Assigned = Assigned || isAssigned(Name, Sub);
+  });
+  return Assigned;
+}
+
+/// countNodes - The size of E, counted up to Limit.
+static unsigned countNodes(ExprAST *E, unsigned Limit) {
+  unsigned Count = 1;
+  forEachChild(E, [&](ExprAST *Sub) {
+    if (Count < Limit)
+      Count += countNodes(Sub, Limit - Count);
+  });
+  return Count;
+}
+
+static ExprAST *foldExpr(ExprAST *E);
+
+/// foldWithVar - Fold E in a scope where Name is bound to Value, or to an
+/// unknown value if Value is null.
+static ExprAST *foldWithVar(ExprAST *E, Symbol Name, NumberExprAST *Value) {
+  ConstantValues.pushScope();
+  ConstantValues.bind(Name, Value);
+  ExprAST *Result = foldExpr(E);
+  ConstantValues.popScope();
+  return Result;
+}
+
+/// unrollFor - Unroll a for loop with constant start and step, an induction
+/// variable which is never assigned, and an end condition which folds to a
+/// constant at each iteration. The trip count is found the way the loop
+/// runs: the body runs at least once, and the increment follows the end
+/// condition. Return null if the loop cannot or should not be unrolled.
+static ExprAST *unrollFor(ForExprAST *F, ExprAST *Start) {
+  NumberExprAST *StartValue = convertConstant(getConstant(Start),
+    F->getVarType());
+  Symbol Var = F->getVarName();
+  if (!StartValue || isAssigned(Var, F->getBody()) ||
+      isAssigned(Var, F->getEnd()) ||
+      (F->getStep() && isAssigned(Var, F->getStep())))
+    return nullptr;
+
+  double Step = 1.0;
+  if (F->getStep()) {
+    NumberExprAST *StepValue = convertConstant(
+      getConstant(foldWithVar(F->getStep(), Var, nullptr)), F->getVarType());
+    if (!StepValue)
+      return nullptr;
+    Step = StepValue->getValue();
+  }
+
+  SmallVector<double, 8> Values;
+  unsigned BodySize = countNodes(F->getBody(), MaxUnrolledNodes + 1);
+  double Value = StartValue->getValue();
+  while (true) {
+    if (Values.size() == MaxUnrollTripCount ||
+        (Values.size() + 1) * BodySize > MaxUnrolledNodes ||
+        (F->getVarType() == VT_Int64 && !(std::fabs(Value) < MaxExactInt)))
+      return nullptr;
+    Values.push_back(Value);
+    auto *Current = TheAST.create<NumberExprAST>(Value, F->getLoc());
+    NumberExprAST *EndCond = getConstant(foldWithVar(F->getEnd(), Var, Current));
+    if (!EndCond)
+      return nullptr;
+    Value = Value + Step;
+    if (!isTrue(EndCond->getValue()))
+      break;
+  }
+
+  // One copy of the body per iteration, then the 0.0 value of for loops.
+  SmallVector<ExprAST *, 9> Iterations;
+  for (double IterValue : Values) {
+    auto *Current = TheAST.create<NumberExprAST>(IterValue, F->getLoc());
+    Iterations.push_back(foldWithVar(F->getBody(), Var, Current));
+  }
+  Iterations.push_back(TheAST.create<NumberExprAST>(0.0, F->getLoc()));
+  return TheAST.create<SeqExprAST>(TheAST.copyArray<ExprAST *>(Iterations),
+    F->getLoc());
+}
+
+static ExprAST *foldExpr(ExprAST *E) {
+  switch (E->getKind()) {
+  case ExprAST::EK_Number:
+    return E;
+  case ExprAST::EK_Variable:
+    if (NumberExprAST *Value =
+          ConstantValues.lookup(cast<VariableExprAST>(E)->getName()))
+      return TheAST.create<NumberExprAST>(Value->getValue(), E->getLoc());
+    return E;
+  case ExprAST::EK_Unary: {
+    auto *U = cast<UnaryExprAST>(E);
+    ExprAST *Operand = foldExpr(U->getOperand());
+    if (Operand == U->getOperand())
+      return E;
+    return TheAST.create<UnaryExprAST>(U->getOpcode(), Operand, E->getLoc());
+  }
+  case ExprAST::EK_Binary: {
+    auto *B = cast<BinaryExprAST>(E);
+    // A variable destination of '=' stays a variable.
+    ExprAST *LHS = B->getOp() == '=' && isa<VariableExprAST>(B->getLHS())
+      ? B->getLHS() : foldExpr(B->getLHS());
+    ExprAST *RHS = foldExpr(B->getRHS());
+    NumberExprAST *L = getConstant(LHS), *R = getConstant(RHS);
+    if (L && R) {
+      double LV = L->getValue(), RV = R->getValue(), Result;
+      bool Builtin = true;
+      switch (B->getOp()) {
+      case '+':
+        Result = LV + RV;
+        break;
+      case '-':
+        Result = LV - RV;
+        break;
+      case '*':
+        Result = LV * RV;
+        break;
+      case '<': // Unordered or less than.
+        Result = !(LV >= RV) ? 1.0 : 0.0;
+        break;
+      default:
+        Builtin = false;
+        break;
+      }
+      // Integer operands may be i64 values.
+      if (Builtin && (!isIntegral(LV) || !isIntegral(RV) ||
+                      std::fabs(Result) < MaxExactInt))
+        return TheAST.create<NumberExprAST>(Result, E->getLoc());
+    }
+    if (LHS == B->getLHS() && RHS == B->getRHS())
+      return E;
+    return TheAST.create<BinaryExprAST>(E->getLoc(), B->getOp(), LHS, RHS);
+  }
+  case ExprAST::EK_Call: {
+    auto *C = cast<CallExprAST>(E);
+    SmallVector<ExprAST *, 8> Args;
+    bool Changed = false;
+    for (ExprAST *Arg : C->getArgs()) {
+      Args.push_back(foldExpr(Arg));
+      Changed |= Args.back() != Arg;
+    }
+    if (!Changed)
+      return E;
+    return TheAST.create<CallExprAST>(E->getLoc(), C->getCallee(),
+      TheAST.copyArray<ExprAST *>(Args));
+  }
+  case ExprAST::EK_If: {
+    auto *I = cast<IfExprAST>(E);
+    ExprAST *Cond = foldExpr(I->getCond());
+    if (NumberExprAST *CondValue = getConstant(Cond))
+      return foldExpr(isTrue(CondValue->getValue()) ? I->getThen()
+                                                    : I->getElse());
+    ExprAST *Then = foldExpr(I->getThen());
+    ExprAST *Else = foldExpr(I->getElse());
+    if (Cond == I->getCond() && Then == I->getThen() && Else == I->getElse())
+      return E;
+    return TheAST.create<IfExprAST>(E->getLoc(), Cond, Then, Else);
+  }
+  case ExprAST::EK_For: {
+    auto *F = cast<ForExprAST>(E);
+    // The start value is evaluated without the variable in scope.
+    ExprAST *Start = foldExpr(F->getStart());
+    if (ExprAST *Unrolled = unrollFor(F, Start))
+      return Unrolled;
+    ConstantValues.pushScope();
+    ConstantValues.bind(F->getVarName(), nullptr);
+    ExprAST *End = foldExpr(F->getEnd());
+    ExprAST *Step = F->getStep() ? foldExpr(F->getStep()) : nullptr;
+    ExprAST *Body = foldExpr(F->getBody());
+    ConstantValues.popScope();
+    if (Start == F->getStart() && End == F->getEnd() && Step == F->getStep() &&
+        Body == F->getBody())
+      return E;
+    return TheAST.create<ForExprAST>(F->getVarName(), F->getVarType(), Start,
+      End, Step, Body, E->getLoc());
+  }
+  case ExprAST::EK_Var: {
+    auto *V = cast<VarExprAST>(E);
+    ArrayRef<VarBinding> VarNames = V->getVarNames();
+    SmallVector<VarBinding, 4> Folded;
+    bool Changed = false;
+    ConstantValues.pushScope();
+    for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
+      // Initializers see the previous variables only.
+      ExprAST *Init = VarNames[i].Init ? foldExpr(VarNames[i].Init) : nullptr;
+      Folded.push_back({VarNames[i].Name, Init, VarNames[i].Type});
+      Changed |= Init != VarNames[i].Init;
+
+      NumberExprAST *Value = convertConstant(Init ? getConstant(Init)
+        : TheAST.create<NumberExprAST>(0.0, E->getLoc()), VarNames[i].Type);
+      bool Assigned = isAssigned(VarNames[i].Name, V->getBody());
+      for (unsigned j = i + 1; j != e && !Assigned; ++j)
+        Assigned = VarNames[j].Init && isAssigned(VarNames[i].Name,
+                                                  VarNames[j].Init);
+      ConstantValues.bind(VarNames[i].Name, Assigned ? nullptr : Value);
+    }
+    ExprAST *Body = foldExpr(V->getBody());
+    ConstantValues.popScope();
+    if (!Changed && Body == V->getBody())
+      return E;
+    return TheAST.create<VarExprAST>(TheAST.copyArray<VarBinding>(Folded),
+      Body, E->getLoc());
+  }
+  case ExprAST::EK_Array: {
+    auto *A = cast<ArrayExprAST>(E);
+    ExprAST *Length = foldExpr(A->getLength());
+    if (Length == A->getLength())
+      return E;
+    return TheAST.create<ArrayExprAST>(E->getLoc(), Length);
+  }
+  case ExprAST::EK_Length: {
+    auto *L = cast<LengthExprAST>(E);
+    ExprAST *Array = foldExpr(L->getArray());
+    if (Array == L->getArray())
+      return E;
+    return TheAST.create<LengthExprAST>(E->getLoc(), Array);
+  }
+  case ExprAST::EK_Index: {
+    auto *I = cast<IndexExprAST>(E);
+    ExprAST *Array = foldExpr(I->getArray());
+    ExprAST *Index = foldExpr(I->getIndex());
+    if (Array == I->getArray() && Index == I->getIndex())
+      return E;
+    return TheAST.create<IndexExprAST>(E->getLoc(), Array, Index);
+  }
+  case ExprAST::EK_Seq: {
+    auto *S = cast<SeqExprAST>(E);
+    SmallVector<ExprAST *, 8> Exprs;
+    for (ExprAST *Sub : S->getExprs())
+      Exprs.push_back(foldExpr(Sub));
+    return TheAST.create<SeqExprAST>(TheAST.copyArray<ExprAST *>(Exprs),
+      E->getLoc());
+  }
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
+/// foldConstants - Fold the body of a function, nodes are created in TheAST.
+static ExprAST *foldConstants(ExprAST *Body) {
+  if (!FoldConstants)
+    return Body;
+  ConstantValues.clear();
+  return foldExpr(Body);
 }
 
 //===----------------------------------------------------------------------===//
 // Debug Info Support
 //===----------------------------------------------------------------------===//
 
-static std::unique_ptr<DIBuilder> DBuilder;
+static thread_local std::unique_ptr<DIBuilder> DBuilder;
 
 DIType *DebugInfo::getDoubleTy() {
   if (DblTy)
@@ -838,6 +1829,37 @@ DIType *DebugInfo::getDoubleTy() {
   return DblTy;
 }
 
+DIType *DebugInfo::getInt64Ty() {
+  if (Int64Ty)
+    return Int64Ty;
+
+  Int64Ty = DBuilder->createBasicType("i64", 64, dwarf::DW_ATE_signed);
+  return Int64Ty;
+}
+
+DIType *DebugInfo::getArrayTy() {
+  if (ArrayTy)
+    return ArrayTy;
+
+  // struct array { double *data; i64 length; }
+  DIFile *Unit = TheCU->getFile();
+  Metadata *Elts[] = {
+    DBuilder->createMemberType(Unit, "data", Unit, 0, 64, 64, 0,
+      DINode::FlagZero, DBuilder->createPointerType(getDoubleTy(), 64)),
+    DBuilder->createMemberType(Unit, "length", Unit, 0, 64, 64, 64,
+      DINode::FlagZero, getInt64Ty())
+  };
+  ArrayTy = DBuilder->createStructType(Unit, "array", Unit, 0, 128, 64,
+    DINode::FlagZero, nullptr, DBuilder->getOrCreateArray(Elts));
+  return ArrayTy;
+}
+
+DIType *DebugInfo::getType(Type *Ty) {
+  if (Ty->isStructTy())
+    return getArrayTy();
+  return Ty->isIntegerTy() ? getInt64Ty() : getDoubleTy();
+}
+
 void DebugInfo::emitLocation(ExprAST *AST) {
   if (!AST)
     return Builder.SetCurrentDebugLocation(DebugLoc());
@@ -850,15 +1872,14 @@ void DebugInfo::emitLocation(ExprAST *AST) {
     DebugLoc::get(AST->getLine(), AST->getCol(), Scope));
 }
 
-static DISubroutineType *CreateFunctionType(unsigned NumArgs, DIFile *Unit) {
+static DISubroutineType *CreateFunctionType(FunctionType *FT, DIFile *Unit) {
   SmallVector<Metadata *, 8> EltTys;
-  DIType *DblTy = KSDbgInfo.getDoubleTy();
 
   // Add the result type.
-  EltTys.push_back(DblTy);
+  EltTys.push_back(KSDbgInfo.getType(FT->getReturnType()));
 
-  for (unsigned i = 0, e = NumArgs; i != e; ++i)
-    EltTys.push_back(DblTy);
+  for (Type *ParamTy : FT->params())
+    EltTys.push_back(KSDbgInfo.getType(ParamTy));
 
   return DBuilder->createSubroutineType(DBuilder->getOrCreateTypeArray(EltTys));
 }
@@ -867,11 +1888,21 @@ static DISubroutineType *CreateFunctionType(unsigned NumArgs, DIFile *Unit) {
 // Code Generation
 //===----------------------------------------------------------------------===//
 
-static std::unique_ptr<Module> TheModule;
-static std::map<std::string, AllocaInst *> NamedValues;
+static thread_local std::unique_ptr<Module> TheModule;
+static thread_local std::unique_ptr<legacy::FunctionPassManager> TheFPM;
+static bool Optimize = false;
+static thread_local ScopedEnvironment<unsigned> NamedValues;
 static std::unique_ptr<KaleidoscopeJIT> TheJIT;
 static std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
 
+// In batch mode, the parser declares the prototypes while the workers are
+// generating code: a worker looking for a function not parsed yet waits for
+// it, or for the end of the file.
+static bool Batch = false;
+static bool BatchParsing = false;
+static std::mutex ProtosLock;
+static std::condition_variable ProtosDeclared;
+
 Value *LogErrorV(const char *Str) {
   LogError(Str);
   return nullptr;
@@ -883,23 +1914,317 @@ Function *getFunction(std::string Name) {
     return F;
 
   // If not, check whether we can codegen the declaration from some existing
-  // prototype.
-  auto FI = FunctionProtos.find(Name);
-  if (FI != FunctionProtos.end())
-    return FI->second->codegen();
+  // prototype. It is copied, then generated out of the lock, which the other
+  // workers and the parser need.
+  std::unique_ptr<PrototypeAST> Proto;
+  {
+    std::unique_lock<std::mutex> Guard(ProtosLock);
+    auto FI = FunctionProtos.find(Name);
+    while (FI == FunctionProtos.end() && BatchParsing) {
+      ProtosDeclared.wait(Guard);
+      FI = FunctionProtos.find(Name);
+    }
+    // If no existing prototype exists, return null.
+    if (FI == FunctionProtos.end())
+      return nullptr;
+    Proto = llvm::make_unique<PrototypeAST>(*FI->second);
+  }
+  return Proto->codegen();
+}
 
-  // If no existing prototype exists, return null.
-  return nullptr;
+/// getArrayType - { double*, i64 }, the data and length of an array. As a
+/// first-class value, it is passed and returned in two registers.
+static StructType *getArrayType() {
+  return StructType::get(TheContext,
+    {Type::getDoublePtrTy(TheContext), Type::getInt64Ty(TheContext)});
 }
 
-/// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
-/// the function.  This is used for mutable variables etc.
-static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
-  const std::string &VarName) {
+/// isArrayType - Arrays are the only aggregate values.
+static bool isArrayType(Type *Ty) { return Ty->isStructTy(); }
+
+static Type *getLLVMType(ValueType Ty) {
+  switch (Ty) {
+  case VT_Double:
+    return Type::getDoubleTy(TheContext);
+  case VT_Int64:
+    return Type::getInt64Ty(TheContext);
+  case VT_Array:
+    return getArrayType();
+  }
+  llvm_unreachable("unknown value type");
+}
+
+/// isInt64Constant - Whether V is a double constant with an exact i64 value,
+/// such as an integer literal.
+static bool isInt64Constant(Value *V) {
+  auto *C = dyn_cast<ConstantFP>(V);
+  if (!C)
+    return false;
+  double D = C->getValueAPF().convertToDouble();
+  return D == std::trunc(D) && std::fabs(D) < 9223372036854775808.0;
+}
+
+/// getCommonType - The type of an operation on L and R: their type if they
+/// have the same, i64 if one is and the other is a constant with the same
+/// value as an i64, so that 'n - 1' stays an integer operation. Double
+/// otherwise.
+static Type *getCommonType(Value *L, Value *R) {
+  if (L->getType() == R->getType())
+    return L->getType();
+  Type *Int64Ty = Type::getInt64Ty(TheContext);
+  bool IntL = L->getType() == Int64Ty, IntR = R->getType() == Int64Ty;
+  if ((IntL && (IntR || isInt64Constant(R))) || (IntR && isInt64Constant(L)))
+    return Int64Ty;
+  return Type::getDoubleTy(TheContext);
+}
+
+/// convertValue - Convert V to Ty at the insertion point: i64 to double
+/// rounds to nearest, double to i64 truncates toward zero. Constants are
+/// folded by the builder. Arrays and numbers do not convert.
+static Value *convertValue(Value *V, Type *Ty) {
+  if (V->getType() == Ty)
+    return V;
+  if (isArrayType(Ty))
+    return LogErrorV("expected an array");
+  if (isArrayType(V->getType()))
+    return LogErrorV("expected a number, not an array");
+  if (Ty->isIntegerTy()) {
+    // fptosi is poison out of the range of Ty: saturate to its bounds, and
+    // NaN to 0, as llvm.fptosi.sat would.
+    unsigned Bits = Ty->getIntegerBitWidth();
+    Value *Int = Builder.CreateFPToSI(V, Ty, "toint");
+    Value *TooLarge = Builder.CreateFCmpOGE(
+      V, ConstantFP::get(V->getType(), std::ldexp(1.0, Bits - 1)), "toolarge");
+    Int = Builder.CreateSelect(
+      TooLarge, ConstantInt::get(TheContext, APInt::getSignedMaxValue(Bits)),
+      Int, "toint");
+    Value *TooSmall = Builder.CreateFCmpOLT(
+      V, ConstantFP::get(V->getType(), -std::ldexp(1.0, Bits - 1)), "toosmall");
+    Int = Builder.CreateSelect(
+      TooSmall, ConstantInt::get(TheContext, APInt::getSignedMinValue(Bits)),
+      Int, "toint");
+    return Builder.CreateSelect(Builder.CreateFCmpUNO(V, V, "isnan"),
+                                ConstantInt::get(Ty, 0), Int, "toint");
+  }
+  return Builder.CreateSIToFP(V, Ty, "todouble");
+}
+
+/// CreateIsTrue - Convert a condition to a bool by comparing non-equal to 0.
+static Value *CreateIsTrue(Value *V, const Twine &Name) {
+  if (isArrayType(V->getType()))
+    return LogErrorV("expected a number condition, not an array");
+  if (V->getType()->isIntegerTy())
+    return Builder.CreateICmpNE(V, ConstantInt::get(V->getType(), 0), Name);
+  return Builder.CreateFCmpONE(
+    V, ConstantFP::get(TheContext, APFloat(0.0)), Name);
+}
+
+/// CreateEntryBlockAlloca - Create an alloca instruction in the entry block of
+/// the function.  This is used for mutable variables etc.
+static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction,
+  const std::string &VarName, Type *Ty) {
   IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
     TheFunction->getEntryBlock().begin());
-  return TmpB.CreateAlloca(Type::getDoubleTy(TheContext), nullptr,
-    VarName.c_str());
+  return TmpB.CreateAlloca(Ty, nullptr, VarName.c_str());
+}
+
+/// UseAllocas - Keep the variables in entry block allocas, for mem2reg to
+/// promote, rather than building their SSA form in the frontend.
+static bool UseAllocas = false;
+
+/// VariableBuilder - The SSA form of the variables of the function being
+/// generated, built on the fly as in Braun et al., "Simple and Efficient
+/// Construction of Static Single Assignment Form". Each binding of a name is a
+/// variable of its own, with its current definition in each block. Reading a
+/// variable in a block without definition looks it up in the predecessors,
+/// through a phi if there are several, or an operand-less phi completed when
+/// the block is sealed, that is once all its predecessors are known. Trivial
+/// phis are removed as soon as complete.
+///
+/// Kaleidoscope has no way to take the address of a variable, so only
+/// UseAllocas keeps variables in memory, each in an entry block alloca.
+class VariableBuilder {
+  typedef unsigned Variable;
+
+  struct VariableInfo {
+    StringRef Name;
+    Type *Ty;
+    AllocaInst *Alloca;
+  };
+
+  std::vector<VariableInfo> Vars;
+  DenseMap<std::pair<Variable, BasicBlock *>, WeakTrackingVH> CurrentDef;
+  DenseMap<BasicBlock *, SmallVector<std::pair<Variable, PHINode *>, 4>>
+    IncompletePhis;
+  SmallPtrSet<BasicBlock *, 16> SealedBlocks;
+
+public:
+  /// Forget the variables of the previous function.
+  void reset() {
+    Vars.clear();
+    CurrentDef.clear();
+    IncompletePhis.clear();
+    SealedBlocks.clear();
+  }
+
+  /// Create a new variable of type Ty. Variables are numbered from 1, so that
+  /// 0 is never a variable.
+  Variable create(Function *TheFunction, StringRef Name, Type *Ty) {
+    Vars.push_back({Name, Ty, UseAllocas ? CreateEntryBlockAlloca(TheFunction,
+                                                                 Name.str(), Ty)
+                                         : nullptr});
+    return Vars.size();
+  }
+
+  Type *getType(Variable Var) const { return Vars[Var - 1].Ty; }
+
+  /// getAlloca - The storage of Var, or null if it is in SSA form.
+  AllocaInst *getAlloca(Variable Var) const { return Vars[Var - 1].Alloca; }
+
+  /// Assign V, of the type of Var, to Var at the insertion point.
+  void write(Variable Var, Value *V) {
+    if (AllocaInst *Alloca = getAlloca(Var))
+      Builder.CreateStore(V, Alloca);
+    else
+      CurrentDef[{Var, Builder.GetInsertBlock()}] = V;
+  }
+
+  /// The value of Var at the insertion point.
+  Value *read(Variable Var) {
+    if (AllocaInst *Alloca = getAlloca(Var))
+      return Builder.CreateLoad(Alloca, Vars[Var - 1].Name);
+    return readVariable(Var, Builder.GetInsertBlock());
+  }
+
+  /// Declare that all the predecessors of BB have been emitted.
+  void seal(BasicBlock *BB) {
+    // Reading the operands can add incomplete phis to other blocks, so the
+    // phis of BB are taken out of the map first.
+    auto Incomplete = IncompletePhis.find(BB);
+    if (Incomplete != IncompletePhis.end()) {
+      auto Phis = std::move(Incomplete->second);
+      IncompletePhis.erase(Incomplete);
+      for (auto &VarPhi : Phis)
+        addPhiOperands(VarPhi.first, VarPhi.second);
+    }
+    SealedBlocks.insert(BB);
+  }
+
+private:
+  Value *readVariable(Variable Var, BasicBlock *BB) {
+    auto Def = CurrentDef.find({Var, BB});
+    if (Def != CurrentDef.end() && Def->second)
+      return Def->second;
+
+    Value *V;
+    if (!SealedBlocks.count(BB)) {
+      // Not all the predecessors are known yet.
+      PHINode *Phi = createPhi(Var, BB);
+      IncompletePhis[BB].push_back({Var, Phi});
+      V = Phi;
+    }
+    else if (BasicBlock *Pred = BB->getSinglePredecessor()) {
+      V = readVariable(Var, Pred);
+    }
+    else {
+      // Break the cycles through the loops with a phi defined first.
+      PHINode *Phi = createPhi(Var, BB);
+      CurrentDef[{Var, BB}] = Phi;
+      V = addPhiOperands(Var, Phi);
+    }
+    CurrentDef[{Var, BB}] = V;
+    return V;
+  }
+
+  PHINode *createPhi(Variable Var, BasicBlock *BB) {
+    const VariableInfo &Info = Vars[Var - 1];
+    if (BB->empty())
+      return PHINode::Create(Info.Ty, 0, Info.Name, BB);
+    return PHINode::Create(Info.Ty, 0, Info.Name, &BB->front());
+  }
+
+  Value *addPhiOperands(Variable Var, PHINode *Phi) {
+    BasicBlock *BB = Phi->getParent();
+    for (BasicBlock *Pred : predecessors(BB))
+      Phi->addIncoming(readVariable(Var, Pred), Pred);
+    return tryRemoveTrivialPhi(Phi);
+  }
+
+  /// tryRemoveTrivialPhi - Replace Phi by its operand if it merges only one
+  /// value, besides itself. The phis using it are not retried: the caller of
+  /// read may still hold one of them, which the optimizer removes if trivial.
+  Value *tryRemoveTrivialPhi(PHINode *Phi) {
+    Value *Same = nullptr;
+    for (Value *Op : Phi->incoming_values()) {
+      if (Op == Same || Op == Phi)
+        continue;
+      if (Same)
+        return Phi;
+      Same = Op;
+    }
+    if (!Same)
+      Same = UndefValue::get(Phi->getType());
+
+    // The tracking handles in CurrentDef follow the replacement.
+    Phi->replaceAllUsesWith(Same);
+    Phi->eraseFromParent();
+    return Same;
+  }
+};
+
+static thread_local VariableBuilder Variables;
+
+/// UncheckedAccesses - The accesses 'a[i]' of the loop being generated which
+/// were checked in bounds before the loop.
+static thread_local SmallPtrSet<IndexExprAST *, 16> UncheckedAccesses;
+
+/// getRuntimeFunction - Declare the library function Name, see below.
+static Function *getRuntimeFunction(StringRef Name, Type *Result,
+  ArrayRef<Type *> Params) {
+  if (Function *F = TheModule->getFunction(Name))
+    return F;
+  return Function::Create(FunctionType::get(Result, Params, false),
+    Function::ExternalLinkage, Name, TheModule.get());
+}
+
+/// CreateElementPtr - The address of the element IndexV of ArrayV, accessed
+/// by Access. The index is checked in bounds first, unless the loop checked
+/// it: out of bounds, arrayindexerror reports it and exits.
+static Value *CreateElementPtr(IndexExprAST *Access, Value *ArrayV,
+  Value *IndexV) {
+  if (!isArrayType(ArrayV->getType()))
+    return LogErrorV("indexed value is not an array");
+  Type *Int64Ty = Type::getInt64Ty(TheContext);
+  IndexV = convertValue(IndexV, Int64Ty);
+  if (!IndexV)
+    return nullptr;
+
+  if (!UncheckedAccesses.count(Access)) {
+    // Negative indices are out of bounds as large unsigned ones.
+    Value *Length = Builder.CreateExtractValue(ArrayV, 1, "len");
+    Value *InBounds = Builder.CreateICmpULT(IndexV, Length, "inbounds");
+    Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    BasicBlock *ErrorBB =
+      BasicBlock::Create(TheContext, "outofbounds", TheFunction);
+    BasicBlock *ElementBB =
+      BasicBlock::Create(TheContext, "element", TheFunction);
+    Builder.CreateCondBr(InBounds, ElementBB, ErrorBB,
+      MDBuilder(TheContext).createBranchWeights(1 << 20, 1));
+    Variables.seal(ErrorBB);
+    Variables.seal(ElementBB);
+
+    Builder.SetInsertPoint(ErrorBB);
+    Function *IndexError = getRuntimeFunction("arrayindexerror",
+      Type::getVoidTy(TheContext), {Int64Ty, Int64Ty});
+    IndexError->setDoesNotReturn();
+    Builder.CreateCall(IndexError, {IndexV, Length});
+    Builder.CreateUnreachable();
+
+    Builder.SetInsertPoint(ElementBB);
+  }
+
+  Value *Data = Builder.CreateExtractValue(ArrayV, 0, "data");
+  return Builder.CreateInBoundsGEP(Data, IndexV, "eltptr");
 }
 
 Value *NumberExprAST::codegen() {
@@ -909,13 +2234,13 @@ Value *NumberExprAST::codegen() {
 
 Value *VariableExprAST::codegen() {
   // Look this variable up in the function.
-  Value *V = NamedValues[Name];
-  if (!V)
+  unsigned Var = NamedValues.lookup(Name);
+  if (!Var)
     return LogErrorV("Unknown variable name");
 
   KSDbgInfo.emitLocation(this);
-  // Load the value.
-  return Builder.CreateLoad(V, Name.c_str());
+  // Read the value.
+  return Variables.read(Var);
 }
 
 Value *UnaryExprAST::codegen() {
@@ -928,19 +2253,78 @@ Value *UnaryExprAST::codegen() {
     return LogErrorV("Unknown unary operator");
 
   KSDbgInfo.emitLocation(this);
+  OperandV = convertValue(OperandV, F->getFunctionType()->getParamType(0));
+  if (!OperandV)
+    return nullptr;
   return Builder.CreateCall(F, OperandV, "unop");
 }
 
+Value *ArrayExprAST::codegen() {
+  Value *LengthV = Length->codegen();
+  if (!LengthV)
+    return nullptr;
+
+  KSDbgInfo.emitLocation(this);
+  Type *Int64Ty = Type::getInt64Ty(TheContext);
+  LengthV = convertValue(LengthV, Int64Ty);
+  if (!LengthV)
+    return nullptr;
+  Function *AllocArray = getRuntimeFunction("allocarray",
+    Type::getDoublePtrTy(TheContext), {Int64Ty});
+  Value *Data = Builder.CreateCall(AllocArray, LengthV, "data");
+
+  Value *ArrayV = UndefValue::get(getArrayType());
+  ArrayV = Builder.CreateInsertValue(ArrayV, Data, 0);
+  return Builder.CreateInsertValue(ArrayV, LengthV, 1, "array");
+}
+
+Value *LengthExprAST::codegen() {
+  Value *ArrayV = Array->codegen();
+  if (!ArrayV)
+    return nullptr;
+  if (!isArrayType(ArrayV->getType()))
+    return LogErrorV("len() of a value which is not an array");
+
+  KSDbgInfo.emitLocation(this);
+  return Builder.CreateExtractValue(ArrayV, 1, "len");
+}
+
+Value *IndexExprAST::codegen() {
+  Value *ArrayV = Array->codegen();
+  Value *IndexV = Index->codegen();
+  if (!ArrayV || !IndexV)
+    return nullptr;
+
+  KSDbgInfo.emitLocation(this);
+  Value *Ptr = CreateElementPtr(this, ArrayV, IndexV);
+  if (!Ptr)
+    return nullptr;
+  return Builder.CreateLoad(Ptr, "elt");
+}
+
 Value *BinaryExprAST::codegen() {
   KSDbgInfo.emitLocation(this);
 
   // Special case '=' because we don't want to emit the LHS as an expression.
   if (Op == '=') {
-    // Assignment requires the LHS to be an identifier.
-    // This assume we're building without RTTI because LLVM builds that way by
-    // default.  If you build LLVM with RTTI this can be changed to a
-    // dynamic_cast for automatic error checking.
-    VariableExprAST *LHSE = static_cast<VariableExprAST *>(LHS.get());
+    // An array element is written in place.
+    if (auto *LHSI = dyn_cast<IndexExprAST>(LHS)) {
+      Value *ArrayV = LHSI->getArray()->codegen();
+      Value *IndexV = LHSI->getIndex()->codegen();
+      Value *Val = RHS->codegen();
+      if (!ArrayV || !IndexV || !Val)
+        return nullptr;
+
+      KSDbgInfo.emitLocation(this);
+      Value *Ptr = CreateElementPtr(LHSI, ArrayV, IndexV);
+      if (!Ptr || !(Val = convertValue(Val, Type::getDoubleTy(TheContext))))
+        return nullptr;
+      Builder.CreateStore(Val, Ptr);
+      return Val;
+    }
+
+    // Otherwise, assignment requires the LHS to be an identifier.
+    VariableExprAST *LHSE = dyn_cast<VariableExprAST>(LHS);
     if (!LHSE)
       return LogErrorV("destination of '=' must be a variable");
     // Codegen the RHS.
@@ -949,11 +2333,15 @@ Value *BinaryExprAST::codegen() {
       return nullptr;
 
     // Look up the name.
-    Value *Variable = NamedValues[LHSE->getName()];
-    if (!Variable)
+    unsigned Var = NamedValues.lookup(LHSE->getName());
+    if (!Var)
       return LogErrorV("Unknown variable name");
 
-    Builder.CreateStore(Val, Variable);
+    // The value converts to the type of the variable.
+    Val = convertValue(Val, Variables.getType(Var));
+    if (!Val)
+      return nullptr;
+    Variables.write(Var, Val);
     return Val;
   }
 
@@ -962,6 +2350,30 @@ Value *BinaryExprAST::codegen() {
   if (!L || !R)
     return nullptr;
 
+  if (Op == '+' || Op == '-' || Op == '*' || Op == '<') {
+    Type *Ty = getCommonType(L, R);
+    if (isArrayType(Ty))
+      return LogErrorV("operands of builtin operators must be numbers");
+    L = convertValue(L, Ty);
+    R = convertValue(R, Ty);
+    if (!L || !R)
+      return nullptr;
+    if (Ty->isIntegerTy()) {
+      switch (Op) {
+      case '+':
+        return Builder.CreateAdd(L, R, "addtmp");
+      case '-':
+        return Builder.CreateSub(L, R, "subtmp");
+      case '*':
+        return Builder.CreateMul(L, R, "multmp");
+      default:
+        L = Builder.CreateICmpSLT(L, R, "cmptmp");
+        // Convert bool 0/1 to i64 0 or 1
+        return Builder.CreateZExt(L, Ty, "booltmp");
+      }
+    }
+  }
+
   switch (Op) {
   case '+':
     return Builder.CreateFAdd(L, R, "addtmp");
@@ -982,7 +2394,10 @@ Value *BinaryExprAST::codegen() {
   Function *F = getFunction(std::string("binary") + Op);
   assert(F && "binary operator not found!");
 
-  Value *Ops[] = { L, R };
+  Value *Ops[] = { convertValue(L, F->getFunctionType()->getParamType(0)),
+                   convertValue(R, F->getFunctionType()->getParamType(1)) };
+  if (!Ops[0] || !Ops[1])
+    return nullptr;
   return Builder.CreateCall(F, Ops, "binop");
 }
 
@@ -990,7 +2405,7 @@ Value *CallExprAST::codegen() {
   KSDbgInfo.emitLocation(this);
 
   // Look up the name in the global module table.
-  Function *CalleeF = getFunction(Callee);
+  Function *CalleeF = getFunction(Symbols.getName(Callee).str());
   if (!CalleeF)
     return LogErrorV("Unknown function referenced");
 
@@ -1000,9 +2415,13 @@ Value *CallExprAST::codegen() {
 
   std::vector<Value *> ArgsV;
   for (unsigned i = 0, e = Args.size(); i != e; ++i) {
-    ArgsV.push_back(Args[i]->codegen());
-    if (!ArgsV.back())
+    Value *ArgV = Args[i]->codegen();
+    if (!ArgV)
       return nullptr;
+    ArgV = convertValue(ArgV, CalleeF->getFunctionType()->getParamType(i));
+    if (!ArgV)
+      return nullptr;
+    ArgsV.push_back(ArgV);
   }
 
   return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
@@ -1015,9 +2434,10 @@ Value *IfExprAST::codegen() {
   if (!CondV)
     return nullptr;
 
-  // Convert condition to a bool by comparing non-equal to 0.0.
-  CondV = Builder.CreateFCmpONE(
-    CondV, ConstantFP::get(TheContext, APFloat(0.0)), "ifcond");
+  // Convert condition to a bool by comparing non-equal to 0.
+  CondV = CreateIsTrue(CondV, "ifcond");
+  if (!CondV)
+    return nullptr;
 
   Function *TheFunction = Builder.GetInsertBlock()->getParent();
 
@@ -1028,6 +2448,8 @@ Value *IfExprAST::codegen() {
   BasicBlock *MergeBB = BasicBlock::Create(TheContext, "ifcont");
 
   Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+  Variables.seal(ThenBB);
+  Variables.seal(ElseBB);
 
   // Emit then value.
   Builder.SetInsertPoint(ThenBB);
@@ -1052,10 +2474,24 @@ Value *IfExprAST::codegen() {
   // Codegen of 'Else' can change the current block, update ElseBB for the PHI.
   ElseBB = Builder.GetInsertBlock();
 
+  // Both values convert to their common type, at the end of their block.
+  Type *Ty = getCommonType(ThenV, ElseV);
+  if (ThenV->getType() != Ty) {
+    Builder.SetInsertPoint(ThenBB->getTerminator());
+    ThenV = convertValue(ThenV, Ty);
+  }
+  if (ElseV->getType() != Ty) {
+    Builder.SetInsertPoint(ElseBB->getTerminator());
+    ElseV = convertValue(ElseV, Ty);
+  }
+  if (!ThenV || !ElseV)
+    return nullptr;
+
   // Emit merge block.
   TheFunction->getBasicBlockList().push_back(MergeBB);
   Builder.SetInsertPoint(MergeBB);
-  PHINode *PN = Builder.CreatePHI(Type::getDoubleTy(TheContext), 2, "iftmp");
+  Variables.seal(MergeBB);
+  PHINode *PN = Builder.CreatePHI(Ty, 2, "iftmp");
 
   PN->addIncoming(ThenV, ThenBB);
   PN->addIncoming(ElseV, ElseBB);
@@ -1063,12 +2499,11 @@ Value *IfExprAST::codegen() {
 }
 
 // Output for-loop as:
-//   var = alloca double
 //   ...
 //   start = startexpr
-//   store start -> var
 //   goto loop
 // loop:
+//   var = phi [start, preheader], [nextvar, loopend]
 //   ...
 //   bodyexpr
 //   ...
@@ -1076,129 +2511,331 @@ Value *IfExprAST::codegen() {
 //   step = stepexpr
 //   endcond = endexpr
 //
-//   curvar = load var
+//   curvar = var, or its value assigned by the body
 //   nextvar = curvar + step
-//   store nextvar -> var
 //   br endcond, loop, endloop
 // outloop:
-Value *ForExprAST::codegen() {
-  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+//
+// The phis of the loop header, for var and for the variables assigned in the
+// loop, are completed once the back edge is emitted.
+//
+// An array loop, over an i64 variable never assigned, ending on 'var < end'
+// with a loop-invariant end and a constant positive step, runs the body for
+// var in [start, max(start, end + step - 1)]. Its accesses 'a[var]' to arrays
+// never assigned in the loop are checked in bounds all at once before the
+// loop: if they are, a second version of the loop runs, without their bounds
+// checks and marked for the vectorizer.
+//
+//   start = startexpr
+//   inbounds = 0 <= start && start < len(a) && end <= len(a) - step && ...
+//   br inbounds, vecloop, loop
+// vecloop:
+//   ... loop without the checks ...
+//   br endcond, vecloop, afterloop, !llvm.loop
+// loop:
+//   ... loop with the checks ...
+//   br endcond, loop, afterloop
+// afterloop:
+
+/// MaxLoopStep - The largest step of array loops, so that len - step does not
+/// overflow.
+static const double MaxLoopStep = 4294967296.0;
+
+/// isAssignedInLoop - Whether the loop F may assign the variable Name.
+static bool isAssignedInLoop(Symbol Name, ForExprAST *F) {
+  return isAssigned(Name, F->getBody()) || isAssigned(Name, F->getEnd()) ||
+    (F->getStep() && isAssigned(Name, F->getStep()));
+}
+
+/// isLoopInvariant - Whether the variable Name, of an array if Array is set,
+/// has the same value before and in the loop F.
+static bool isLoopInvariant(Symbol Name, bool Array, ForExprAST *F) {
+  unsigned Var = NamedValues.lookup(Name);
+  return Var && Name != F->getVarName() &&
+    isArrayType(Variables.getType(Var)) == Array && !isAssignedInLoop(Name, F);
+}
 
-  // Create an alloca for the variable in the entry block.
-  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+/// isInvariantBound - Whether E, an end of the loop F, has the same value
+/// before and in the loop, and generates without error: the arithmetic of
+/// constants, lengths and variables not assigned in the loop.
+static bool isInvariantBound(ExprAST *E, ForExprAST *F) {
+  switch (E->getKind()) {
+  case ExprAST::EK_Number:
+    return true;
+  case ExprAST::EK_Variable:
+    return isLoopInvariant(cast<VariableExprAST>(E)->getName(), false, F);
+  case ExprAST::EK_Length: {
+    auto *Array = dyn_cast<VariableExprAST>(cast<LengthExprAST>(E)->getArray());
+    return Array && isLoopInvariant(Array->getName(), true, F);
+  }
+  case ExprAST::EK_Binary: {
+    auto *B = cast<BinaryExprAST>(E);
+    return (B->getOp() == '+' || B->getOp() == '-' || B->getOp() == '*') &&
+      isInvariantBound(B->getLHS(), F) && isInvariantBound(B->getRHS(), F);
+  }
+  default:
+    return false;
+  }
+}
 
-  KSDbgInfo.emitLocation(this);
+/// containsLoop - Whether E has a for loop.
+static bool containsLoop(ExprAST *E) {
+  bool Found = isa<ForExprAST>(E);
+  forEachChild(E, [&](ExprAST *Sub) { Found = Found || containsLoop(Sub); });
+  return Found;
+}
 
-  // Emit the start code first, without 'variable' in scope.
-  Value *StartVal = Start->codegen();
-  if (!StartVal)
+/// collectLoopAccesses - Add the accesses 'a[var]' of E to Accesses, for var
+/// the variable of the loop F and a an array not assigned in it. Shadowed
+/// holds the names bound in the loop around E.
+static void collectLoopAccesses(ExprAST *E, ForExprAST *F,
+  SmallVectorImpl<Symbol> &Shadowed, SmallVectorImpl<IndexExprAST *> &Accesses) {
+  if (auto *Access = dyn_cast<IndexExprAST>(E)) {
+    auto *Array = dyn_cast<VariableExprAST>(Access->getArray());
+    auto *Index = dyn_cast<VariableExprAST>(Access->getIndex());
+    if (Array && Index && Index->getName() == F->getVarName() &&
+        !is_contained(Shadowed, Index->getName()) &&
+        !is_contained(Shadowed, Array->getName()) &&
+        isLoopInvariant(Array->getName(), true, F))
+      Accesses.push_back(Access);
+  }
+
+  size_t NumShadowed = Shadowed.size();
+  if (auto *Loop = dyn_cast<ForExprAST>(E))
+    Shadowed.push_back(Loop->getVarName());
+  else if (auto *V = dyn_cast<VarExprAST>(E))
+    for (const VarBinding &Var : V->getVarNames())
+      Shadowed.push_back(Var.Name);
+  forEachChild(E, [&](ExprAST *Sub) {
+    collectLoopAccesses(Sub, F, Shadowed, Accesses);
+  });
+  Shadowed.resize(NumShadowed);
+}
+
+/// codegenBoundsCheck - For an array loop, collect its accesses in bounds of
+/// the whole iteration space, and emit the check that they are. Null if
+/// this is not an array loop.
+Value *ForExprAST::codegenBoundsCheck(unsigned Var,
+  SmallVectorImpl<IndexExprAST *> &Accesses) {
+  auto *Cond = dyn_cast<BinaryExprAST>(End);
+  auto *CondVar = Cond ? dyn_cast<VariableExprAST>(Cond->getLHS()) : nullptr;
+  if (VarType != VT_Int64 || !CondVar || Cond->getOp() != '<' ||
+      CondVar->getName() != VarName || isAssignedInLoop(VarName, this) ||
+      !isInvariantBound(Cond->getRHS(), this))
     return nullptr;
+  double StepValue = 1.0;
+  if (Step) {
+    auto *StepC = dyn_cast<NumberExprAST>(Step);
+    if (!StepC || !isIntegral(StepC->getValue()) || StepC->getValue() < 1.0 ||
+        StepC->getValue() > MaxLoopStep)
+      return nullptr;
+    StepValue = StepC->getValue();
+  }
 
-  // Store the value into the alloca.
-  Builder.CreateStore(StartVal, Alloca);
+  SmallVector<Symbol, 4> Shadowed;
+  collectLoopAccesses(Body, this, Shadowed, Accesses);
+  if (Accesses.empty())
+    return nullptr;
 
-  // Make the new basic block for the loop header, inserting after current
-  // block.
-  BasicBlock *LoopBB = BasicBlock::Create(TheContext, "loop", TheFunction);
+  // The end compares as an i64, or the loop could not be counted.
+  Type *Int64Ty = Type::getInt64Ty(TheContext);
+  Value *Bound = Cond->getRHS()->codegen();
+  if (!Bound || (Bound->getType() != Int64Ty && !isInt64Constant(Bound)))
+    return nullptr;
+  Bound = convertValue(Bound, Int64Ty);
+
+  Value *StartVal = Variables.read(Var);
+  Value *StepVal = ConstantInt::get(Int64Ty, (int64_t)StepValue);
+  Value *InBounds = Builder.CreateICmpSGE(StartVal,
+    ConstantInt::get(Int64Ty, 0), "inbounds");
+  SmallVector<Symbol, 4> Arrays;
+  for (IndexExprAST *Access : Accesses) {
+    Symbol Name = cast<VariableExprAST>(Access->getArray())->getName();
+    if (is_contained(Arrays, Name))
+      continue;
+    Arrays.push_back(Name);
+
+    Value *Length = Builder.CreateExtractValue(
+      Variables.read(NamedValues.lookup(Name)), 1, "len");
+    InBounds = Builder.CreateAnd(InBounds,
+      Builder.CreateICmpSLT(StartVal, Length), "inbounds");
+    InBounds = Builder.CreateAnd(InBounds,
+      Builder.CreateICmpSLE(Bound, Builder.CreateSub(Length, StepVal)),
+      "inbounds");
+  }
+  return InBounds;
+}
 
-  // Insert an explicit fall through from the current block to the LoopBB.
-  Builder.CreateBr(LoopBB);
+/// codegenLoop - Emit the loop from its header LoopBB, which the current
+/// block branches to, to its exit AfterBB. Vectorize marks the loop for the
+/// vectorizer, its variable then being known not to overflow.
+bool ForExprAST::codegenLoop(unsigned Var, BasicBlock *LoopBB,
+  BasicBlock *AfterBB, bool Vectorize) {
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  Type *VarTy = Variables.getType(Var);
 
   // Start insertion in LoopBB.
+  TheFunction->getBasicBlockList().push_back(LoopBB);
   Builder.SetInsertPoint(LoopBB);
 
   // Within the loop, the variable is defined equal to the PHI node.  If it
-  // shadows an existing variable, we have to restore it, so save it now.
-  AllocaInst *OldVal = NamedValues[VarName];
-  NamedValues[VarName] = Alloca;
+  // shadows an existing variable, the scope restores it.
+  NamedValues.pushScope();
+  NamedValues.bind(VarName, Var);
 
   // Emit the body of the loop.  This, like any other expr, can change the
   // current BB.  Note that we ignore the value computed by the body, but don't
   // allow an error.
   if (!Body->codegen())
-    return nullptr;
+    return false;
 
   // Emit the step value.
   Value *StepVal = nullptr;
   if (Step) {
     StepVal = Step->codegen();
     if (!StepVal)
-      return nullptr;
+      return false;
   }
   else {
     // If not specified, use 1.0.
     StepVal = ConstantFP::get(TheContext, APFloat(1.0));
   }
+  StepVal = convertValue(StepVal, VarTy);
+  if (!StepVal)
+    return false;
 
   // Compute the end condition.
   Value *EndCond = End->codegen();
   if (!EndCond)
-    return nullptr;
+    return false;
 
-  // Reload, increment, and restore the alloca.  This handles the case where
+  // Reread, increment, and reassign the variable.  This handles the case where
   // the body of the loop mutates the variable.
-  Value *CurVar = Builder.CreateLoad(Alloca, VarName.c_str());
-  Value *NextVar = Builder.CreateFAdd(CurVar, StepVal, "nextvar");
-  Builder.CreateStore(NextVar, Alloca);
+  Value *CurVar = Variables.read(Var);
+  Value *NextVar;
+  if (!VarTy->isIntegerTy())
+    NextVar = Builder.CreateFAdd(CurVar, StepVal, "nextvar");
+  else if (Vectorize)
+    NextVar = Builder.CreateNSWAdd(CurVar, StepVal, "nextvar");
+  else
+    NextVar = Builder.CreateAdd(CurVar, StepVal, "nextvar");
+  Variables.write(Var, NextVar);
 
-  // Convert condition to a bool by comparing non-equal to 0.0.
-  EndCond = Builder.CreateFCmpONE(
-    EndCond, ConstantFP::get(TheContext, APFloat(0.0)), "loopcond");
+  // Convert condition to a bool by comparing non-equal to 0.
+  EndCond = CreateIsTrue(EndCond, "loopcond");
+  if (!EndCond)
+    return false;
+
+  // Insert the conditional branch into the end of LoopEndBB.  The back edge
+  // is the last predecessor of LoopBB.
+  BranchInst *BackEdge = Builder.CreateCondBr(EndCond, LoopBB, AfterBB);
+  Variables.seal(LoopBB);
+
+  // The hint lets the vectorizer reorder the reductions on doubles, so that
+  // a sum over an array may round differently from the scalar loop.
+  if (Vectorize) {
+    Metadata *Enable[] = {
+      MDString::get(TheContext, "llvm.loop.vectorize.enable"),
+      ConstantAsMetadata::get(Builder.getTrue())
+    };
+    Metadata *LoopOps[] = { nullptr, MDNode::get(TheContext, Enable) };
+    MDNode *LoopID = MDNode::getDistinct(TheContext, LoopOps);
+    LoopID->replaceOperandWith(0, LoopID);
+    BackEdge->setMetadata(LLVMContext::MD_loop, LoopID);
+  }
 
-  // Create the "after loop" block and insert it.
-  BasicBlock *AfterBB =
-    BasicBlock::Create(TheContext, "afterloop", TheFunction);
+  // Restore the unshadowed variable.
+  NamedValues.popScope();
+  return true;
+}
+
+Value *ForExprAST::codegen() {
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+
+  // Create the variable, an alloca in the entry block with UseAllocas.
+  Type *VarTy = getLLVMType(VarType);
+  unsigned Var = Variables.create(TheFunction, Symbols.getName(VarName), VarTy);
+
+  KSDbgInfo.emitLocation(this);
+
+  // Emit the start code first, without 'variable' in scope.
+  Value *StartVal = Start->codegen();
+  if (!StartVal)
+    return nullptr;
 
-  // Insert the conditional branch into the end of LoopEndBB.
-  Builder.CreateCondBr(EndCond, LoopBB, AfterBB);
+  // Assign the start value.
+  StartVal = convertValue(StartVal, VarTy);
+  if (!StartVal)
+    return nullptr;
+  Variables.write(Var, StartVal);
+
+  // Make the new basic block for the loop header, and the "after loop" block,
+  // inserted once their predecessors are.
+  BasicBlock *LoopBB = BasicBlock::Create(TheContext, "loop");
+  BasicBlock *AfterBB = BasicBlock::Create(TheContext, "afterloop");
+
+  // An innermost array loop in bounds runs without checks, other loops with.
+  // Versioning the outer loops too would copy the body once per level.
+  SmallVector<IndexExprAST *, 8> Accesses;
+  Value *InBounds =
+    containsLoop(Body) ? nullptr : codegenBoundsCheck(Var, Accesses);
+  if (InBounds) {
+    BasicBlock *VecLoopBB = BasicBlock::Create(TheContext, "vecloop");
+    Builder.CreateCondBr(InBounds, VecLoopBB, LoopBB);
+    UncheckedAccesses.insert(Accesses.begin(), Accesses.end());
+    bool Emitted = codegenLoop(Var, VecLoopBB, AfterBB, true);
+    for (IndexExprAST *Access : Accesses)
+      UncheckedAccesses.erase(Access);
+    if (!Emitted)
+      return nullptr;
+  }
+  else {
+    // Insert an explicit fall through from the current block to the LoopBB.
+    Builder.CreateBr(LoopBB);
+  }
+  if (!codegenLoop(Var, LoopBB, AfterBB, false))
+    return nullptr;
 
   // Any new code will be inserted in AfterBB.
+  TheFunction->getBasicBlockList().push_back(AfterBB);
   Builder.SetInsertPoint(AfterBB);
-
-  // Restore the unshadowed variable.
-  if (OldVal)
-    NamedValues[VarName] = OldVal;
-  else
-    NamedValues.erase(VarName);
+  Variables.seal(AfterBB);
 
   // for expr always returns 0.0.
   return Constant::getNullValue(Type::getDoubleTy(TheContext));
 }
 
 Value *VarExprAST::codegen() {
-  std::vector<AllocaInst *> OldBindings;
-
   Function *TheFunction = Builder.GetInsertBlock()->getParent();
 
   // Register all variables and emit their initializer.
-  for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
-    const std::string &VarName = VarNames[i].first;
-    ExprAST *Init = VarNames[i].second.get();
+  NamedValues.pushScope();
+  for (const VarBinding &Var : VarNames) {
+    ExprAST *Init = Var.Init;
 
     // Emit the initializer before adding the variable to scope, this prevents
     // the initializer from referencing the variable itself, and permits stuff
     // like this:
     //  var a = 1 in
     //    var a = a in ...   # refers to outer 'a'.
+    Type *VarTy = getLLVMType(Var.Type);
     Value *InitVal;
     if (Init) {
       InitVal = Init->codegen();
-      if (!InitVal)
+      if (!InitVal || !(InitVal = convertValue(InitVal, VarTy)))
         return nullptr;
     }
-    else { // If not specified, use 0.0.
-      InitVal = ConstantFP::get(TheContext, APFloat(0.0));
+    else { // If not specified, use 0.0, or an empty array.
+      InitVal = Constant::getNullValue(VarTy);
     }
 
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
-    Builder.CreateStore(InitVal, Alloca);
+    unsigned Variable =
+      Variables.create(TheFunction, Symbols.getName(Var.Name), VarTy);
+    Variables.write(Variable, InitVal);
 
-    // Remember the old variable binding so that we can restore the binding when
-    // we unrecurse.
-    OldBindings.push_back(NamedValues[VarName]);
-
-    // Remember this binding.
-    NamedValues[VarName] = Alloca;
+    // Remember this binding, the scope restores the shadowed one when we
+    // unrecurse.
+    NamedValues.bind(Var.Name, Variable);
   }
 
   KSDbgInfo.emitLocation(this);
@@ -1209,18 +2846,27 @@ Value *VarExprAST::codegen() {
     return nullptr;
 
   // Pop all our variables from scope.
-  for (unsigned i = 0, e = VarNames.size(); i != e; ++i)
-    NamedValues[VarNames[i].first] = OldBindings[i];
+  NamedValues.popScope();
 
   // Return the body computation.
   return BodyVal;
 }
 
+Value *SeqExprAST::codegen() {
+  Value *Result = nullptr;
+  for (ExprAST *E : Exprs)
+    if (!(Result = E->codegen()))
+      return nullptr;
+  return Result;
+}
+
 Function *PrototypeAST::codegen() {
-  // Make the function type:  double(double,double) etc.
-  std::vector<Type *> Doubles(Args.size(), Type::getDoubleTy(TheContext));
+  // Make the function type:  double(double,i64) etc.
+  std::vector<Type *> ParamTys;
+  for (ValueType Ty : ArgTypes)
+    ParamTys.push_back(getLLVMType(Ty));
   FunctionType *FT =
-    FunctionType::get(Type::getDoubleTy(TheContext), Doubles, false);
+    FunctionType::get(getLLVMType(ResultType), ParamTys, false);
 
   Function *F =
     Function::Create(FT, Function::ExternalLinkage, Name, TheModule.get());
@@ -1228,27 +2874,208 @@ Function *PrototypeAST::codegen() {
   // Set names for all arguments.
   unsigned Idx = 0;
   for (auto &Arg : F->args())
-    Arg.setName(Args[Idx++]);
+    Arg.setName(Symbols.getName(Args[Idx++]));
 
   return F;
 }
 
+// A memo function caches its results in a table of its module, looked up on
+// entry and filled on return. The table is direct-mapped, indexed by a hash of
+// the arguments: a result replaces the one hashed to the same entry. Each
+// entry holds a sequence number, the arguments and the result, all as i64
+// bits. The sequence number is 0 until the entry is first written, and odd
+// while it is written, as a seqlock which neither readers nor writers wait
+// on:
+//
+// lookup:
+//   seq = load acquire entry.seq
+//   args, result = load monotonic entry.args, entry.result
+//   fence acquire
+//   hit = seq != 0 && seq even && args match && load entry.seq == seq
+// store:
+//   seq = load entry.seq
+//   if seq even && cmpxchg(entry.seq, seq, seq + 1) succeeds:
+//     fence release
+//     store monotonic entry.args, entry.result
+//     store release entry.seq = seq + 2
+//
+// A writer which finds the entry busy leaves it alone. Name$memostats.N counts
+// the hits and misses of the N-th compile of the function.
+
+/// MemoStatsSymbols - The counters of the last compile of each memo function.
+/// Each compile defines its own, so that recompiling a function never defines
+/// its counters twice.
+static std::mutex MemoStatsLock;
+static std::map<std::string, std::string> MemoStatsSymbols;
+static unsigned NextMemoStats = 0;
+
+static std::string createMemoStatsSymbol(const std::string &Function) {
+  std::lock_guard<std::mutex> Guard(MemoStatsLock);
+  std::string Name =
+    Function + "$memostats." + std::to_string(NextMemoStats++);
+  MemoStatsSymbols[Function] = Name;
+  return Name;
+}
+
+/// MemoTableBits - The log2 of the entries of a memo table.
+static const unsigned MemoTableBits = 10;
+
+/// MemoEntry - The entry of the memo table for the arguments of the function
+/// being generated.
+struct MemoEntry {
+  Value *Entry = nullptr;        // [args + 2 x i64]*
+  SmallVector<Value *, 4> Keys;  // the arguments as i64 bits
+  Value *Stats = nullptr;        // [2 x i64]*, hits and misses
+};
+
+static Value *CreateAtomicLoad(Value *Ptr, AtomicOrdering Order,
+  const Twine &Name) {
+  LoadInst *Load = Builder.CreateAlignedLoad(Ptr, 8, Name);
+  Load->setAtomic(Order);
+  return Load;
+}
+
+static void CreateAtomicStore(Value *V, Value *Ptr, AtomicOrdering Order) {
+  StoreInst *Store = Builder.CreateAlignedStore(V, Ptr, 8);
+  Store->setAtomic(Order);
+}
+
+/// getMemoWord - The address of word Idx of the memo entry: the sequence
+/// number, then the arguments, then the result.
+static Value *getMemoWord(const MemoEntry &Memo, unsigned Idx) {
+  return Builder.CreateConstInBoundsGEP2_64(Memo.Entry, 0, Idx);
+}
+
+static void countMemoEvent(const MemoEntry &Memo, unsigned Counter) {
+  Builder.CreateAtomicRMW(AtomicRMWInst::Add,
+    Builder.CreateConstInBoundsGEP2_64(Memo.Stats, 0, Counter),
+    Builder.getInt64(1), AtomicOrdering::Monotonic);
+}
+
+/// emitMemoLookup - Emit the memo table of the function P being generated,
+/// and the lookup of its arguments, which returns the memoized result if any.
+static MemoEntry emitMemoLookup(Function *TheFunction, const PrototypeAST &P) {
+  Type *Int64Ty = Type::getInt64Ty(TheContext);
+  ArrayType *EntryTy = ArrayType::get(Int64Ty, P.getArgs().size() + 2);
+  ArrayType *TableTy = ArrayType::get(EntryTy, 1u << MemoTableBits);
+  ArrayType *StatsTy = ArrayType::get(Int64Ty, 2);
+  auto *Table = new GlobalVariable(*TheModule, TableTy, false,
+    GlobalValue::InternalLinkage, ConstantAggregateZero::get(TableTy),
+    P.getName() + "$memo");
+
+  MemoEntry Memo;
+  Memo.Stats = new GlobalVariable(*TheModule, StatsTy, false,
+    GlobalValue::ExternalLinkage, ConstantAggregateZero::get(StatsTy),
+    createMemoStatsSymbol(P.getName()));
+
+  // Fibonacci hashing of the argument bits.
+  Value *Hash = Builder.getInt64(0);
+  for (auto &Arg : TheFunction->args()) {
+    Value *Key = Arg.getType()->isDoubleTy()
+      ? Builder.CreateBitCast(&Arg, Int64Ty, Arg.getName() + ".bits") : &Arg;
+    Memo.Keys.push_back(Key);
+    Hash = Builder.CreateMul(Builder.CreateXor(Hash, Key),
+      Builder.getInt64(0x9E3779B97F4A7C15ULL));
+  }
+  Value *Index = Builder.CreateLShr(Hash, 64 - MemoTableBits, "memoindex");
+  Memo.Entry = Builder.CreateInBoundsGEP(Table, {Builder.getInt64(0), Index},
+    "memoentry");
+
+  Value *Seq = CreateAtomicLoad(getMemoWord(Memo, 0), AtomicOrdering::Acquire,
+    "seq");
+  Value *Hit = Builder.CreateAnd(Builder.CreateICmpNE(Seq, Builder.getInt64(0)),
+    Builder.CreateICmpEQ(Builder.CreateAnd(Seq, 1), Builder.getInt64(0)));
+  for (unsigned i = 0, e = Memo.Keys.size(); i != e; ++i) {
+    Value *Key = CreateAtomicLoad(getMemoWord(Memo, i + 1),
+      AtomicOrdering::Monotonic, "memokey");
+    Hit = Builder.CreateAnd(Hit, Builder.CreateICmpEQ(Key, Memo.Keys[i]));
+  }
+  Value *Result = CreateAtomicLoad(getMemoWord(Memo, Memo.Keys.size() + 1),
+    AtomicOrdering::Monotonic, "memoresult");
+  Builder.CreateFence(AtomicOrdering::Acquire);
+  Value *SeqAgain = CreateAtomicLoad(getMemoWord(Memo, 0),
+    AtomicOrdering::Monotonic, "seqagain");
+  Hit = Builder.CreateAnd(Hit, Builder.CreateICmpEQ(SeqAgain, Seq), "memohit");
+
+  BasicBlock *HitBB = BasicBlock::Create(TheContext, "memohit", TheFunction);
+  BasicBlock *MissBB = BasicBlock::Create(TheContext, "memomiss", TheFunction);
+  Builder.CreateCondBr(Hit, HitBB, MissBB);
+  Variables.seal(HitBB);
+  Variables.seal(MissBB);
+
+  Builder.SetInsertPoint(HitBB);
+  countMemoEvent(Memo, 0);
+  Type *ResultTy = TheFunction->getReturnType();
+  Builder.CreateRet(ResultTy->isDoubleTy()
+    ? Builder.CreateBitCast(Result, ResultTy) : Result);
+
+  Builder.SetInsertPoint(MissBB);
+  countMemoEvent(Memo, 1);
+  return Memo;
+}
+
+/// emitMemoStore - Store the result RetVal of the function being generated
+/// in the entry of its arguments, unless the entry is being written.
+static void emitMemoStore(const MemoEntry &Memo, Value *RetVal) {
+  Function *TheFunction = Builder.GetInsertBlock()->getParent();
+  Type *Int64Ty = Type::getInt64Ty(TheContext);
+  Value *SeqPtr = getMemoWord(Memo, 0);
+  Value *Seq = CreateAtomicLoad(SeqPtr, AtomicOrdering::Monotonic, "seq");
+  Value *Free = Builder.CreateICmpEQ(Builder.CreateAnd(Seq, 1),
+    Builder.getInt64(0), "memofree");
+
+  BasicBlock *LockBB = BasicBlock::Create(TheContext, "memolock", TheFunction);
+  BasicBlock *WriteBB =
+    BasicBlock::Create(TheContext, "memowrite", TheFunction);
+  BasicBlock *DoneBB = BasicBlock::Create(TheContext, "memodone", TheFunction);
+  Builder.CreateCondBr(Free, LockBB, DoneBB);
+  Variables.seal(LockBB);
+
+  Builder.SetInsertPoint(LockBB);
+  Value *Pair = Builder.CreateAtomicCmpXchg(SeqPtr, Seq,
+    Builder.CreateAdd(Seq, Builder.getInt64(1)), AtomicOrdering::Acquire,
+    AtomicOrdering::Monotonic);
+  Builder.CreateCondBr(Builder.CreateExtractValue(Pair, 1, "memolocked"),
+    WriteBB, DoneBB);
+  Variables.seal(WriteBB);
+
+  Builder.SetInsertPoint(WriteBB);
+  Builder.CreateFence(AtomicOrdering::Release);
+  for (unsigned i = 0, e = Memo.Keys.size(); i != e; ++i)
+    CreateAtomicStore(Memo.Keys[i], getMemoWord(Memo, i + 1),
+      AtomicOrdering::Monotonic);
+  Value *Result = RetVal->getType()->isDoubleTy()
+    ? Builder.CreateBitCast(RetVal, Int64Ty) : RetVal;
+  CreateAtomicStore(Result, getMemoWord(Memo, Memo.Keys.size() + 1),
+    AtomicOrdering::Monotonic);
+  CreateAtomicStore(Builder.CreateAdd(Seq, Builder.getInt64(2)), SeqPtr,
+    AtomicOrdering::Release);
+  Builder.CreateBr(DoneBB);
+  Variables.seal(DoneBB);
+
+  Builder.SetInsertPoint(DoneBB);
+}
+
 Function *FunctionAST::codegen() {
   // Transfer ownership of the prototype to the FunctionProtos map, but keep a
-  // reference to it for use below.
+  // reference to it for use below. In batch mode, the parser declared it.
   auto &P = *Proto;
-  FunctionProtos[Proto->getName()] = std::move(Proto);
+  if (!Batch)
+    FunctionProtos[Proto->getName()] = std::move(Proto);
   Function *TheFunction = getFunction(P.getName());
   if (!TheFunction)
     return nullptr;
 
   // If this is an operator, install it.
-  if (P.isBinaryOp())
-    BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+  if (P.isBinaryOp() && !Batch)
+    BinopPrecedence[(unsigned char)P.getOperatorName()] =
+      P.getBinaryPrecedence();
 
   // Create a new basic block to start insertion into.
   BasicBlock *BB = BasicBlock::Create(TheContext, "entry", TheFunction);
   Builder.SetInsertPoint(BB);
+  Variables.reset();
+  Variables.seal(BB);
 
   // Create a subprogram DIE for this function.
   DIFile *Unit = DBuilder->createFile(KSDbgInfo.TheCU->getFilename(),
@@ -1258,7 +3085,7 @@ Function *FunctionAST::codegen() {
   unsigned ScopeLine = LineNo;
   DISubprogram *SP = DBuilder->createFunction(
     FContext, P.getName(), StringRef(), Unit, LineNo,
-    CreateFunctionType(TheFunction->arg_size(), Unit),
+    CreateFunctionType(TheFunction->getFunctionType(), Unit),
     false /* internal linkage */, true /* definition */, ScopeLine,
     DINode::FlagPrototyped, false);
   TheFunction->setSubprogram(SP);
@@ -1271,32 +3098,49 @@ Function *FunctionAST::codegen() {
   // will run past them when breaking on a function)
   KSDbgInfo.emitLocation(nullptr);
 
-  // Record the function arguments in the NamedValues map.
+  // Record the function arguments in the NamedValues environment.
   NamedValues.clear();
   unsigned ArgIdx = 0;
   for (auto &Arg : TheFunction->args()) {
-    // Create an alloca for this variable.
-    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
+    // Create the variable, an alloca with UseAllocas.
+    unsigned Var = Variables.create(TheFunction, Arg.getName(), Arg.getType());
 
     // Create a debug descriptor for the variable.
     DILocalVariable *D = DBuilder->createParameterVariable(
-      SP, Arg.getName(), ++ArgIdx, Unit, LineNo, KSDbgInfo.getDoubleTy(),
-      true);
-
-    DBuilder->insertDeclare(Alloca, D, DBuilder->createExpression(),
-      DebugLoc::get(LineNo, 0, SP),
-      Builder.GetInsertBlock());
+      SP, Arg.getName(), ++ArgIdx, Unit, LineNo,
+      KSDbgInfo.getType(Arg.getType()), true);
+
+    // Describe the storage of the variable, or its incoming value in SSA form.
+    if (AllocaInst *Alloca = Variables.getAlloca(Var))
+      DBuilder->insertDeclare(Alloca, D, DBuilder->createExpression(),
+        DebugLoc::get(LineNo, 0, SP),
+        Builder.GetInsertBlock());
+    else
+      DBuilder->insertDbgValueIntrinsic(&Arg, D, DBuilder->createExpression(),
+        DebugLoc::get(LineNo, 0, SP),
+        Builder.GetInsertBlock());
 
-    // Store the initial value into the alloca.
-    Builder.CreateStore(&Arg, Alloca);
+    // Assign the initial value.
+    Variables.write(Var, &Arg);
 
     // Add arguments to variable symbol table.
-    NamedValues[Arg.getName()] = Alloca;
+    NamedValues.bind(P.getArgs()[ArgIdx - 1], Var);
   }
 
-  KSDbgInfo.emitLocation(Body.get());
+  // Return the memoized result if any, the body computes it otherwise.
+  MemoEntry Memo;
+  if (P.isMemo())
+    Memo = emitMemoLookup(TheFunction, P);
+
+  KSDbgInfo.emitLocation(Body);
+
+  Value *RetVal = Body->codegen();
+  if (RetVal)
+    RetVal = convertValue(RetVal, TheFunction->getReturnType());
+  if (RetVal) {
+    if (P.isMemo())
+      emitMemoStore(Memo, RetVal);
 
-  if (Value *RetVal = Body->codegen()) {
     // Finish off the function.
     Builder.CreateRet(RetVal);
 
@@ -1306,14 +3150,18 @@ Function *FunctionAST::codegen() {
     // Validate the generated code, checking for consistency.
     verifyFunction(*TheFunction);
 
+    // Optimize the function, vectorizing the loops marked for it.
+    if (Optimize)
+      TheFPM->run(*TheFunction);
+
     return TheFunction;
   }
 
   // Error reading body, remove function.
   TheFunction->eraseFromParent();
 
-  if (P.isBinaryOp())
-    BinopPrecedence.erase(Proto->getOperatorName());
+  if (P.isBinaryOp() && !Batch)
+    BinopPrecedence[(unsigned char)P.getOperatorName()] = 0;
 
   // Pop off the lexical block for the function since we added it
   // unconditionally.
@@ -1322,30 +3170,800 @@ Function *FunctionAST::codegen() {
   return nullptr;
 }
 
+//===----------------------------------------------------------------------===//
+// Purity Analysis
+//===----------------------------------------------------------------------===//
+
+// A function is pure when its result depends on its arguments only and
+// calling it has no other effect, so that its results can be memoized.
+// Variables are local to a call, so assigning them is pure. Externs are
+// assumed impure, and so is any use of arrays, which are shared mutable
+// memory. A pure function only calls itself and the pure functions defined
+// before it, which rules out mutual recursion.
+
+/// AutoMemo - Memoize the pure functions with tree recursion, even without
+/// the memo attribute.
+static bool AutoMemo = false;
+
+static Symbol getOperatorSymbol(const char *Prefix, char Op) {
+  return Symbols.intern((Twine(Prefix) + Twine(Op)).str());
+}
+
+static bool isBuiltinBinaryOp(char Op) {
+  return Op == '=' || Op == '+' || Op == '-' || Op == '*' || Op == '<';
+}
+
+/// isPureCallee - Whether the function Name, called by the function P, is
+/// pure. Only the parser declares prototypes, so it reads them without lock.
+static bool isPureCallee(const PrototypeAST &P, Symbol Name) {
+  StringRef Callee = Symbols.getName(Name);
+  if (Callee == P.getName())
+    return true;
+  auto FI = FunctionProtos.find(Callee.str());
+  return FI != FunctionProtos.end() && FI->second->isPure();
+}
+
+static bool isPureExpr(const PrototypeAST &P, ExprAST *E) {
+  switch (E->getKind()) {
+  case ExprAST::EK_Array:
+  case ExprAST::EK_Length:
+  case ExprAST::EK_Index:
+    return false;
+  case ExprAST::EK_Unary:
+    if (!isPureCallee(P,
+          getOperatorSymbol("unary", cast<UnaryExprAST>(E)->getOpcode())))
+      return false;
+    break;
+  case ExprAST::EK_Binary: {
+    char Op = cast<BinaryExprAST>(E)->getOp();
+    if (!isBuiltinBinaryOp(Op) &&
+        !isPureCallee(P, getOperatorSymbol("binary", Op)))
+      return false;
+    break;
+  }
+  case ExprAST::EK_Call:
+    if (!isPureCallee(P, cast<CallExprAST>(E)->getCallee()))
+      return false;
+    break;
+  default:
+    break;
+  }
+  bool Pure = true;
+  forEachChild(E, [&](ExprAST *Sub) { Pure = Pure && isPureExpr(P, Sub); });
+  return Pure;
+}
+
+/// isPureFunction - Whether the function P with body Body is pure.
+static bool isPureFunction(const PrototypeAST &P, ExprAST *Body) {
+  return !P.hasArrays() && isPureExpr(P, Body);
+}
+
+/// keepsPurity - Whether P may replace the function of the same name. The
+/// functions defined after a pure function were checked against it, and may
+/// be memoized: it cannot be replaced by an impure one.
+static bool keepsPurity(const PrototypeAST &P) {
+  auto FI = FunctionProtos.find(P.getName());
+  return P.isPure() || FI == FunctionProtos.end() || !FI->second->isPure();
+}
+
+/// countSelfCalls - The calls of the function Self in E.
+static unsigned countSelfCalls(Symbol Self, ExprAST *E) {
+  unsigned Count = 0;
+  if (auto *C = dyn_cast<CallExprAST>(E))
+    Count += C->getCallee() == Self;
+  forEachChild(E, [&](ExprAST *Sub) { Count += countSelfCalls(Self, Sub); });
+  return Count;
+}
+
+/// isMemoCandidate - Whether AutoMemo applies to the function P, pure and
+/// calling itself more than once: its calls grow exponentially with its
+/// arguments, and only linearly once memoized.
+static bool isMemoCandidate(const PrototypeAST &P, ExprAST *Body) {
+  return AutoMemo && P.isPure() &&
+    countSelfCalls(Symbols.intern(P.getName()), Body) >= 2;
+}
+
+//===----------------------------------------------------------------------===//
+// Interpreter Tier
+//===----------------------------------------------------------------------===//
+
+// In tiered mode, top-level expressions are evaluated by walking their AST,
+// and functions are interpreted until they have been called JITThreshold
+// times. They are then compiled, with the interpreted functions they call, in
+// a module of their own, and later calls go to the compiled code.
+//
+// The interpreter follows the codegen semantics exactly: unordered '<'
+// (FCmpULT), ordered conditions (FCmpONE), and for loops running the body,
+// then the step, then the end condition before the increment.
+//
+// The interpreter only has double values. Typed code, which has type
+// annotations, arrays, or calls functions with an i64 or array result, is
+// compiled on its first call, and called through an entry thunk converting
+// from and to doubles. Functions on arrays cannot be called from interpreted
+// code, and have no entry thunk.
+
+static bool Tiered = false;
+static unsigned JITThreshold = 100;
+
+static void InitializeModule(TargetMachine &TM);
+static void InitializeDebugInfo();
+
+/// TieredFunction - A function known to the tiered driver: a definition
+/// which keeps its AST while it is interpreted, or an extern.
+struct TieredFunction {
+  PrototypeAST Proto;
+  ExprAST *Body;                      // null for an extern.
+  std::unique_ptr<ASTContext> Nodes;  // owns the body nodes.
+  unsigned Calls = 0;
+  bool CompileFailed = false;
+  bool TypeChecked = false;
+  bool Typed = false;
+  JITTargetAddress Address = 0;       // compiled (or host) code, or the entry
+                                      // thunk of typed code.
+
+  TieredFunction(const PrototypeAST &Proto, ExprAST *Body,
+    std::unique_ptr<ASTContext> Nodes)
+    : Proto(Proto), Body(Body), Nodes(std::move(Nodes)) {}
+};
+
+/// TieredFunctions - The functions, indexed by the symbol of their name.
+static std::vector<std::unique_ptr<TieredFunction>> TieredFunctions;
+
+static TieredFunction *getTieredFunction(Symbol Name) {
+  return Name < TieredFunctions.size() ? TieredFunctions[Name].get() : nullptr;
+}
+
+static void registerTieredFunction(std::unique_ptr<TieredFunction> F) {
+  Symbol Name = Symbols.intern(F->Proto.getName());
+  if (Name >= TieredFunctions.size())
+    TieredFunctions.resize(Name + 1);
+  TieredFunctions[Name] = std::move(F);
+
+  // Whether a function is typed code depends on the result types of its
+  // callees, which a redefinition may change: check again the functions not
+  // compiled yet. Compiled ones are called the way they were compiled.
+  for (auto &G : TieredFunctions)
+    if (G && !G->Address)
+      G->TypeChecked = false;
+}
+
+/// collectCallees - Add the functions called by an expression to Callees.
+static void collectCallees(ExprAST *E, SmallVectorImpl<Symbol> &Callees) {
+  if (auto *U = dyn_cast<UnaryExprAST>(E))
+    Callees.push_back(getOperatorSymbol("unary", U->getOpcode()));
+  else if (auto *B = dyn_cast<BinaryExprAST>(E)) {
+    if (!isBuiltinBinaryOp(B->getOp()))
+      Callees.push_back(getOperatorSymbol("binary", B->getOp()));
+  }
+  else if (auto *C = dyn_cast<CallExprAST>(E))
+    Callees.push_back(C->getCallee());
+  forEachChild(E, [&](ExprAST *Sub) { collectCallees(Sub, Callees); });
+}
+
+static bool hasTypeAnnotations(ExprAST *E) {
+  if (isa<ArrayExprAST>(E) || isa<LengthExprAST>(E) || isa<IndexExprAST>(E))
+    return true;
+  if (auto *F = dyn_cast<ForExprAST>(E)) {
+    if (F->getVarType() != VT_Double)
+      return true;
+  }
+  else if (auto *V = dyn_cast<VarExprAST>(E)) {
+    for (const VarBinding &Var : V->getVarNames())
+      if (Var.Type != VT_Double)
+        return true;
+  }
+  bool Annotated = false;
+  forEachChild(E, [&](ExprAST *Sub) {
+    Annotated = Annotated || hasTypeAnnotations(Sub);
+  });
+  return Annotated;
+}
+
+/// isTypedCode - Whether E has values the interpreter cannot represent: typed
+/// variables, arrays, or results of functions with an i64 or array result.
+static bool isTypedCode(ExprAST *E) {
+  if (hasTypeAnnotations(E))
+    return true;
+  SmallVector<Symbol, 16> Callees;
+  collectCallees(E, Callees);
+  for (Symbol Callee : Callees)
+    if (TieredFunction *G = getTieredFunction(Callee))
+      if (G->Proto.getResultType() != VT_Double)
+        return true;
+  return false;
+}
+
+/// isTypedFunction - Whether F is typed code, checked on its first use
+/// against the functions defined at that time, and again once one is
+/// redefined.
+static bool isTypedFunction(TieredFunction *F) {
+  if (!F->TypeChecked) {
+    F->Typed = F->Proto.isTyped() || (F->Body && isTypedCode(F->Body));
+    F->TypeChecked = true;
+  }
+  return F->Typed;
+}
+
+/// hasEntryThunk - Whether F is called from interpreted code through its entry
+/// thunk.
+static bool hasEntryThunk(TieredFunction *F) {
+  return isTypedFunction(F) && !F->Proto.hasArrays();
+}
+
+/// emitEntryThunk - Emit Name$entry, which calls the function with its
+/// arguments read from an array of doubles, and returns its result as a
+/// double.
+static void emitEntryThunk(const PrototypeAST &P) {
+  Function *F = getFunction(P.getName());
+  Type *DoubleTy = Type::getDoubleTy(TheContext);
+  FunctionType *FT =
+    FunctionType::get(DoubleTy, {DoubleTy->getPointerTo()}, false);
+  Function *Thunk = Function::Create(FT, Function::ExternalLinkage,
+    P.getName() + "$entry", TheModule.get());
+  Builder.SetInsertPoint(BasicBlock::Create(TheContext, "entry", Thunk));
+  KSDbgInfo.emitLocation(nullptr);
+
+  Value *ArgArray = &*Thunk->arg_begin();
+  std::vector<Value *> ArgsV;
+  for (Argument &Arg : F->args()) {
+    Value *ArgPtr =
+      Builder.CreateConstGEP1_32(ArgArray, Arg.getArgNo(), "argptr");
+    Value *ArgV = Builder.CreateLoad(ArgPtr, "arg");
+    ArgsV.push_back(convertValue(ArgV, Arg.getType()));
+  }
+  Value *Result = Builder.CreateCall(F, ArgsV, "result");
+  Builder.CreateRet(convertValue(Result, DoubleTy));
+}
+
+/// compileTieredFunction - Compile F and the interpreted functions it may
+/// call in a new module, as the compiled code cannot call back into the
+/// interpreter.
+static void compileTieredFunction(TieredFunction *F) {
+  SmallVector<TieredFunction *, 8> Functions = {F};
+  SmallPtrSet<TieredFunction *, 8> Visited = {F};
+  SmallVector<Symbol, 16> Callees;
+  for (unsigned i = 0; i != Functions.size(); ++i) {
+    if (!Functions[i]->Body)
+      continue; // A typed extern, compiled for its entry thunk.
+    Callees.clear();
+    collectCallees(Functions[i]->Body, Callees);
+    for (Symbol Callee : Callees) {
+      TieredFunction *G = getTieredFunction(Callee);
+      if (G && G->Body && !G->Address && Visited.insert(G).second)
+        Functions.push_back(G);
+    }
+  }
+
+  InitializeModule(TheJIT->getTargetMachine());
+  InitializeDebugInfo();
+  bool Failed = false;
+  for (TieredFunction *G : Functions) {
+    if (!G->Body)
+      continue;
+    FunctionAST FnAST(llvm::make_unique<PrototypeAST>(G->Proto), G->Body);
+    if (!FnAST.codegen())
+      Failed = true;
+  }
+  for (TieredFunction *G : Functions)
+    if (!Failed && hasEntryThunk(G))
+      emitEntryThunk(G->Proto);
+  DBuilder->finalize();
+  DBuilder.reset();
+  TheFPM.reset();
+
+  if (Failed) {
+    for (TieredFunction *G : Functions)
+      G->CompileFailed = true;
+    TheModule.reset();
+    return;
+  }
+  TheJIT->addModule(std::move(TheModule));
+  for (TieredFunction *G : Functions) {
+    std::string Name = G->Proto.getName();
+    if (hasEntryThunk(G))
+      Name += "$entry";
+    if (auto Sym = TheJIT->findSymbol(Name))
+      G->Address = cantFail(Sym.getAddress());
+  }
+}
+
+/// LiveArrays - The arrays allocated by allocarray, not freed yet.
+static std::vector<double *> LiveArrays;
+
+/// ArrayScope - Free the arrays allocated during a top-level call. No array
+/// outlives it: arrays are neither passed to interpreted code nor returned
+/// from a top-level expression.
+class ArrayScope {
+  size_t Mark = LiveArrays.size();
+
+public:
+  ~ArrayScope() {
+    for (size_t i = Mark, e = LiveArrays.size(); i != e; ++i)
+      free(LiveArrays[i]);
+    LiveArrays.resize(Mark);
+  }
+};
+
+/// callNative - Call compiled or host code with the toy calling convention.
+/// Functions with more arguments than MaxNativeArgs stay interpreted.
+static const unsigned MaxNativeArgs = 6;
+
+static double callNative(JITTargetAddress Address, ArrayRef<double> A) {
+  ArrayScope Arrays;
+  switch (A.size()) {
+  case 0:
+    return ((double (*)())Address)();
+  case 1:
+    return ((double (*)(double))Address)(A[0]);
+  case 2:
+    return ((double (*)(double, double))Address)(A[0], A[1]);
+  case 3:
+    return ((double (*)(double, double, double))Address)(A[0], A[1], A[2]);
+  case 4:
+    return ((double (*)(double, double, double, double))Address)(
+      A[0], A[1], A[2], A[3]);
+  case 5:
+    return ((double (*)(double, double, double, double, double))Address)(
+      A[0], A[1], A[2], A[3], A[4]);
+  case 6:
+    return ((double (*)(double, double, double, double, double, double))
+      Address)(A[0], A[1], A[2], A[3], A[4], A[5]);
+  }
+  llvm_unreachable("too many arguments for a native call");
+}
+
+/// callEntry - Call typed code through its entry thunk.
+static double callEntry(JITTargetAddress Address, ArrayRef<double> A) {
+  ArrayScope Arrays;
+  return ((double (*)(const double *))Address)(A.data());
+}
+
+/// VarSlot - Where a variable lives: the index of its value in Slots, for the
+/// call depth which bound it. Variables of the callers are not visible.
+struct VarSlot {
+  unsigned Depth;
+  unsigned Index;
+};
+
+static std::vector<double> Slots;
+static ScopedEnvironment<VarSlot> Locals;
+static unsigned FrameDepth = 0;
+static bool EvalFailed = false;
+
+static double LogErrorEval(const char *Str) {
+  LogError(Str);
+  EvalFailed = true;
+  return 0;
+}
+
+static double *lookupSlot(Symbol Name) {
+  VarSlot S = Locals.lookup(Name);
+  return S.Depth == FrameDepth ? &Slots[S.Index] : nullptr;
+}
+
+static void bindSlot(Symbol Name, double Value) {
+  Locals.bind(Name, {FrameDepth, (unsigned)Slots.size()});
+  Slots.push_back(Value);
+}
+
+static double callTieredFunction(Symbol Callee, ArrayRef<double> Args);
+
+static double evaluate(ExprAST *E) {
+  switch (E->getKind()) {
+  case ExprAST::EK_Number:
+    return cast<NumberExprAST>(E)->getValue();
+  case ExprAST::EK_Variable: {
+    double *Slot = lookupSlot(cast<VariableExprAST>(E)->getName());
+    if (!Slot)
+      return LogErrorEval("Unknown variable name");
+    return *Slot;
+  }
+  case ExprAST::EK_Unary: {
+    auto *U = cast<UnaryExprAST>(E);
+    double Operand = evaluate(U->getOperand());
+    return callTieredFunction(getOperatorSymbol("unary", U->getOpcode()),
+      Operand);
+  }
+  case ExprAST::EK_Binary: {
+    auto *B = cast<BinaryExprAST>(E);
+    if (B->getOp() == '=') {
+      auto *LHSE = dyn_cast<VariableExprAST>(B->getLHS());
+      if (!LHSE)
+        return LogErrorEval("destination of '=' must be a variable");
+      double Val = evaluate(B->getRHS());
+      double *Slot = lookupSlot(LHSE->getName());
+      if (!Slot)
+        return LogErrorEval("Unknown variable name");
+      return *Slot = Val;
+    }
+    double L = evaluate(B->getLHS());
+    double R = evaluate(B->getRHS());
+    switch (B->getOp()) {
+    case '+':
+      return L + R;
+    case '-':
+      return L - R;
+    case '*':
+      return L * R;
+    case '<':
+      return !(L >= R) ? 1.0 : 0.0; // Unordered or less than.
+    }
+    double Ops[] = { L, R };
+    return callTieredFunction(getOperatorSymbol("binary", B->getOp()), Ops);
+  }
+  case ExprAST::EK_Call: {
+    auto *C = cast<CallExprAST>(E);
+    SmallVector<double, 8> Args;
+    for (ExprAST *Arg : C->getArgs())
+      Args.push_back(evaluate(Arg));
+    return callTieredFunction(C->getCallee(), Args);
+  }
+  case ExprAST::EK_If: {
+    auto *I = cast<IfExprAST>(E);
+    return isTrue(evaluate(I->getCond())) ? evaluate(I->getThen())
+                                          : evaluate(I->getElse());
+  }
+  case ExprAST::EK_For: {
+    auto *F = cast<ForExprAST>(E);
+    double Start = evaluate(F->getStart());
+    Locals.pushScope();
+    bindSlot(F->getVarName(), Start);
+    unsigned Index = Slots.size() - 1;
+    while (!EvalFailed) {
+      evaluate(F->getBody());
+      double Step = F->getStep() ? evaluate(F->getStep()) : 1.0;
+      double EndCond = evaluate(F->getEnd());
+      Slots[Index] += Step;
+      if (!isTrue(EndCond))
+        break;
+    }
+    Locals.popScope();
+    Slots.resize(Index);
+    return 0.0;
+  }
+  case ExprAST::EK_Seq: {
+    double Result = 0.0;
+    for (ExprAST *Sub : cast<SeqExprAST>(E)->getExprs())
+      Result = evaluate(Sub);
+    return Result;
+  }
+  case ExprAST::EK_Var: {
+    auto *V = cast<VarExprAST>(E);
+    size_t Base = Slots.size();
+    Locals.pushScope();
+    for (const VarBinding &Var : V->getVarNames())
+      bindSlot(Var.Name, Var.Init ? evaluate(Var.Init) : 0.0);
+    double Result = evaluate(V->getBody());
+    Locals.popScope();
+    Slots.resize(Base);
+    return Result;
+  }
+  case ExprAST::EK_Array:
+  case ExprAST::EK_Length:
+  case ExprAST::EK_Index:
+    return LogErrorEval("Cannot interpret arrays"); // Typed code.
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
+static double callTieredFunction(Symbol Callee, ArrayRef<double> Args) {
+  TieredFunction *F = getTieredFunction(Callee);
+  if (!F)
+    return LogErrorEval("Unknown function referenced");
+  if (F->Proto.getArgs().size() != Args.size())
+    return LogErrorEval("Incorrect # arguments passed");
+  if (F->Proto.hasArrays())
+    return LogErrorEval("Cannot pass arrays to or from interpreted code");
+  if (EvalFailed)
+    return 0;
+
+  bool Typed = isTypedFunction(F);
+  bool Native = Typed || Args.size() <= MaxNativeArgs;
+  if (!F->Body && !F->Address && !Typed) {
+    // Extern: resolve it in the host process.
+    auto Sym = TheJIT->findSymbol(F->Proto.getName());
+    if (!Sym || !Native)
+      return LogErrorEval("Cannot call extern function");
+    F->Address = cantFail(Sym.getAddress());
+  }
+  else if (Native && !F->Address && !F->CompileFailed &&
+    (Typed || ++F->Calls > JITThreshold)) {
+    compileTieredFunction(F);
+  }
+
+  if (F->Address && Native)
+    return Typed ? callEntry(F->Address, Args) : callNative(F->Address, Args);
+  if (Typed)
+    return LogErrorEval("Cannot interpret typed code");
+
+  // Interpret the body in a new frame.
+  size_t Base = Slots.size();
+  FrameDepth++;
+  Locals.pushScope();
+  ArrayRef<Symbol> ArgNames = F->Proto.getArgs();
+  for (unsigned i = 0, e = Args.size(); i != e; ++i)
+    bindSlot(ArgNames[i], Args[i]);
+  double Result = evaluate(F->Body);
+  Locals.popScope();
+  FrameDepth--;
+  Slots.resize(Base);
+  return Result;
+}
+
+/// evaluateTopLevel - Evaluate a top-level expression in an empty frame, or
+/// compile it if it is typed code.
+static bool evaluateTopLevel(ExprAST *Body, double &Result) {
+  if (isTypedCode(Body)) {
+    static unsigned TypedExprs = 0;
+    TieredFunction F(PrototypeAST(Body->getLoc(),
+                                  "__anon_typed" + std::to_string(TypedExprs++),
+                                  {}, {}, VT_Double),
+                     Body, nullptr);
+    compileTieredFunction(&F);
+    if (!F.Address)
+      return false;
+    Result = callEntry(F.Address, None);
+    return true;
+  }
+
+  Locals.clear();
+  Slots.clear();
+  FrameDepth = 1;
+  EvalFailed = false;
+  Result = evaluate(Body);
+  return !EvalFailed;
+}
+
+//===----------------------------------------------------------------------===//
+// Batch Compilation
+//===----------------------------------------------------------------------===//
+
+// In batch mode, the whole input is compiled as one unit. The main thread
+// lexes and parses, while worker threads generate the IR of the parsed
+// functions, each in its own context and module, and compile their module to
+// an object. The objects are then linked in the JIT, and the top-level
+// expressions are run in source order. As a whole-file unit, a function can
+// call functions defined further in the file.
+
+static unsigned BatchThreads = std::thread::hardware_concurrency();
+
+/// BatchQueue - The parsed functions waiting for a worker.
+class BatchQueue {
+  std::mutex Lock;
+  std::condition_variable Ready;
+  std::deque<FunctionAST *> Functions;
+  bool Closed = false;
+
+public:
+  void push(FunctionAST *FnAST) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Functions.push_back(FnAST);
+    Ready.notify_one();
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Closed = true;
+    Ready.notify_all();
+  }
+
+  /// Return the next function, or null once the queue is closed and empty.
+  FunctionAST *pop() {
+    std::unique_lock<std::mutex> Guard(Lock);
+    Ready.wait(Guard, [&]() { return Closed || !Functions.empty(); });
+    if (Functions.empty())
+      return nullptr;
+    FunctionAST *FnAST = Functions.front();
+    Functions.pop_front();
+    return FnAST;
+  }
+};
+
+/// BatchObjects - The objects compiled by the workers.
+struct BatchObjects {
+  std::mutex Lock;
+  std::vector<SimpleCompiler::CompileResult> Objects;
+};
+
+static void runBatchWorker(BatchQueue &Queue, BatchObjects &Results) {
+  // The target machine is not shared: each worker optimizes and runs its own
+  // codegen.
+  std::unique_ptr<TargetMachine> TM(KaleidoscopeJIT::selectHostTarget());
+  InitializeModule(*TM);
+  InitializeDebugInfo();
+  while (FunctionAST *FnAST = Queue.pop()) {
+    if (!FnAST->codegen())
+      fprintf(stderr, "Error reading function definition:");
+  }
+  DBuilder->finalize();
+
+  SimpleCompiler Compile(*TM);
+  auto Object = Compile(*TheModule);
+  TheFPM.reset();
+  DBuilder.reset();
+  TheModule.reset();
+
+  std::lock_guard<std::mutex> Guard(Results.Lock);
+  Results.Objects.push_back(std::move(Object));
+}
+
+static void declareBatchPrototype(const PrototypeAST &P) {
+  std::lock_guard<std::mutex> Guard(ProtosLock);
+  FunctionProtos[P.getName()] = llvm::make_unique<PrototypeAST>(P);
+  ProtosDeclared.notify_all();
+}
+
+/// CompileBatch - top ::= definition | external | expression | ';'
+static void CompileBatch() {
+  BatchQueue Queue;
+  BatchObjects Results;
+  std::vector<std::unique_ptr<FunctionAST>> Functions;
+  std::vector<std::string> TopLevelNames;
+  std::set<std::string> Defined;
+
+  BatchParsing = true;
+  std::vector<std::thread> Workers;
+  for (unsigned i = 0, e = std::max(BatchThreads, 1u); i != e; ++i)
+    Workers.emplace_back([&]() { runBatchWorker(Queue, Results); });
+
+  while (CurTok != tok_eof) {
+    std::unique_ptr<FunctionAST> FnAST;
+    switch (CurTok) {
+    case ';': // ignore top-level semicolons.
+      getNextToken();
+      continue;
+    case tok_def:
+      FnAST = ParseDefinition();
+      // Operators are installed as soon as parsed, for the following code.
+      if (FnAST && FnAST->getProto().isBinaryOp())
+        BinopPrecedence[(unsigned char)FnAST->getProto().getOperatorName()] =
+          FnAST->getProto().getBinaryPrecedence();
+      break;
+    case tok_extern:
+      if (auto ProtoAST = ParseExtern())
+        declareBatchPrototype(*ProtoAST);
+      else
+        getNextToken(); // Skip token for error recovery.
+      continue;
+    default:
+      // Top-level expressions get a name of their own to be run after link.
+      TopLevelNames.push_back("__anon_expr" +
+        std::to_string(TopLevelNames.size()));
+      FnAST = ParseTopLevelExpr(TopLevelNames.back());
+      if (!FnAST)
+        TopLevelNames.pop_back();
+      break;
+    }
+
+    if (!FnAST) {
+      // Skip token for error recovery.
+      getNextToken();
+      continue;
+    }
+    // Definitions are compiled by different workers and linked together: a
+    // second one would not replace the first, as it does out of batch mode.
+    if (!Defined.insert(FnAST->getProto().getName()).second) {
+      LogError(("Function " + FnAST->getProto().getName() +
+                " is already defined in this batch").c_str());
+      continue;
+    }
+    declareBatchPrototype(FnAST->getProto());
+    Queue.push(FnAST.get());
+    Functions.push_back(std::move(FnAST));
+  }
+
+  {
+    std::lock_guard<std::mutex> Guard(ProtosLock);
+    BatchParsing = false;
+    ProtosDeclared.notify_all();
+  }
+  Queue.close();
+  for (auto &Worker : Workers)
+    Worker.join();
+
+  // Link, then run the top-level expressions in order.
+  for (auto &Object : Results.Objects)
+    TheJIT->addObject(std::move(Object));
+  for (const std::string &Name : TopLevelNames) {
+    auto ExprSymbol = TheJIT->findSymbol(Name);
+    if (!ExprSymbol) {
+      fprintf(stderr, "Error generating code for top level expr");
+      continue;
+    }
+    auto Address = ExprSymbol.getAddress();
+    if (!Address) {
+      logAllUnhandledErrors(Address.takeError(), errs(), "Error: ");
+      continue;
+    }
+    double (*FP)() = (double (*)())(intptr_t)*Address;
+    ArrayScope Arrays;
+    fprintf(stderr, "Evaluated to %f\n", FP());
+  }
+
+  Functions.clear();
+  TheAST.reset();
+}
+
 //===----------------------------------------------------------------------===//
 // Top-Level parsing and JIT Driver
 //===----------------------------------------------------------------------===//
 
-static void InitializeModule() {
+static void InitializeModule(TargetMachine &TM) {
   // Open a new module.
   TheModule = llvm::make_unique<Module>("my cool jit", TheContext);
   TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
+
+  // With -opt, create the optimizer of the functions of the module, with the
+  // cost model of the target TM compiling it. The loop passes bring the loops
+  // to the form the vectorizer expects, and the loops marked by the frontend
+  // are vectorized for the host instruction set.
+  if (!Optimize)
+    return;
+  TheFPM = llvm::make_unique<legacy::FunctionPassManager>(TheModule.get());
+  TheFPM->add(createTargetTransformInfoWrapperPass(TM.getTargetIRAnalysis()));
+  TheFPM->add(createPromoteMemoryToRegisterPass());
+  TheFPM->add(createInstructionCombiningPass());
+  TheFPM->add(createCFGSimplificationPass());
+  TheFPM->add(createLICMPass());
+  TheFPM->add(createIndVarSimplifyPass());
+  TheFPM->add(createLoopVectorizePass());
+  TheFPM->add(createInstructionCombiningPass());
+  TheFPM->add(createCFGSimplificationPass());
+  TheFPM->doInitialization();
+}
+
+static void InitializeDebugInfo() {
+  // Add the current debug info version into the module.
+  TheModule->addModuleFlag(Module::Warning, "Debug Info Version",
+    DEBUG_METADATA_VERSION);
+
+  // Darwin only supports dwarf2.
+  if (Triple(sys::getProcessTriple()).isOSDarwin())
+    TheModule->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 2);
+
+  // Construct the DIBuilder, we do this here because we need the module.
+  DBuilder = llvm::make_unique<DIBuilder>(*TheModule);
+
+  // Create the compile unit for the module.
+  // Currently down as "fib.ks" as a filename since we're redirecting stdin
+  // but we'd like actual source locations.
+  KSDbgInfo.TheCU = DBuilder->createCompileUnit(
+    dwarf::DW_LANG_C,
+    DBuilder->createFile("fib.ks", "D:\\git\\llvm_test\\llvm_objuse"),
+    "Kaleidoscope Compiler", 0, "", 0);
 }
 
 static void HandleDefinition() {
   if (auto FnAST = ParseDefinition()) {
-    if (!FnAST->codegen())
+    if (Tiered) {
+      // Keep the function to interpret it: its nodes are moved out of the
+      // parser context, and its prototype is declared for later compiles.
+      const PrototypeAST &P = FnAST->getProto();
+      if (P.isBinaryOp())
+        BinopPrecedence[(unsigned char)P.getOperatorName()] =
+          P.getBinaryPrecedence();
+      FunctionProtos[P.getName()] = llvm::make_unique<PrototypeAST>(P);
+      registerTieredFunction(llvm::make_unique<TieredFunction>(
+        P, FnAST->getBody(), llvm::make_unique<ASTContext>(std::move(TheAST))));
+    }
+    else if (!FnAST->codegen())
       fprintf(stderr, "Error reading function definition:");
   }
   else {
     // Skip token for error recovery.
     getNextToken();
   }
+  TheAST.reset();
 }
 
 static void HandleExtern() {
   if (auto ProtoAST = ParseExtern()) {
-    if (!ProtoAST->codegen())
+    if (Tiered) {
+      registerTieredFunction(
+        llvm::make_unique<TieredFunction>(*ProtoAST, nullptr, nullptr));
+      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+    }
+    else if (!ProtoAST->codegen())
       fprintf(stderr, "Error reading extern");
     else
       FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
@@ -1357,9 +3975,20 @@ static void HandleExtern() {
 }
 
 static void HandleTopLevelExpression() {
-  // Evaluate a top-level expression into an anonymous function.
-  if (auto FnAST = ParseTopLevelExpr()) {
-    if (!FnAST->codegen()) {
+  // Evaluate a top-level expression into an anonymous function. Compiled into
+  // the module, each one gets a name of its own after the first.
+  static unsigned TopLevelCount = 0;
+  std::string Name = "__anon_expr";
+  if (!Tiered && TopLevelCount++)
+    Name += std::to_string(TopLevelCount - 1);
+  if (auto FnAST = ParseTopLevelExpr(Name)) {
+    if (Tiered) {
+      // One-shot code: interpret it rather than compiling it.
+      double Result;
+      if (evaluateTopLevel(FnAST->getBody(), Result))
+        fprintf(stderr, "Evaluated to %f\n", Result);
+    }
+    else if (!FnAST->codegen()) {
       fprintf(stderr, "Error generating code for top level expr");
     }
   }
@@ -1367,6 +3996,7 @@ static void HandleTopLevelExpression() {
     // Skip token for error recovery.
     getNextToken();
   }
+  TheAST.reset();
 }
 
 /// top ::= definition | external | expression | ';'
@@ -1391,6 +4021,27 @@ static void MainLoop() {
   }
 }
 
+/// printMemoStats - Print the hits and misses of the memo functions which
+/// were compiled, interpreted calls are not memoized.
+static void printMemoStats() {
+  for (auto &Proto : FunctionProtos) {
+    auto StatsName = MemoStatsSymbols.find(Proto.first);
+    if (!Proto.second->isMemo() || StatsName == MemoStatsSymbols.end())
+      continue;
+    auto StatsSymbol = TheJIT->findSymbol(StatsName->second);
+    if (!StatsSymbol)
+      continue;
+    auto Address = StatsSymbol.getAddress();
+    if (!Address) {
+      logAllUnhandledErrors(Address.takeError(), errs(), "Error: ");
+      continue;
+    }
+    const uint64_t *Stats = (const uint64_t *)(intptr_t)*Address;
+    fprintf(stderr, "memo %s: %llu hits, %llu misses\n", Proto.first.c_str(),
+            (unsigned long long)Stats[0], (unsigned long long)Stats[1]);
+  }
+}
+
 //===----------------------------------------------------------------------===//
 // "Library" functions that can be "extern'd" from user code.
 //===----------------------------------------------------------------------===//
@@ -1413,12 +4064,112 @@ extern "C" DLLEXPORT double printd(double X) {
   return 0;
 }
 
+/// allocarray - The elements of array(n), set to 0.0, freed at the end of
+/// the top-level call allocating them.
+extern "C" DLLEXPORT double *allocarray(int64_t Length) {
+  if (Length < 0) {
+    fprintf(stderr, "Error: negative array length %lld\n", (long long)Length);
+    exit(1);
+  }
+  double *Data = (double *)calloc(Length, sizeof(double));
+  if (!Data && Length) {
+    fprintf(stderr, "Error: out of memory for an array of %lld\n",
+            (long long)Length);
+    exit(1);
+  }
+  if (Data)
+    LiveArrays.push_back(Data);
+  return Data;
+}
+
+/// arrayindexerror - Report an array access out of bounds, and exit.
+extern "C" DLLEXPORT void arrayindexerror(int64_t Index, int64_t Length) {
+  fprintf(stderr, "Error: index %lld out of bounds of an array of %lld\n",
+          (long long)Index, (long long)Length);
+  exit(1);
+}
+
+/// runLexerBenchmark - Lex the whole input Repeat times without parsing it,
+/// and print the token count and the lexing throughput.
+static void runLexerBenchmark(int Repeat) {
+  uint64_t Tokens = 0;
+  auto Start = std::chrono::steady_clock::now();
+  for (int i = 0; i < Repeat; i++) {
+    LexPtr = LexLineStart = LexBuffer->getBufferStart();
+    LexLine = 1;
+    while (gettok() != tok_eof)
+      Tokens++;
+  }
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+
+  double Bytes = (double)LexBuffer->getBufferSize() * Repeat;
+  double Seconds = Elapsed.count() > 0 ? Elapsed.count() : 1e-9;
+  fprintf(stderr, "Lexed %.0f bytes, %llu tokens in %.3f s: %.3f GB/s, "
+          "%.1f Mtokens/s\n", Bytes, (unsigned long long)Tokens, Seconds,
+          Bytes / Seconds / 1e9, Tokens / Seconds / 1e6);
+}
+
 //===----------------------------------------------------------------------===//
 // Main driver code.
 //===----------------------------------------------------------------------===//
 #include <stdio.h>
 
-int main() {
+int main(int argc, char *argv[]) {
+  const char *InputPath = nullptr;
+  const char *ObjectPath = "D:\\git\\llvm_test\\llvm_objuse\\jitted.obj";
+  bool MemoStats = false;
+  int LexBenchRepeat = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-heap-ast"))
+      TheAST.setHeapAllocation(true); // One allocation per node, to compare.
+    else if (!strcmp(argv[i], "-tiered"))
+      Tiered = true;
+    else if (!strncmp(argv[i], "-jit-threshold=", 15))
+      JITThreshold = atoi(argv[i] + 15);
+    else if (!strcmp(argv[i], "-no-fold"))
+      FoldConstants = false;
+    else if (!strcmp(argv[i], "-opt"))
+      Optimize = true; // Optimize, and vectorize the array loops.
+    else if (!strcmp(argv[i], "-allocas"))
+      UseAllocas = true; // Leave the SSA construction to mem2reg, to compare.
+    else if (!strcmp(argv[i], "-auto-memo"))
+      AutoMemo = true;
+    else if (!strcmp(argv[i], "-memo-stats"))
+      MemoStats = true;
+    else if (!strcmp(argv[i], "-batch"))
+      Batch = true;
+    else if (!strncmp(argv[i], "-threads=", 9))
+      BatchThreads = atoi(argv[i] + 9);
+    else if (!strncmp(argv[i], "-obj=", 5))
+      ObjectPath = argv[i] + 5;
+    else if (!strcmp(argv[i], "-lex-bench"))
+      LexBenchRepeat = 10;
+    else if (!strncmp(argv[i], "-lex-bench=", 11))
+      LexBenchRepeat = atoi(argv[i] + 11);
+    else
+      InputPath = argv[i];
+  }
+
+  // Lex the given file ('-' for stdin), or the builtin fib sample.
+  if (InputPath) {
+    auto Buffer = MemoryBuffer::getFileOrSTDIN(InputPath);
+    if (!Buffer) {
+      fprintf(stderr, "Error: cannot read %s: %s\n", InputPath,
+              Buffer.getError().message().c_str());
+      return 1;
+    }
+    setLexerInput(std::move(*Buffer));
+  } else {
+    setLexerInput(MemoryBuffer::getMemBuffer(DefaultSource, "fib.ks"));
+  }
+
+  // Only measure the lexer, the input is neither parsed nor compiled.
+  if (LexBenchRepeat > 0) {
+    runLexerBenchmark(LexBenchRepeat);
+    return 0;
+  }
+
   InitializeNativeTarget();
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();
@@ -1436,31 +4187,33 @@ int main() {
 
   TheJIT = llvm::make_unique<KaleidoscopeJIT>();
 
-  InitializeModule();
-
-  // Add the current debug info version into the module.
-  TheModule->addModuleFlag(Module::Warning, "Debug Info Version",
-    DEBUG_METADATA_VERSION);
-
-  // Darwin only supports dwarf2.
-  if (Triple(sys::getProcessTriple()).isOSDarwin())
-    TheModule->addModuleFlag(llvm::Module::Warning, "Dwarf Version", 2);
+  // In batch mode, compile the whole input on all cores, then run it.
+  if (Batch) {
+    CompileBatch();
+    if (MemoStats)
+      printMemoStats();
+    return 0;
+  }
 
-  // Construct the DIBuilder, we do this here because we need the module.
-  DBuilder = llvm::make_unique<DIBuilder>(*TheModule);
+  // In tiered mode, evaluate the whole input, compiling hot functions only.
+  if (Tiered) {
+    MainLoop();
+    if (MemoStats)
+      printMemoStats();
+    return 0;
+  }
 
-  // Create the compile unit for the module.
-  // Currently down as "fib.ks" as a filename since we're redirecting stdin
-  // but we'd like actual source locations.
-  KSDbgInfo.TheCU = DBuilder->createCompileUnit(
-    dwarf::DW_LANG_C,
-    DBuilder->createFile("fib.ks", "D:\\git\\llvm_test\\llvm_objuse"),
-    "Kaleidoscope Compiler", 0, "", 0);
+  InitializeModule(TheJIT->getTargetMachine());
+  InitializeDebugInfo();
 
-  // Run the main "interpreter loop" now.
-  //MainLoop();
-  HandleDefinition();
-  HandleTopLevelExpression();
+  // Compile the whole input file into the module, the builtin sample being
+  // one definition and one expression.
+  if (InputPath)
+    MainLoop();
+  else {
+    HandleDefinition();
+    HandleTopLevelExpression();
+  }
 
   // Finalize the debug info.
   DBuilder->finalize();
@@ -1470,7 +4223,11 @@ int main() {
 
   StringRef bytes = result.getBinary()->getMemoryBufferRef().getBuffer();
 
-  FILE* f = fopen("D:\\git\\llvm_test\\llvm_objuse\\jitted.obj", "wb");
+  FILE* f = fopen(ObjectPath, "wb");
+  if (!f) {
+    fprintf(stderr, "Error: cannot write %s\n", ObjectPath);
+    return 1;
+  }
   int bytes_count = bytes.bytes_end() - bytes.bytes_begin();
   fwrite(bytes.bytes_begin(), bytes_count, 1, f);
   fclose(f);
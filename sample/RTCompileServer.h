@@ -0,0 +1,561 @@
+#pragma once
+
+#include "./RTThreadPool.h"
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/Debug.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Target/TargetMachine.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <windows.h>
+#include <sddl.h>
+
+// The protocol of the compile server, over a byte pipe: a request header,
+// then the target, the module identifier and the bitcode; a response header,
+// then the relocatable object, or the error message
+struct RTCompileRequest {
+   static constexpr uint32_t Magic = 0x52544352; // 'RTCR'
+   static constexpr uint32_t Version = 2;
+   static constexpr uint32_t MaxNameLength = 4096;
+   uint32_t magic;
+   uint32_t version;
+   uint32_t targetLength;
+   uint32_t identifierLength;
+   uint64_t bitcodeSize;
+};
+struct RTCompileResponse {
+   static constexpr uint32_t Magic = 0x52544341; // 'RTCA'
+   enum Status : uint32_t { Compiled, Failed, TargetMismatch };
+   uint32_t magic;
+   uint32_t status;
+   uint64_t size;
+};
+
+/// The code generation settings a module is compiled with: a server only
+/// compiles for clients which would generate the same code.
+inline std::string getCompileTarget(const llvm::TargetMachine& TM) {
+   std::string target;
+   llvm::raw_string_ostream(target) << TM.getTargetTriple().str() << " " << TM.getTargetCPU() << " "
+      << TM.getTargetFeatureString() << " O" << (int)TM.getOptLevel() << " "
+      << TM.createDataLayout().getStringRepresentation();
+   return target;
+}
+
+/// The SID of the user a process runs as, or empty if it cannot be read.
+inline std::string getProcessUser(HANDLE process) {
+   HANDLE token;
+   if (!OpenProcessToken(process, TOKEN_QUERY, &token)) return "";
+   std::string user;
+   DWORD size = 0;
+   GetTokenInformation(token, TokenUser, NULL, 0, &size);
+   std::vector<char> buffer(size);
+   LPSTR sid = nullptr;
+   if (size && GetTokenInformation(token, TokenUser, buffer.data(), size, &size) &&
+      ConvertSidToStringSidA(((TOKEN_USER*)buffer.data())->User.Sid, &sid)) {
+      user = sid;
+      LocalFree(sid);
+   }
+   CloseHandle(token);
+   return user;
+}
+
+/// Read or write size bytes on a pipe. With an event, the pipe is overlapped
+/// and the transfer fails after timeout milliseconds without progress.
+inline bool transferPipe(HANDLE pipe, HANDLE event, bool write, char* data, uint64_t size, DWORD timeout = INFINITE) {
+   while (size) {
+      DWORD chunk = (DWORD)std::min<uint64_t>(size, 1 << 20);
+      DWORD done = 0;
+      if (!event) {
+         BOOL ok = write ? WriteFile(pipe, data, chunk, &done, NULL) : ReadFile(pipe, data, chunk, &done, NULL);
+         if (!ok || !done) return false;
+      }
+      else {
+         OVERLAPPED overlapped = {};
+         overlapped.hEvent = event;
+         ResetEvent(event);
+         BOOL ok = write ? WriteFile(pipe, data, chunk, NULL, &overlapped) : ReadFile(pipe, data, chunk, NULL, &overlapped);
+         if (!ok && GetLastError() != ERROR_IO_PENDING) return false;
+         if (WaitForSingleObject(event, timeout) != WAIT_OBJECT_0) {
+            CancelIoEx(pipe, &overlapped);
+            GetOverlappedResult(pipe, &overlapped, &done, TRUE);
+            return false;
+         }
+         if (!GetOverlappedResult(pipe, &overlapped, &done, FALSE) || !done) return false;
+      }
+      data += done;
+      size -= done;
+   }
+   return true;
+}
+
+/// Compiles modules for the engines of other processes, over a named pipe,
+/// so that a module shared by several processes is compiled once. Objects
+/// are cached by the hash of their bitcode, in memory up to maxCachedBytes
+/// and in cacheDir, so that the server starts warm. Requests for a module
+/// being compiled wait for it rather than compiling it again.
+///
+/// Connections are served by threads of their own, and modules compiled on
+/// the pool, so that idle clients never hold a compile thread. The server
+/// disconnects and joins them when destroyed. Only local
+/// processes of the user running the server can connect, and requests larger
+/// than maxRequestBytes are refused before anything is allocated.
+class RTCompileServer {
+public:
+   static constexpr const char* DefaultPipeName = "\\\\.\\pipe\\RTCompileServer";
+   using Compiler = std::function<llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>>(llvm::Module&)>;
+
+private:
+   struct CompiledObject {
+      std::unique_ptr<llvm::MemoryBuffer> object;
+      std::string error;
+   };
+   using SharedObject = std::shared_future<std::shared_ptr<CompiledObject>>;
+   struct Connection {
+      HANDLE pipe;
+      std::thread thread;
+      std::atomic<bool> done{ false };
+   };
+
+   std::string pipeName;
+   std::string target;
+   std::string cacheDir;
+   Compiler compile;
+   uint64_t maxCachedBytes;
+   uint64_t maxRequestBytes;
+   RTThreadPool Pool;
+
+   std::mutex lock;
+   llvm::StringMap<SharedObject> objects; // by bitcode hash
+   std::deque<std::string> cachedOrder; // compiled objects, oldest first
+   uint64_t cachedBytes = 0;
+   std::atomic<uint64_t> requestCount;
+   std::atomic<uint64_t> compileCount;
+
+   std::mutex connectionsLock;
+   std::list<Connection> connections; // stable, their threads refer to them
+
+public:
+   RTCompileServer(llvm::StringRef pipeName, llvm::StringRef target, Compiler compile, llvm::StringRef cacheDir,
+      unsigned compileThreads, uint64_t maxCachedBytes = 256 << 20, uint64_t maxRequestBytes = 256 << 20)
+      : pipeName(pipeName.str()), target(target.str()), cacheDir(cacheDir.str()), compile(std::move(compile)),
+      maxCachedBytes(maxCachedBytes), maxRequestBytes(maxRequestBytes), Pool(compileThreads), requestCount(0),
+      compileCount(0) {
+   }
+   ~RTCompileServer() {
+      // Blocked transfers fail once their pipe is disconnected
+      std::lock_guard<std::mutex> guard(this->connectionsLock);
+      for (Connection& connection : this->connections) {
+         CancelIoEx(connection.pipe, NULL);
+         DisconnectNamedPipe(connection.pipe);
+      }
+      for (Connection& connection : this->connections) {
+         connection.thread.join();
+         CloseHandle(connection.pipe);
+      }
+      this->connections.clear();
+
+      // Compile tasks use the members declared after the pool
+      this->Pool.join();
+   }
+
+   /// Serve clients until the pipe cannot be created anymore. The first
+   /// instance of the pipe must be created by this server: another process
+   /// owning the name fails the server rather than sharing its clients.
+   void run() {
+      std::string user = getProcessUser(GetCurrentProcess());
+      PSECURITY_DESCRIPTOR descriptor = nullptr;
+      if (user.empty() || !ConvertStringSecurityDescriptorToSecurityDescriptorA(("D:P(A;;GA;;;" + user + ")").c_str(),
+         SDDL_REVISION_1, &descriptor, NULL)) {
+         llvm::dbgs() << "Cannot restrict pipe " << this->pipeName << " to the current user: " << GetLastError() << ".\n";
+         return;
+      }
+      SECURITY_ATTRIBUTES attributes = { sizeof(attributes), descriptor, FALSE };
+      DWORD openMode = PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE;
+      while (1) {
+         HANDLE pipe = CreateNamedPipeA(this->pipeName.c_str(), openMode,
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, PIPE_UNLIMITED_INSTANCES,
+            1 << 16, 1 << 16, 0, &attributes);
+         if (pipe == INVALID_HANDLE_VALUE) {
+            llvm::dbgs() << "Cannot create pipe " << this->pipeName << ": " << GetLastError() << ".\n";
+            break;
+         }
+         openMode &= ~FILE_FLAG_FIRST_PIPE_INSTANCE;
+         if (!ConnectNamedPipe(pipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED) {
+            CloseHandle(pipe);
+            continue;
+         }
+         this->reapConnections();
+         std::lock_guard<std::mutex> guard(this->connectionsLock);
+         Connection& connection = this->connections.emplace_back();
+         connection.pipe = pipe;
+         connection.thread = std::thread([this, &connection]() {
+            this->serve(connection.pipe);
+            connection.done = true;
+            });
+      }
+      LocalFree(descriptor);
+   }
+
+   void printStatistics(llvm::raw_ostream& OS) {
+      OS << "Compile server: " << this->compileCount << " modules compiled for " << this->requestCount << " requests.\n";
+   }
+
+private:
+   /// Join the connections served, and close their pipes.
+   void reapConnections() {
+      std::lock_guard<std::mutex> guard(this->connectionsLock);
+      for (auto it = this->connections.begin(); it != this->connections.end();) {
+         if (!it->done) {
+            ++it;
+            continue;
+         }
+         it->thread.join();
+         CloseHandle(it->pipe);
+         it = this->connections.erase(it);
+      }
+   }
+
+   /// Serve requests until the client disconnects or fails. The pipe is
+   /// closed by the server once the thread is joined.
+   void serve(HANDLE pipe) {
+      while (1) {
+         RTCompileRequest request;
+         if (!transferPipe(pipe, NULL, false, (char*)&request, sizeof(request))) break;
+         if (request.magic != RTCompileRequest::Magic || request.version != RTCompileRequest::Version) break;
+         if (request.targetLength > RTCompileRequest::MaxNameLength ||
+            request.identifierLength > RTCompileRequest::MaxNameLength ||
+            request.bitcodeSize > this->maxRequestBytes) {
+            llvm::dbgs() << "Compile request of " << request.bitcodeSize << " bytes refused.\n";
+            break;
+         }
+         std::string target(request.targetLength, '\0');
+         std::string identifier(request.identifierLength, '\0');
+         std::string bitcode(request.bitcodeSize, '\0');
+         if (!transferPipe(pipe, NULL, false, &target[0], target.size()) ||
+            !transferPipe(pipe, NULL, false, &identifier[0], identifier.size()) ||
+            !transferPipe(pipe, NULL, false, &bitcode[0], bitcode.size())) {
+            break;
+         }
+         this->requestCount++;
+
+         std::shared_ptr<CompiledObject> compiled;
+         uint32_t status;
+         if (target != this->target) {
+            compiled = std::make_shared<CompiledObject>();
+            compiled->error = "Server compiles for " + this->target + ", not " + target;
+            status = RTCompileResponse::TargetMismatch;
+         }
+         else {
+            compiled = this->getObject(identifier, std::move(bitcode)).get();
+            status = compiled->object ? RTCompileResponse::Compiled : RTCompileResponse::Failed;
+         }
+
+         llvm::StringRef payload = compiled->object ? compiled->object->getBuffer() : llvm::StringRef(compiled->error);
+         RTCompileResponse response = { RTCompileResponse::Magic, status, payload.size() };
+         if (!transferPipe(pipe, NULL, true, (char*)&response, sizeof(response)) ||
+            !transferPipe(pipe, NULL, true, (char*)payload.data(), payload.size())) {
+            break;
+         }
+      }
+      FlushFileBuffers(pipe);
+      DisconnectNamedPipe(pipe);
+   }
+
+   /// The object of a bitcode, compiled once whatever the number of requests.
+   SharedObject getObject(llvm::StringRef identifier, std::string bitcode) {
+      std::string key = llvm::toHex(llvm::SHA1::hash(llvm::arrayRefFromStringRef(bitcode)));
+      auto promise = std::make_shared<std::promise<std::shared_ptr<CompiledObject>>>();
+      SharedObject object = promise->get_future().share();
+      {
+         std::lock_guard<std::mutex> guard(this->lock);
+         auto it = this->objects.find(key);
+         if (it != this->objects.end()) {
+            return it->second;
+         }
+         this->objects[key] = object;
+      }
+      this->Pool.submit([this, promise, key, identifier = identifier.str(), bitcode = std::move(bitcode)]() {
+         auto compiled = this->compileObject(key, identifier, bitcode);
+         this->cacheObject(key, *compiled);
+         promise->set_value(std::move(compiled));
+         });
+      return object;
+   }
+
+   std::shared_ptr<CompiledObject> compileObject(llvm::StringRef key, llvm::StringRef identifier, llvm::StringRef bitcode) {
+      using namespace llvm;
+
+      auto compiled = std::make_shared<CompiledObject>();
+      std::string filename = this->cacheDir + "/" + key.str() + ".obj";
+      if (auto Cached = MemoryBuffer::getFile(filename)) {
+         // Objects are renamed in place once written: an object which does
+         // not parse was not written by this server, and is compiled again
+         if (auto Object = object::ObjectFile::createObjectFile((*Cached)->getMemBufferRef())) {
+            compiled->object = std::move(*Cached);
+            return compiled;
+         }
+         else {
+            consumeError(Object.takeError());
+         }
+      }
+
+      LLVMContext Ctx;
+      auto M = parseBitcodeFile(MemoryBufferRef(bitcode, identifier), Ctx);
+      if (!M) {
+         compiled->error = toString(M.takeError());
+         return compiled;
+      }
+      (*M)->setModuleIdentifier(identifier);
+      auto Object = this->compile(**M);
+      if (!Object) {
+         compiled->error = toString(Object.takeError());
+         return compiled;
+      }
+      this->compileCount++;
+      compiled->object = std::move(*Object);
+
+      // A server stopped while writing must not leave a truncated object
+      int FD;
+      SmallString<128> tempPath;
+      std::error_code Err = sys::fs::createUniqueFile(filename + ".%%%%%%.tmp", FD, tempPath);
+      if (!Err) {
+         raw_fd_ostream OStream(FD, /*shouldClose=*/true);
+         OStream << compiled->object->getBuffer();
+         OStream.close();
+         if (OStream.has_error()) {
+            Err = OStream.error();
+            OStream.clear_error();
+         }
+      }
+      if (!Err) {
+         Err = sys::fs::rename(tempPath, filename);
+      }
+      if (Err && !tempPath.empty()) {
+         sys::fs::remove(tempPath);
+      }
+      if (Err) {
+         dbgs() << "Cannot write object for " << identifier << " in cache.\n";
+      }
+      return compiled;
+   }
+
+   /// Keep the objects compiled while they fit, the oldest being evicted
+   /// first. Failures are not kept, to be retried at the next request.
+   void cacheObject(const std::string& key, const CompiledObject& compiled) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      if (!compiled.object) {
+         this->objects.erase(key);
+         return;
+      }
+      this->cachedOrder.push_back(key);
+      this->cachedBytes += compiled.object->getBufferSize();
+      while (this->cachedBytes > this->maxCachedBytes && this->cachedOrder.size() > 1) {
+         auto it = this->objects.find(this->cachedOrder.front());
+         this->cachedBytes -= it->second.get()->object->getBufferSize();
+         this->objects.erase(it);
+         this->cachedOrder.pop_front();
+      }
+   }
+};
+
+/// Sends modules to a compile server, and falls back to the engine when it
+/// is not available: after a failed connection or transfer, the server is
+/// not tried again for retryDelay. A server run by another user is not sent
+/// anything, and a server compiling for another target or data layout is
+/// never tried again. Connections are kept open between requests, one per
+/// compiling thread.
+class RTCompileClient {
+private:
+   struct Connection {
+      HANDLE pipe;
+      HANDLE event;
+   };
+
+   std::string pipeName;
+   std::string target;
+   std::string user;
+   DWORD timeout;
+   std::chrono::milliseconds retryDelay;
+
+   std::mutex lock;
+   std::vector<Connection> idleConnections;
+   std::chrono::steady_clock::time_point retryTime;
+   bool available = true;
+   bool mismatched = false;
+   std::atomic<uint64_t> remoteCount;
+   std::atomic<uint64_t> localCount;
+
+public:
+   RTCompileClient(llvm::StringRef pipeName, llvm::StringRef target, DWORD timeout = 60000,
+      std::chrono::milliseconds retryDelay = std::chrono::seconds(5))
+      : pipeName(pipeName.str()), target(target.str()), user(getProcessUser(GetCurrentProcess())), timeout(timeout),
+      retryDelay(retryDelay), remoteCount(0), localCount(0) {
+   }
+   ~RTCompileClient() {
+      for (Connection& connection : this->idleConnections) {
+         close(connection);
+      }
+   }
+
+   /// Compile M on the server to an object buffer named bufferName. Returns
+   /// null if the server is not available, and the error of the server if
+   /// it failed: M is then to be compiled in process.
+   llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> compile(llvm::Module& M, llvm::StringRef bufferName) {
+      using namespace llvm;
+
+      Connection connection;
+      if (!this->takeConnection(connection)) {
+         this->localCount++;
+         return nullptr;
+      }
+
+      SmallVector<char, 0> Bitcode;
+      {
+         raw_svector_ostream BitcodeStream(Bitcode);
+         WriteBitcodeToFile(M, BitcodeStream);
+      }
+      const std::string& identifier = M.getModuleIdentifier();
+      RTCompileRequest request = { RTCompileRequest::Magic, RTCompileRequest::Version,
+         (uint32_t)this->target.size(), (uint32_t)identifier.size(), Bitcode.size() };
+      RTCompileResponse response;
+      bool sent = this->transfer(connection, true, (char*)&request, sizeof(request)) &&
+         this->transfer(connection, true, (char*)this->target.data(), this->target.size()) &&
+         this->transfer(connection, true, (char*)identifier.data(), identifier.size()) &&
+         this->transfer(connection, true, Bitcode.data(), Bitcode.size()) &&
+         this->transfer(connection, false, (char*)&response, sizeof(response)) &&
+         response.magic == RTCompileResponse::Magic;
+      std::unique_ptr<WritableMemoryBuffer> Payload;
+      if (sent) {
+         Payload = WritableMemoryBuffer::getNewUninitMemBuffer(response.size, bufferName);
+         sent = Payload && this->transfer(connection, false, Payload->getBufferStart(), response.size);
+      }
+      if (!sent) {
+         close(connection);
+         this->setUnavailable();
+         this->localCount++;
+         return nullptr;
+      }
+      if (response.status == RTCompileResponse::TargetMismatch) {
+         close(connection);
+         this->setMismatched(StringRef(Payload->getBufferStart(), response.size));
+         this->localCount++;
+         return nullptr;
+      }
+      this->releaseConnection(connection);
+
+      if (response.status != RTCompileResponse::Compiled) {
+         this->localCount++;
+         return make_error<StringError>(StringRef(Payload->getBufferStart(), response.size), inconvertibleErrorCode());
+      }
+      this->remoteCount++;
+      return std::unique_ptr<MemoryBuffer>(std::move(Payload));
+   }
+
+   void printStatistics(llvm::raw_ostream& OS) {
+      OS << "Compile server: " << this->remoteCount << " modules compiled remotely, "
+         << this->localCount << " in process.\n";
+   }
+
+private:
+   bool transfer(Connection& connection, bool write, char* data, uint64_t size) {
+      return transferPipe(connection.pipe, connection.event, write, data, size, this->timeout);
+   }
+
+   bool takeConnection(Connection& connection) {
+      {
+         std::lock_guard<std::mutex> guard(this->lock);
+         if (this->mismatched || (!this->available && std::chrono::steady_clock::now() < this->retryTime)) {
+            return false;
+         }
+         if (!this->idleConnections.empty()) {
+            connection = this->idleConnections.back();
+            this->idleConnections.pop_back();
+            return true;
+         }
+      }
+      // The server only identifies the client, it cannot act on its behalf
+      DWORD flags = FILE_FLAG_OVERLAPPED | SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION;
+      connection.pipe = CreateFileA(this->pipeName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+         OPEN_EXISTING, flags, NULL);
+      if (connection.pipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY &&
+         WaitNamedPipeA(this->pipeName.c_str(), 1000)) {
+         connection.pipe = CreateFileA(this->pipeName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+            OPEN_EXISTING, flags, NULL);
+      }
+      if (connection.pipe == INVALID_HANDLE_VALUE) {
+         this->setUnavailable();
+         return false;
+      }
+      if (!this->isServerTrusted(connection.pipe)) {
+         llvm::dbgs() << "Compile server " << this->pipeName << " is not run by the current user.\n";
+         CloseHandle(connection.pipe);
+         this->setUnavailable();
+         return false;
+      }
+      connection.event = CreateEventA(NULL, TRUE, FALSE, NULL);
+
+      std::lock_guard<std::mutex> guard(this->lock);
+      if (!this->available) {
+         llvm::dbgs() << "Compile server " << this->pipeName << " is available.\n";
+         this->available = true;
+      }
+      return true;
+   }
+
+   /// Whether the process at the other end of the pipe runs as this one.
+   bool isServerTrusted(HANDLE pipe) {
+      ULONG processId;
+      if (this->user.empty() || !GetNamedPipeServerProcessId(pipe, &processId)) return false;
+      HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId);
+      if (!process) return false;
+      bool trusted = getProcessUser(process) == this->user;
+      CloseHandle(process);
+      return trusted;
+   }
+
+   void releaseConnection(Connection& connection) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      this->idleConnections.push_back(connection);
+   }
+
+   void setUnavailable() {
+      std::lock_guard<std::mutex> guard(this->lock);
+      if (this->available) {
+         llvm::dbgs() << "Compile server " << this->pipeName << " is not available, compiling in process.\n";
+         this->available = false;
+      }
+      this->retryTime = std::chrono::steady_clock::now() + this->retryDelay;
+   }
+
+   void setMismatched(llvm::StringRef error) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      if (!this->mismatched) {
+         llvm::dbgs() << "Compile server " << this->pipeName << " is not compatible, compiling in process: "
+            << error << ".\n";
+         this->mismatched = true;
+      }
+   }
+
+   static void close(Connection& connection) {
+      CloseHandle(connection.pipe);
+      if (connection.event) {
+         CloseHandle(connection.event);
+      }
+   }
+};
@@ -0,0 +1,302 @@
+#pragma once
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/ExecutionEngine/RuntimeDyld.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/IR/DebugInfo.h>
+#include <llvm/Support/Debug.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SHA1.h>
+#include <mutex>
+
+/// The name of the files cached for a module. Identifiers which are long,
+/// such as the ones of batches, or which are not portable file names, such
+/// as the ones of tenants, are shortened and completed with their hash.
+inline std::string getCacheName(llvm::StringRef identifier) {
+   const size_t maxLength = 48;
+   std::string name;
+   for (char c : identifier.take_front(maxLength)) {
+      name += llvm::isAlnum(c) || c == '.' || c == '_' || c == '-' || c == '$' ? c : '_';
+   }
+   if (identifier.size() > maxLength || name != identifier) {
+      name += "-" + llvm::toHex(llvm::SHA1::hash(llvm::arrayRefFromStringRef(identifier))).substr(0, 16);
+   }
+   return name;
+}
+
+/// The source position of each function of lean code, kept instead of its
+/// DWARF: a file and a line per symbol, the files being shared.
+class RTLineTable {
+private:
+   struct Entry {
+      unsigned file;
+      unsigned line;
+   };
+   mutable std::mutex lock;
+   std::vector<std::string> files;
+   llvm::StringMap<unsigned> fileIndexes;
+   llvm::StringMap<Entry> functions;
+
+public:
+   void addModule(const llvm::Module& M) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      for (const llvm::Function& F : M) {
+         const llvm::DISubprogram* SP = F.getSubprogram();
+         if (F.isDeclaration() || !SP) continue;
+         auto it = this->fileIndexes.try_emplace(SP->getFilename(), this->files.size());
+         if (it.second) {
+            this->files.push_back(SP->getFilename().str());
+         }
+         this->functions[F.getName()] = Entry{ it.first->second, SP->getLine() };
+      }
+   }
+
+   bool lookup(llvm::StringRef name, std::string& file, unsigned& line) const {
+      std::lock_guard<std::mutex> guard(this->lock);
+      auto it = this->functions.find(name);
+      if (it == this->functions.end()) return false;
+      file = this->files[it->second.file];
+      line = it->second.line;
+      return true;
+   }
+};
+
+/// Where a section of an object was loaded in JIT memory.
+struct RTLoadedSection {
+   std::string name;
+   uint64_t address;
+   uint64_t size;
+};
+
+/// The sections of Object which were given a load address.
+inline std::vector<RTLoadedSection> getLoadedSections(
+   const llvm::object::ObjectFile& Object, const llvm::RuntimeDyld::LoadedObjectInfo& LOS) {
+   std::vector<RTLoadedSection> sections;
+   for (const llvm::object::SectionRef& Section : Object.sections()) {
+      auto name = Section.getName();
+      uint64_t address = LOS.getSectionLoadAddress(Section);
+      if (!name) {
+         llvm::consumeError(name.takeError());
+      }
+      else if (address) {
+         sections.push_back(RTLoadedSection{ name->str(), address, Section.getSize() });
+      }
+   }
+   return sections;
+}
+
+/// The debug object of Object as loaded, its sections at their load
+/// addresses. RuntimeDyld only builds the ones of ELF and MachO objects: the
+/// section headers of COFF have 32-bit addresses, which cannot describe JIT
+/// memory, so COFF objects are reported as having none.
+inline llvm::Expected<llvm::object::OwningBinary<llvm::object::ObjectFile>> getDebugObject(
+   const llvm::object::ObjectFile& Object, const llvm::RuntimeDyld::LoadedObjectInfo& LOS)
+{
+   auto Debug = LOS.getObjectForDebug(Object);
+   if (!Debug.getBinary()) {
+      return llvm::make_error<llvm::StringError>("No debug object for " + Object.getFileName() +
+         ": only ELF and MachO objects have one", llvm::inconvertibleErrorCode());
+   }
+   return std::move(Debug);
+}
+
+/// A debug object refers to no symbol which matters: its code is never run,
+/// and only its debug sections are registered.
+class RTScratchResolver : public llvm::JITSymbolResolver {
+public:
+   void lookup(const LookupSet& Symbols, OnResolvedFunction OnResolved) override {
+      LookupResult Result;
+      for (auto& Name : Symbols) {
+         Result[Name] = llvm::JITEvaluatedSymbol(0, llvm::JITSymbolFlags::Exported);
+      }
+      OnResolved(std::move(Result));
+   }
+   llvm::Expected<LookupSet> getResponsibilitySet(const LookupSet& Symbols) override {
+      return LookupSet();
+   }
+   bool allowsZeroSymbols() override { return true; }
+};
+
+/// Load Object in scratch memory with each section mapped at the address of
+/// the loaded section of the same name and rank, then return its debug
+/// object, which describes the code at these addresses. The debug sections
+/// stay in scratch memory, freed on return once copied.
+inline llvm::Expected<llvm::object::OwningBinary<llvm::object::ObjectFile>> createRelocatedDebugObject(
+   const llvm::object::ObjectFile& Object, llvm::ArrayRef<RTLoadedSection> sections)
+{
+   using namespace llvm;
+
+   SectionMemoryManager MemMgr;
+   RTScratchResolver Resolver;
+   RuntimeDyld Dyld(MemMgr, Resolver);
+   Dyld.setProcessAllSections(true);
+   auto Info = Dyld.loadObject(Object);
+   if (Dyld.hasError()) {
+      return make_error<StringError>(Dyld.getErrorString(), inconvertibleErrorCode());
+   }
+
+   StringMap<unsigned> ranks;
+   for (const object::SectionRef& Section : Object.sections()) {
+      auto name = Section.getName();
+      if (!name) {
+         return name.takeError();
+      }
+      uint64_t localAddress = Info->getSectionLoadAddress(Section);
+      if (!localAddress) continue;
+      unsigned rank = ranks[*name]++;
+      for (const RTLoadedSection& loaded : sections) {
+         if (loaded.name != *name || rank-- != 0) continue;
+         if (loaded.size != Section.getSize()) {
+            return make_error<StringError>("Debug object of " + Object.getFileName() + " does not match its code",
+               inconvertibleErrorCode());
+         }
+         Dyld.mapSectionAddress((const void*)localAddress, loaded.address);
+         break;
+      }
+   }
+   Dyld.resolveRelocations();
+   return getDebugObject(Object, *Info);
+}
+
+/// Lean mode: modules are compiled without their debug info and value names,
+/// which costs neither codegen time nor JIT memory. The debug info of each
+/// module is saved as bitcode in a directory instead, and its DWARF is
+/// regenerated on demand: the module is compiled again with its debug info,
+/// and the object is loaded in scratch memory with its sections mapped at the
+/// addresses of the lean code, which debug info does not change. The debug
+/// object is then registered as if it was the one loaded.
+class RTLeanDebugInfo {
+private:
+   struct LeanObject {
+      std::string bitcodePath;
+      std::vector<RTLoadedSection> sections;
+      bool registered = false;
+   };
+
+   std::mutex lock;
+   std::mutex regenerateLock;
+   std::string directory;
+   llvm::StringMap<LeanObject> objects; // by object buffer identifier
+
+public:
+   RTLineTable Lines;
+
+   RTLeanDebugInfo(llvm::StringRef directory)
+      : directory(directory.str()) {
+   }
+
+   /// Save the debug info of M, to be compiled to the object objectName, then
+   /// strip it with the value names.
+   void stripModule(llvm::Module& M, llvm::StringRef objectName) {
+      using namespace llvm;
+
+      this->Lines.addModule(M);
+
+      // Without a version, the debug info would be dropped when read back
+      if (!getDebugMetadataVersionFromModule(M)) {
+         M.addModuleFlag(Module::Warning, "Debug Info Version", DEBUG_METADATA_VERSION);
+      }
+      SmallString<128> path(this->directory);
+      sys::path::append(path, getCacheName(M.getModuleIdentifier()) + ".debug.bc");
+      std::error_code Err;
+      raw_fd_ostream OS(path, Err, sys::fs::OF_None);
+      if (!Err) {
+         WriteBitcodeToFile(M, OS);
+         std::lock_guard<std::mutex> guard(this->lock);
+         this->objects[objectName].bitcodePath = path.str().str();
+      }
+      else {
+         dbgs() << "Cannot save debug info of " << M.getModuleIdentifier() << " in " << path << ".\n";
+      }
+
+      StripDebugInfo(M);
+      M.getContext().setDiscardValueNames(true);
+      for (Function& F : M) {
+         for (Argument& A : F.args()) {
+            A.setName("");
+         }
+         for (BasicBlock& BB : F) {
+            BB.setName("");
+            for (Instruction& I : BB) {
+               I.setName("");
+            }
+         }
+      }
+   }
+
+   /// Record where the sections of a lean object were loaded.
+   void notifyLoaded(const llvm::object::ObjectFile& Object, const llvm::RuntimeDyld::LoadedObjectInfo& LOS) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      auto it = this->objects.find(Object.getFileName());
+      if (it != this->objects.end()) {
+         it->second.sections = getLoadedSections(Object, LOS);
+      }
+   }
+
+   /// Regenerate the DWARF of the lean objects loaded since the last call, and
+   /// pass each debug object to registerDebugObject with the name of its
+   /// object. compileWithDebugInfo compiles a module as is.
+   llvm::Error regenerate(
+      llvm::function_ref<llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>>(llvm::Module&)> compileWithDebugInfo,
+      llvm::function_ref<llvm::Error(llvm::StringRef, llvm::object::OwningBinary<llvm::object::ObjectFile>)> registerDebugObject)
+   {
+      using namespace llvm;
+
+      std::lock_guard<std::mutex> regenerateGuard(this->regenerateLock);
+      std::vector<StringMapEntry<LeanObject>*> pending;
+      {
+         std::lock_guard<std::mutex> guard(this->lock);
+         for (auto& entry : this->objects) {
+            if (!entry.second.registered && !entry.second.sections.empty()) {
+               entry.second.registered = true;
+               pending.push_back(&entry);
+            }
+         }
+      }
+
+      Error Err = Error::success();
+      for (auto* entry : pending) {
+         Err = joinErrors(std::move(Err), this->regenerateObject(entry->getKey(), entry->second, compileWithDebugInfo, registerDebugObject));
+      }
+      return Err;
+   }
+
+private:
+   llvm::Error regenerateObject(
+      llvm::StringRef objectName, LeanObject& lean,
+      llvm::function_ref<llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>>(llvm::Module&)> compileWithDebugInfo,
+      llvm::function_ref<llvm::Error(llvm::StringRef, llvm::object::OwningBinary<llvm::object::ObjectFile>)> registerDebugObject)
+   {
+      using namespace llvm;
+
+      auto Bitcode = MemoryBuffer::getFile(lean.bitcodePath);
+      if (!Bitcode) {
+         return errorCodeToError(Bitcode.getError());
+      }
+      LLVMContext Context;
+      auto M = parseBitcodeFile((*Bitcode)->getMemBufferRef(), Context);
+      if (!M) {
+         return M.takeError();
+      }
+      auto DebugObject = compileWithDebugInfo(**M);
+      if (!DebugObject) {
+         return DebugObject.takeError();
+      }
+      auto Obj = object::ObjectFile::createObjectFile((*DebugObject)->getMemBufferRef());
+      if (!Obj) {
+         return Obj.takeError();
+      }
+
+      // Debug info does not change the code: its sections map onto the lean ones
+      auto Relocated = createRelocatedDebugObject(**Obj, lean.sections);
+      if (!Relocated) {
+         return Relocated.takeError();
+      }
+      return registerDebugObject(objectName, std::move(*Relocated));
+   }
+};
@@ -0,0 +1,281 @@
+#pragma once
+
+#include "./RTDebugInfo.h"
+#include "./RTModulePartitioner.h"
+#include <llvm/ADT/StringSet.h>
+#include <atomic>
+
+// The GDB JIT interface, defined in LLVM by its registration listener:
+// debuggers break in __jit_debug_register_code to read the entry named by
+// __jit_debug_descriptor, and read its whole list when they attach
+extern "C" {
+   struct jit_code_entry {
+      jit_code_entry* next_entry;
+      jit_code_entry* prev_entry;
+      const char* symfile_addr;
+      uint64_t symfile_size;
+   };
+   struct jit_descriptor {
+      uint32_t version;
+      uint32_t action_flag;
+      jit_code_entry* relevant_entry;
+      jit_code_entry* first_entry;
+   };
+   extern jit_descriptor __jit_debug_descriptor;
+   void __jit_debug_register_code();
+}
+
+/// Registers the DWARF of JIT code with debuggers through the GDB JIT
+/// interface, instead of the listener of LLVM which copies and registers
+/// every object as it is loaded.
+///
+/// Nothing is copied until registration is enabled, at runtime or once a
+/// debugger is attached: until then, the objects are only recorded with the
+/// addresses of their sections, and their debug objects are rebuilt when
+/// needed from the mapping of their cached object, or from the cache file.
+/// The objects whose sections were dropped are not recorded. Debug objects are registered in batches, at each
+/// flush, and only for the selected modules. They are unregistered and freed
+/// when their module is removed.
+///
+/// Targets without debug objects, such as COFF, are marked unsupported:
+/// enabling registration then fails instead of registering nothing.
+class RTDebugRegistrar {
+private:
+   enum { JIT_NOACTION = 0, JIT_REGISTER_FN, JIT_UNREGISTER_FN };
+
+   struct DebugObject {
+      std::string module;
+      std::shared_ptr<llvm::MemoryBuffer> mappedObject;
+      std::string cachedObjectPath;
+      std::vector<RTLoadedSection> sections;
+      llvm::object::OwningBinary<llvm::object::ObjectFile> debugObject;
+      jit_code_entry* entry = nullptr;
+   };
+
+   std::mutex lock;
+   std::atomic<bool> enabled;
+   std::string unsupported;
+   llvm::StringSet<> selection;
+   std::vector<std::unique_ptr<DebugObject>> objects;
+   std::vector<DebugObject*> pending;
+   unsigned registeredCount = 0;
+
+   /// The descriptor is shared by all the engines of the process.
+   static std::mutex& getInterfaceLock() {
+      static std::mutex interfaceLock;
+      return interfaceLock;
+   }
+
+public:
+   RTDebugRegistrar()
+      : enabled(false) {
+   }
+   ~RTDebugRegistrar() {
+      this->removeModules([](llvm::StringRef) { return true; });
+   }
+
+   /// Refuse registration, for the reason given: the debug objects of the
+   /// target cannot be built. Called before any object is loaded.
+   void setUnsupported(llvm::StringRef reason) {
+      this->unsupported = reason.str();
+   }
+   bool isSupported() const {
+      return this->unsupported.empty();
+   }
+
+   /// Enable registration: the objects loaded so far are registered at the
+   /// next flush, and the ones loaded from now on are copied as they are
+   /// loaded.
+   llvm::Error enable() {
+      if (!this->isSupported()) {
+         return llvm::make_error<llvm::StringError>("Debug registration is not supported: " + this->unsupported,
+            llvm::inconvertibleErrorCode());
+      }
+      this->enabled = true;
+      return llvm::Error::success();
+   }
+   bool isEnabled() const {
+      return this->enabled;
+   }
+
+   /// Limit registration to the selected modules, or their partitions. All
+   /// modules are registered while none is selected.
+   void select(llvm::StringRef module) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      this->selection.insert(module);
+   }
+
+   /// Record an object linked from module, mapped as mappedObject or cached
+   /// at cachedObjectPath, both empty if its sections were dropped. Its debug
+   /// object is only copied once registration is enabled for module.
+   llvm::Error notifyLoaded(llvm::StringRef module, const llvm::object::ObjectFile& Object,
+      const llvm::RuntimeDyld::LoadedObjectInfo& LOS, std::shared_ptr<llvm::MemoryBuffer> mappedObject,
+      llvm::StringRef cachedObjectPath) {
+      if (!this->isSupported()) {
+         return llvm::Error::success();
+      }
+      auto object = std::make_unique<DebugObject>();
+      object->module = module.str();
+      std::lock_guard<std::mutex> guard(this->lock);
+      if (this->enabled && this->isSelected(module)) {
+         auto Debug = getDebugObject(Object, LOS);
+         if (!Debug) {
+            return Debug.takeError();
+         }
+         object->debugObject = std::move(*Debug);
+      }
+      else if (mappedObject || !cachedObjectPath.empty()) {
+         object->mappedObject = std::move(mappedObject);
+         object->cachedObjectPath = cachedObjectPath.str();
+         object->sections = getLoadedSections(Object, LOS);
+      }
+      else {
+         return llvm::Error::success();
+      }
+      this->pending.push_back(object.get());
+      this->objects.push_back(std::move(object));
+      return llvm::Error::success();
+   }
+
+   /// Record a debug object built for module, such as regenerated DWARF.
+   llvm::Error addDebugObject(llvm::StringRef module, llvm::object::OwningBinary<llvm::object::ObjectFile> Debug) {
+      if (!Debug.getBinary()) {
+         return llvm::make_error<llvm::StringError>("Empty debug object for " + module, llvm::inconvertibleErrorCode());
+      }
+      auto object = std::make_unique<DebugObject>();
+      object->module = module.str();
+      object->debugObject = std::move(Debug);
+      std::lock_guard<std::mutex> guard(this->lock);
+      this->pending.push_back(object.get());
+      this->objects.push_back(std::move(object));
+      return llvm::Error::success();
+   }
+
+   /// Register the debug objects of the selected modules recorded since the
+   /// last flush, rebuilding the ones not copied yet. Does nothing until
+   /// registration is enabled.
+   llvm::Error flush() {
+      using namespace llvm;
+
+      if (!this->enabled) {
+         return Error::success();
+      }
+      std::lock_guard<std::mutex> guard(this->lock);
+      Error Err = Error::success();
+      std::vector<DebugObject*> batch;
+      std::vector<DebugObject*> unselected;
+      for (DebugObject* object : this->pending) {
+         if (!this->isSelected(object->module)) {
+            unselected.push_back(object);
+            continue;
+         }
+         if (!object->debugObject.getBinary()) {
+            if (auto rebuildErr = this->rebuild(*object)) {
+               Err = joinErrors(std::move(Err), std::move(rebuildErr));
+               continue;
+            }
+         }
+         batch.push_back(object);
+      }
+      this->pending = std::move(unselected);
+      if (batch.empty()) {
+         return Err;
+      }
+
+      // The list is updated once per batch, but the protocol has debuggers
+      // read one entry per notification
+      std::lock_guard<std::mutex> interfaceGuard(getInterfaceLock());
+      for (DebugObject* object : batch) {
+         MemoryBufferRef Buffer = object->debugObject.getBinary()->getMemoryBufferRef();
+         auto entry = new jit_code_entry();
+         entry->symfile_addr = Buffer.getBufferStart();
+         entry->symfile_size = Buffer.getBufferSize();
+         entry->prev_entry = nullptr;
+         entry->next_entry = __jit_debug_descriptor.first_entry;
+         if (entry->next_entry) {
+            entry->next_entry->prev_entry = entry;
+         }
+         __jit_debug_descriptor.first_entry = entry;
+         object->entry = entry;
+      }
+      for (DebugObject* object : batch) {
+         __jit_debug_descriptor.relevant_entry = object->entry;
+         __jit_debug_descriptor.action_flag = JIT_REGISTER_FN;
+         __jit_debug_register_code();
+      }
+      this->registeredCount += batch.size();
+      return Err;
+   }
+
+   /// Unregister and free the debug objects of the modules for which removed
+   /// returns true.
+   void removeModules(llvm::function_ref<bool(llvm::StringRef)> removed) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      llvm::erase_if(this->pending, [&](DebugObject* object) {
+         return removed(object->module);
+         });
+      std::lock_guard<std::mutex> interfaceGuard(getInterfaceLock());
+      llvm::erase_if(this->objects, [&](std::unique_ptr<DebugObject>& object) {
+         if (!removed(object->module)) return false;
+         if (jit_code_entry* entry = object->entry) {
+            if (entry->prev_entry) {
+               entry->prev_entry->next_entry = entry->next_entry;
+            }
+            else {
+               __jit_debug_descriptor.first_entry = entry->next_entry;
+            }
+            if (entry->next_entry) {
+               entry->next_entry->prev_entry = entry->prev_entry;
+            }
+            __jit_debug_descriptor.relevant_entry = entry;
+            __jit_debug_descriptor.action_flag = JIT_UNREGISTER_FN;
+            __jit_debug_register_code();
+            delete entry;
+            this->registeredCount--;
+         }
+         return true;
+         });
+   }
+
+   void printStatistics(llvm::raw_ostream& OS) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      if (this->objects.empty()) return;
+      OS << "Debug registration: " << this->registeredCount << " of " << this->objects.size()
+         << " objects registered" << (this->enabled ? "" : ", disabled") << ".\n";
+   }
+
+private:
+   bool isSelected(llvm::StringRef module) {
+      if (this->selection.empty()) return true;
+      for (auto& selected : this->selection) {
+         if (isPartitionOf(module, selected.getKey())) return true;
+      }
+      return false;
+   }
+
+   llvm::Error rebuild(DebugObject& object) {
+      using namespace llvm;
+
+      std::unique_ptr<MemoryBuffer> Read;
+      if (!object.mappedObject) {
+         auto Cached = MemoryBuffer::getFile(object.cachedObjectPath);
+         if (!Cached) {
+            return errorCodeToError(Cached.getError());
+         }
+         Read = std::move(*Cached);
+      }
+      const MemoryBuffer& Cached = object.mappedObject ? *object.mappedObject : *Read;
+      auto Obj = object::ObjectFile::createObjectFile(Cached.getMemBufferRef());
+      if (!Obj) {
+         return Obj.takeError();
+      }
+      auto Debug = createRelocatedDebugObject(**Obj, object.sections);
+      if (!Debug) {
+         return Debug.takeError();
+      }
+      object.debugObject = std::move(*Debug);
+      object.mappedObject.reset();
+      object.sections.clear();
+      return Error::success();
+   }
+};
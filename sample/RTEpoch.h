@@ -0,0 +1,169 @@
+#pragma once
+
+#include <llvm/ADT/FunctionExtras.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// Epoch-based reclamation of retired JIT code. A thread holds a Guard while
+/// it may run code which can be retired: entering and leaving only store the
+/// epoch of the thread in a slot of its own, without lock. Code retired at an
+/// epoch is freed once no thread holds a guard entered at that epoch or
+/// before, since those are the only ones which may have seen it.
+///
+/// Threads are shared by every engine of the process, so the manager is too,
+/// but code is retired on behalf of an owner: an owner going away drains its
+/// own entries rather than leaving them to the next engine which reclaims.
+class RTEpochManager {
+private:
+   struct alignas(64) Slot {
+      std::atomic<uint64_t> epoch; // 0 while the thread is out of JIT code
+      std::atomic<bool> used;
+      Slot* next = nullptr;
+      Slot()
+         : epoch(0), used(true) {
+      }
+   };
+   struct ThreadSlot {
+      Slot* slot = nullptr;
+      unsigned depth = 0;
+      ~ThreadSlot() {
+         if (this->slot) {
+            this->slot->used.store(false, std::memory_order_release);
+         }
+      }
+   };
+   struct Retired {
+      uint64_t epoch;
+      const void* owner;
+      llvm::unique_function<void()> release;
+   };
+
+   std::atomic<uint64_t> globalEpoch;
+   std::atomic<Slot*> slots; // never freed, reused once their thread ends
+   std::mutex retireLock;
+   std::vector<Retired> retired;
+
+   RTEpochManager()
+      : globalEpoch(1), slots(nullptr) {
+   }
+
+public:
+   static RTEpochManager& get() {
+      static RTEpochManager manager;
+      return manager;
+   }
+
+   class Guard {
+   private:
+      ThreadSlot* thread;
+   public:
+      Guard(ThreadSlot* thread)
+         : thread(thread) {
+      }
+      Guard(Guard&& other)
+         : thread(other.thread) {
+         other.thread = nullptr;
+      }
+      Guard(const Guard&) = delete;
+      ~Guard() {
+         if (this->thread && --this->thread->depth == 0) {
+            this->thread->slot->epoch.store(0, std::memory_order_release);
+         }
+      }
+   };
+
+   /// Enter JIT code: the code retired from now on is kept until the guard is
+   /// released. Guards can be nested.
+   Guard enter() {
+      static thread_local ThreadSlot thread;
+      if (!thread.slot) {
+         thread.slot = this->claimSlot();
+      }
+      if (thread.depth++ == 0) {
+         // Published before any load of a code pointer by this thread
+         thread.slot->epoch.store(this->globalEpoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+         std::atomic_thread_fence(std::memory_order_seq_cst);
+      }
+      return Guard(&thread);
+   }
+
+   /// Retire code of owner no longer reachable for threads entering from now
+   /// on: release is called once the threads which may still run it are out.
+   void retire(const void* owner, llvm::unique_function<void()> release) {
+      // The code pointers were updated before
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      {
+         std::lock_guard<std::mutex> guard(this->retireLock);
+         uint64_t epoch = this->globalEpoch.fetch_add(1, std::memory_order_seq_cst);
+         this->retired.push_back(Retired{ epoch, owner, std::move(release) });
+      }
+      this->reclaim();
+   }
+
+   /// Release the retired code no thread can still run. Returns the count of
+   /// retired code still kept.
+   size_t reclaim() {
+      // The code retired from now on is kept, whatever the scan finds
+      uint64_t oldestActive = this->globalEpoch.load(std::memory_order_seq_cst);
+      for (Slot* slot = this->slots.load(std::memory_order_acquire); slot; slot = slot->next) {
+         uint64_t epoch = slot->epoch.load(std::memory_order_seq_cst);
+         if (epoch && epoch < oldestActive) {
+            oldestActive = epoch;
+         }
+      }
+
+      std::vector<Retired> released;
+      size_t kept;
+      {
+         std::lock_guard<std::mutex> guard(this->retireLock);
+         auto it = std::stable_partition(this->retired.begin(), this->retired.end(), [&](const Retired& entry) {
+            return entry.epoch >= oldestActive;
+            });
+         std::move(it, this->retired.end(), std::back_inserter(released));
+         this->retired.erase(it, this->retired.end());
+         kept = this->retired.size();
+      }
+      for (Retired& entry : released) {
+         entry.release();
+      }
+      return kept;
+   }
+
+   /// Release all the code retired by owner, waiting for the threads which may
+   /// still run it. The calling thread must not hold a guard.
+   void drain(const void* owner) {
+      for (;;) {
+         this->reclaim();
+         {
+            std::lock_guard<std::mutex> guard(this->retireLock);
+            if (std::none_of(this->retired.begin(), this->retired.end(), [&](const Retired& entry) {
+               return entry.owner == owner;
+               })) {
+               return;
+            }
+         }
+         std::this_thread::yield();
+      }
+   }
+
+private:
+   Slot* claimSlot() {
+      for (Slot* slot = this->slots.load(std::memory_order_acquire); slot; slot = slot->next) {
+         bool used = false;
+         if (!slot->used.load(std::memory_order_relaxed) &&
+            slot->used.compare_exchange_strong(used, true, std::memory_order_acquire)) {
+            return slot;
+         }
+      }
+      Slot* slot = new Slot();
+      slot->next = this->slots.load(std::memory_order_relaxed);
+      while (!this->slots.compare_exchange_weak(slot->next, slot, std::memory_order_release)) {
+      }
+      return slot;
+   }
+};
@@ -0,0 +1,350 @@
+#pragma once
+
+#include <llvm/ExecutionEngine/JITLink/EHFrameSupport.h>
+#include <llvm/ExecutionEngine/JITLink/JITLinkMemoryManager.h>
+#include <llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/Orc/Shared/AllocationActions.h>
+#include <llvm/Support/Debug.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/Memory.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/raw_ostream.h>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+
+/// The linker of the objects of an engine.
+enum class RTObjectLinker {
+   // RuntimeDyld, for COFF objects
+   RuntimeDyld,
+   // JITLink, for ELF x86-64 objects of the small code model
+   JITLink,
+};
+
+/// A JITLink memory manager carving every allocation out of one slab mapped
+/// up front, so that all JIT code and data lie within 2 GB of each other:
+/// objects of the small code model reach one another with 32-bit relative
+/// relocations. The pages freed, of finalization segments once finalized and
+/// of removed objects, are reused first fit.
+class RTSlabMemoryManager : public llvm::jitlink::JITLinkMemoryManager {
+private:
+   struct FinalizedAllocInfo {
+      llvm::sys::MemoryBlock StandardSegments;
+      std::vector<llvm::orc::shared::WrapperFunctionCall> DeallocActions;
+   };
+
+   class SlabInFlightAlloc : public InFlightAlloc {
+   private:
+      RTSlabMemoryManager& MemMgr;
+      llvm::jitlink::BasicLayout BL;
+      llvm::sys::MemoryBlock StandardSegments;
+      llvm::sys::MemoryBlock FinalizeSegments;
+
+   public:
+      SlabInFlightAlloc(RTSlabMemoryManager& MemMgr, llvm::jitlink::BasicLayout BL,
+         llvm::sys::MemoryBlock StandardSegments, llvm::sys::MemoryBlock FinalizeSegments)
+         : MemMgr(MemMgr), BL(std::move(BL)), StandardSegments(StandardSegments), FinalizeSegments(FinalizeSegments) {
+      }
+
+      void finalize(OnFinalizedFunction OnFinalized) override {
+         using namespace llvm;
+
+         for (auto& KV : this->BL.segments()) {
+            auto Prot = jitlink::toSysMemoryProtectionFlags(KV.first.getMemProt());
+            auto& Seg = KV.second;
+            sys::MemoryBlock Block(Seg.WorkingMem, alignTo(Seg.ContentSize + Seg.ZeroFillSize, this->MemMgr.PageSize));
+            if (auto EC = sys::Memory::protectMappedMemory(Block, Prot)) {
+               return OnFinalized(errorCodeToError(EC));
+            }
+            if (Prot & sys::Memory::MF_EXEC) {
+               sys::Memory::InvalidateInstructionCache(Block.base(), Block.allocatedSize());
+            }
+         }
+         auto DeallocActions = orc::shared::runFinalizeActions(this->BL.graphAllocActions());
+         if (!DeallocActions) {
+            return OnFinalized(DeallocActions.takeError());
+         }
+         this->MemMgr.release(this->FinalizeSegments);
+         auto Info = new FinalizedAllocInfo{ this->StandardSegments, std::move(*DeallocActions) };
+         OnFinalized(FinalizedAlloc(orc::ExecutorAddr::fromPtr(Info)));
+      }
+
+      void abandon(OnAbandonedFunction OnAbandoned) override {
+         this->MemMgr.release(this->FinalizeSegments);
+         this->MemMgr.release(this->StandardSegments);
+         OnAbandoned(llvm::Error::success());
+      }
+   };
+
+   llvm::sys::MemoryBlock Slab;
+   uint64_t PageSize;
+   std::mutex lock;
+   std::map<uint64_t, uint64_t> freeRanges; // sizes by offset in the slab
+   uint64_t usedBytes = 0;
+   uint64_t peakBytes = 0;
+
+   RTSlabMemoryManager(llvm::sys::MemoryBlock Slab, uint64_t PageSize)
+      : Slab(Slab), PageSize(PageSize) {
+      this->freeRanges[0] = Slab.allocatedSize();
+   }
+
+public:
+   static llvm::Expected<std::unique_ptr<RTSlabMemoryManager>> Create(uint64_t slabSize) {
+      using namespace llvm;
+
+      auto PageSize = sys::Process::getPageSize();
+      if (!PageSize) {
+         return PageSize.takeError();
+      }
+      std::error_code EC;
+      auto Slab = sys::Memory::allocateMappedMemory(alignTo(slabSize, *PageSize), nullptr,
+         sys::Memory::MF_READ | sys::Memory::MF_WRITE, EC);
+      if (EC) {
+         return errorCodeToError(EC);
+      }
+      return std::unique_ptr<RTSlabMemoryManager>(new RTSlabMemoryManager(Slab, *PageSize));
+   }
+   ~RTSlabMemoryManager() override {
+      llvm::sys::Memory::releaseMappedMemory(this->Slab);
+   }
+
+   void allocate(const llvm::jitlink::JITLinkDylib* JD, llvm::jitlink::LinkGraph& G,
+      OnAllocatedFunction OnAllocated) override {
+      using namespace llvm;
+
+      jitlink::BasicLayout BL(G);
+      auto Sizes = BL.getContiguousPageBasedLayoutSizes(this->PageSize);
+      if (!Sizes) {
+         return OnAllocated(Sizes.takeError());
+      }
+      sys::MemoryBlock StandardSegments, FinalizeSegments;
+      if (!this->reserve(Sizes->StandardSegs, StandardSegments) || !this->reserve(Sizes->FinalizeSegs, FinalizeSegments)) {
+         this->release(StandardSegments);
+         return OnAllocated(make_error<StringError>("JIT slab of " + Twine(this->Slab.allocatedSize()) +
+            " bytes is full", inconvertibleErrorCode()));
+      }
+
+      auto NextStandardAddr = orc::ExecutorAddr::fromPtr(StandardSegments.base());
+      auto NextFinalizeAddr = orc::ExecutorAddr::fromPtr(FinalizeSegments.base());
+      for (auto& KV : BL.segments()) {
+         auto& SegAddr = KV.first.getMemDeallocPolicy() == jitlink::MemDeallocPolicy::Standard
+            ? NextStandardAddr : NextFinalizeAddr;
+         auto& Seg = KV.second;
+         Seg.WorkingMem = SegAddr.toPtr<char*>();
+         Seg.Addr = SegAddr;
+         SegAddr += alignTo(Seg.ContentSize + Seg.ZeroFillSize, this->PageSize);
+      }
+      if (auto Err = BL.apply()) {
+         this->release(FinalizeSegments);
+         this->release(StandardSegments);
+         return OnAllocated(std::move(Err));
+      }
+      OnAllocated(std::make_unique<SlabInFlightAlloc>(*this, std::move(BL), StandardSegments, FinalizeSegments));
+   }
+
+   using JITLinkMemoryManager::allocate;
+
+   void deallocate(std::vector<FinalizedAlloc> Allocs, OnDeallocatedFunction OnDeallocated) override {
+      using namespace llvm;
+
+      Error Err = Error::success();
+      for (auto& Alloc : llvm::reverse(Allocs)) {
+         auto Info = Alloc.release().toPtr<FinalizedAllocInfo*>();
+         Err = joinErrors(std::move(Err), orc::shared::runDeallocActions(Info->DeallocActions));
+         this->release(Info->StandardSegments);
+         delete Info;
+      }
+      OnDeallocated(std::move(Err));
+   }
+
+   using JITLinkMemoryManager::deallocate;
+
+   uint64_t getSlabSize() const {
+      return this->Slab.allocatedSize();
+   }
+   uint64_t getUsedBytes() {
+      std::lock_guard<std::mutex> guard(this->lock);
+      return this->usedBytes;
+   }
+
+   void printStatistics(llvm::raw_ostream& OS) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      OS << "JIT slab: " << (this->usedBytes >> 10) << " KB used, " << (this->peakBytes >> 10) << " KB at peak, of "
+         << (this->Slab.allocatedSize() >> 10) << " KB.\n";
+   }
+
+private:
+   /// Reserve zeroed pages, first fit.
+   bool reserve(uint64_t size, llvm::sys::MemoryBlock& block) {
+      if (!size) {
+         block = llvm::sys::MemoryBlock();
+         return true;
+      }
+      std::lock_guard<std::mutex> guard(this->lock);
+      for (auto it = this->freeRanges.begin(); it != this->freeRanges.end(); ++it) {
+         if (it->second < size) continue;
+         uint64_t offset = it->first;
+         uint64_t left = it->second - size;
+         this->freeRanges.erase(it);
+         if (left) {
+            this->freeRanges[offset + size] = left;
+         }
+         this->usedBytes += size;
+         this->peakBytes = std::max(this->peakBytes, this->usedBytes);
+         block = llvm::sys::MemoryBlock((char*)this->Slab.base() + offset, size);
+         memset(block.base(), 0, size);
+         return true;
+      }
+      return false;
+   }
+
+   /// Give back pages, writable again, merging them with their free neighbors.
+   void release(llvm::sys::MemoryBlock block) {
+      if (!block.allocatedSize()) return;
+      llvm::sys::Memory::protectMappedMemory(block, llvm::sys::Memory::MF_READ | llvm::sys::Memory::MF_WRITE);
+      uint64_t offset = (char*)block.base() - (char*)this->Slab.base();
+      uint64_t size = block.allocatedSize();
+
+      std::lock_guard<std::mutex> guard(this->lock);
+      this->usedBytes -= size;
+      auto next = this->freeRanges.find(offset + size);
+      if (next != this->freeRanges.end()) {
+         size += next->second;
+         this->freeRanges.erase(next);
+      }
+      auto previous = this->freeRanges.lower_bound(offset);
+      if (previous != this->freeRanges.begin() && (--previous)->first + previous->second == offset) {
+         previous->second += size;
+      }
+      else {
+         this->freeRanges[offset] = size;
+      }
+   }
+};
+
+/// Whether the EH frames of the objects linked can be registered, the only
+/// unwind info of ELF objects: the runtime must provide __register_frame.
+/// MSVC runtimes do not, their unwinder only reads function tables.
+inline bool canRegisterEHFrames() {
+#if defined(_MSC_VER)
+   return false;
+#else
+   return true;
+#endif
+}
+
+/// Registers the EH frames of the objects linked, so that exceptions and
+/// stack walks unwind through JIT code. Requires canRegisterEHFrames().
+inline std::unique_ptr<llvm::orc::ObjectLinkingLayer::Plugin> createEHFramePlugin(llvm::orc::ExecutionSession& ES) {
+#if defined(_MSC_VER)
+   return nullptr;
+#else
+   return std::make_unique<llvm::orc::EHFrameRegistrationPlugin>(ES,
+      std::make_unique<llvm::jitlink::InProcessEHFrameRegistrar>());
+#endif
+}
+
+/// Calls OnLinked with the graph of each object and the dylib it is linked
+/// in once its addresses are final, before it runs, and OnEmitted once it can
+/// run.
+class RTLinkGraphPlugin : public llvm::orc::ObjectLinkingLayer::Plugin {
+public:
+   using OnLinkedFunction = std::function<void(llvm::orc::JITDylib&, llvm::jitlink::LinkGraph&)>;
+   using OnEmittedFunction = std::function<void(llvm::StringRef)>;
+
+private:
+   OnLinkedFunction OnLinked;
+   OnEmittedFunction OnEmitted;
+   std::mutex lock;
+   llvm::DenseMap<llvm::orc::MaterializationResponsibility*, std::string> linking; // graph names
+
+public:
+   RTLinkGraphPlugin(OnLinkedFunction OnLinked, OnEmittedFunction OnEmitted)
+      : OnLinked(std::move(OnLinked)), OnEmitted(std::move(OnEmitted)) {
+   }
+
+   void modifyPassConfig(llvm::orc::MaterializationResponsibility& MR, llvm::jitlink::LinkGraph& G,
+      llvm::jitlink::PassConfiguration& Config) override {
+      {
+         std::lock_guard<std::mutex> guard(this->lock);
+         this->linking[&MR] = G.getName();
+      }
+      Config.PostFixupPasses.push_back([this, &JD = MR.getTargetJITDylib()](llvm::jitlink::LinkGraph& G) {
+         this->OnLinked(JD, G);
+         return llvm::Error::success();
+         });
+   }
+
+   llvm::Error notifyEmitted(llvm::orc::MaterializationResponsibility& MR) override {
+      std::string name = this->take(MR);
+      if (!name.empty()) {
+         this->OnEmitted(name);
+      }
+      return llvm::Error::success();
+   }
+   llvm::Error notifyFailed(llvm::orc::MaterializationResponsibility& MR) override {
+      this->take(MR);
+      return llvm::Error::success();
+   }
+   llvm::Error notifyRemovingResources(llvm::orc::ResourceKey K) override {
+      return llvm::Error::success();
+   }
+   void notifyTransferringResources(llvm::orc::ResourceKey DstKey, llvm::orc::ResourceKey SrcKey) override {
+   }
+
+private:
+   std::string take(llvm::orc::MaterializationResponsibility& MR) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      auto it = this->linking.find(&MR);
+      if (it == this->linking.end()) return std::string();
+      std::string name = std::move(it->second);
+      this->linking.erase(it);
+      return name;
+   }
+};
+
+/// Writes the functions of the objects linked to the perf map of the process,
+/// 'perf-<pid>.map' in dir, for profilers to name JIT frames.
+class RTPerfMapPlugin : public llvm::orc::ObjectLinkingLayer::Plugin {
+private:
+   std::mutex lock;
+   std::unique_ptr<llvm::raw_fd_ostream> OS;
+
+public:
+   RTPerfMapPlugin(llvm::StringRef dir) {
+      std::string path = (dir + "/perf-" + llvm::Twine(llvm::sys::Process::getProcessId()) + ".map").str();
+      std::error_code Err;
+      this->OS = std::make_unique<llvm::raw_fd_ostream>(path, Err, llvm::sys::fs::OF_Text);
+      if (Err) {
+         llvm::dbgs() << "Cannot write perf map " << path << ".\n";
+         this->OS.reset();
+      }
+   }
+
+   void modifyPassConfig(llvm::orc::MaterializationResponsibility& MR, llvm::jitlink::LinkGraph& G,
+      llvm::jitlink::PassConfiguration& Config) override {
+      if (!this->OS) return;
+      Config.PostFixupPasses.push_back([this](llvm::jitlink::LinkGraph& G) {
+         std::lock_guard<std::mutex> guard(this->lock);
+         for (llvm::jitlink::Symbol* Sym : G.defined_symbols()) {
+            if (Sym->isCallable() && Sym->hasName() && Sym->getSize()) {
+               *this->OS << llvm::format("%llx %llx ", (unsigned long long)Sym->getAddress().getValue(),
+                  (unsigned long long)Sym->getSize()) << Sym->getName() << "\n";
+            }
+         }
+         this->OS->flush();
+         return llvm::Error::success();
+         });
+   }
+
+   llvm::Error notifyFailed(llvm::orc::MaterializationResponsibility& MR) override {
+      return llvm::Error::success();
+   }
+   llvm::Error notifyRemovingResources(llvm::orc::ResourceKey K) override {
+      return llvm::Error::success();
+   }
+   void notifyTransferringResources(llvm::orc::ResourceKey DstKey, llvm::orc::ResourceKey SrcKey) override {
+   }
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+#include "./RTThreadPool.h"
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/ExecutionEngine/Orc/Layer.h>
+#include <llvm/Support/SmallVectorMemoryBuffer.h>
+#include <llvm/Transforms/Utils/SplitModule.h>
+#include <mutex>
+
+/// Count the function definitions of a module, used to decide whether it is
+/// worth splitting for parallel codegen.
+inline unsigned getDefinedFunctionCount(const llvm::Module& M) {
+   unsigned count = 0;
+   for (const llvm::Function& F : M) {
+      if (!F.isDeclaration()) count++;
+   }
+   return count;
+}
+
+/// Split a module into N partitions balanced by size, each one serialized as
+/// bitcode so that it can be reloaded in its own context and compiled on its
+/// own thread. Local symbols are kept local: the functions referring to them
+/// are placed in the same partition.
+///
+/// Partition identifiers are derived from the module identifier, and the split
+/// is deterministic, so the object cache keeps working per partition. With
+/// definitions, the names of the non-local definitions of each partition are
+/// returned there.
+inline std::vector<std::unique_ptr<llvm::MemoryBuffer>>
+splitModuleToBitcode(llvm::Module& M, unsigned N, std::vector<std::vector<std::string>>* definitions = nullptr) {
+   using namespace llvm;
+
+   std::vector<std::unique_ptr<MemoryBuffer>> Partitions;
+   SplitModule(M, N, [&](std::unique_ptr<Module> MPart) {
+      if (definitions) {
+         definitions->emplace_back();
+         for (GlobalValue& GV : MPart->global_values()) {
+            if (!GV.isDeclaration() && !GV.hasLocalLinkage()) {
+               definitions->back().push_back(GV.getName().str());
+            }
+         }
+      }
+      SmallVector<char, 0> BitcodeSV;
+      {
+         raw_svector_ostream BitcodeStream(BitcodeSV);
+         WriteBitcodeToFile(*MPart, BitcodeStream);
+      }
+      std::string Name;
+      raw_string_ostream(Name) << M.getModuleIdentifier() << ".part" << Partitions.size() << "of" << N;
+      Partitions.push_back(std::make_unique<SmallVectorMemoryBuffer>(std::move(BitcodeSV), Name));
+      }, true);
+   return Partitions;
+}
+
+/// Whether identifier is the one of module, or of one of its partitions.
+inline bool isPartitionOf(llvm::StringRef identifier, llvm::StringRef module) {
+   return identifier.consume_front(module) && (identifier.empty() || identifier.startswith(".part"));
+}
+
+/// Materializes a large module as partitions compiled at once on the compile
+/// pool. Adding the module only defines its symbols, like any IR module: it
+/// is split and compiled once one of them is looked up, and each object is
+/// then linked with the responsibility for the symbols of its partition.
+class RTPartitionedMaterializationUnit : public llvm::orc::IRMaterializationUnit {
+public:
+   using CompileFunction = std::function<llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>>(llvm::MemoryBufferRef)>;
+
+private:
+   unsigned numPartitions;
+   llvm::orc::ObjectLayer& ObjLayer;
+   RTThreadPool& pool;
+   CompileFunction compile;
+
+public:
+   RTPartitionedMaterializationUnit(llvm::orc::ExecutionSession& ES, const llvm::orc::IRSymbolMapper::ManglingOptions& MO,
+      llvm::orc::ThreadSafeModule TSM, unsigned numPartitions, llvm::orc::ObjectLayer& ObjLayer, RTThreadPool& pool,
+      CompileFunction compile)
+      : IRMaterializationUnit(ES, MO, std::move(TSM)), numPartitions(numPartitions), ObjLayer(ObjLayer), pool(pool),
+      compile(std::move(compile)) {
+   }
+
+   llvm::StringRef getName() const override {
+      return "RTPartitionedMaterializationUnit";
+   }
+
+   void materialize(std::unique_ptr<llvm::orc::MaterializationResponsibility> R) override {
+      using namespace llvm;
+      using namespace llvm::orc;
+
+      std::vector<std::vector<std::string>> Definitions;
+      auto Partitions = this->TSM.withModuleDo([&](Module& M) {
+         return splitModuleToBitcode(M, this->numPartitions, &Definitions);
+         });
+
+      std::vector<std::unique_ptr<MemoryBuffer>> Objects(Partitions.size());
+      std::mutex ErrLock;
+      Error Err = Error::success();
+      {
+         RTTaskGroup Group(this->pool);
+         for (size_t i = 0; i < Partitions.size(); i++) {
+            Group.spawn([&, i]() {
+               auto Obj = this->compile(Partitions[i]->getMemBufferRef());
+               std::lock_guard<std::mutex> guard(ErrLock);
+               if (Obj) {
+                  Objects[i] = std::move(*Obj);
+               }
+               else {
+                  Err = joinErrors(std::move(Err), Obj.takeError());
+               }
+               });
+         }
+      }
+      if (Err) {
+         R->getExecutionSession().reportError(std::move(Err));
+         R->failMaterialization();
+         return;
+      }
+
+      // The symbols left, such as initializers, stay with the last partition
+      StringMap<SymbolStringPtr> Mangled;
+      for (auto& KV : this->SymbolToDefinition) {
+         Mangled[KV.second->getName()] = KV.first;
+      }
+      for (size_t i = 0; i + 1 < Objects.size(); i++) {
+         SymbolNameSet Symbols;
+         for (auto& name : Definitions[i]) {
+            auto it = Mangled.find(name);
+            if (it != Mangled.end() && R->getSymbols().count(it->second)) {
+               Symbols.insert(it->second);
+            }
+         }
+         if (Symbols.empty()) continue;
+         auto PartR = R->delegate(Symbols);
+         if (!PartR) {
+            R->getExecutionSession().reportError(PartR.takeError());
+            R->failMaterialization();
+            return;
+         }
+         this->ObjLayer.emit(std::move(*PartR), std::move(Objects[i]));
+      }
+      this->ObjLayer.emit(std::move(R), std::move(Objects.back()));
+   }
+};
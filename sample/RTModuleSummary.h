@@ -0,0 +1,148 @@
+#pragma once
+
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/DebugInfo.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/SmallVectorMemoryBuffer.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <mutex>
+
+/// Index of 'available_externally' summaries for the small exported functions
+/// of the modules already added to an engine.
+///
+/// Each added module contributes one bitcode summary holding a copy of its
+/// small functions. When a later module declares one of them, the summary is
+/// linked into it so the optimizer can inline the body, while the symbol is
+/// still resolved against the original definition.
+class RTModuleSummaryIndex {
+private:
+   std::mutex lock;
+   llvm::StringMap<unsigned> functionSummaries;
+   std::vector<std::shared_ptr<llvm::MemoryBuffer>> summaries;
+
+public:
+   unsigned maxInstructionCount;
+
+   RTModuleSummaryIndex(unsigned maxInstructionCount = 32)
+      : maxInstructionCount(maxInstructionCount) {
+   }
+
+   /// Record the small exported functions of M. The caller must hold the lock
+   /// of the module context.
+   void addModule(const llvm::Module& M) {
+      using namespace llvm;
+
+      std::vector<const Function*> candidates;
+      for (const Function& F : M) {
+         if (this->isSummarizable(F)) {
+            candidates.push_back(&F);
+         }
+      }
+      if (candidates.empty()) {
+         return;
+      }
+
+      // Clone only the selected bodies, everything else becomes a declaration
+      ValueToValueMapTy VMap;
+      auto Summary = CloneModule(M, VMap, [&](const GlobalValue* GV) {
+         return std::find(candidates.begin(), candidates.end(), GV) != candidates.end();
+         });
+      for (const Function* F : candidates) {
+         cast<Function>(VMap[F])->setLinkage(GlobalValue::AvailableExternallyLinkage);
+      }
+      StripDebugInfo(*Summary);
+
+      SmallVector<char, 0> BitcodeSV;
+      {
+         raw_svector_ostream BitcodeStream(BitcodeSV);
+         WriteBitcodeToFile(*Summary, BitcodeStream);
+      }
+
+      std::lock_guard<std::mutex> guard(this->lock);
+      unsigned index = this->summaries.size();
+      this->summaries.push_back(std::make_shared<SmallVectorMemoryBuffer>(
+         std::move(BitcodeSV), M.getModuleIdentifier() + "-summary"));
+      for (const Function* F : candidates) {
+         this->functionSummaries[F->getName()] = index;
+      }
+   }
+
+   /// Link into M the summaries defining the functions it only declares.
+   /// The caller must hold the lock of the module context.
+   llvm::Error importInto(llvm::Module& M) {
+      using namespace llvm;
+
+      // Shared, a summary can be removed while it is being imported
+      std::vector<std::shared_ptr<MemoryBuffer>> imports;
+      {
+         std::lock_guard<std::mutex> guard(this->lock);
+         std::vector<unsigned> indexes;
+         for (const Function& F : M) {
+            if (!F.isDeclaration() || F.isIntrinsic()) continue;
+            auto it = this->functionSummaries.find(F.getName());
+            if (it != this->functionSummaries.end() &&
+               std::find(indexes.begin(), indexes.end(), it->second) == indexes.end()) {
+               indexes.push_back(it->second);
+            }
+         }
+         for (unsigned index : indexes) {
+            imports.push_back(this->summaries[index]);
+         }
+      }
+
+      for (auto& Import : imports) {
+         MemoryBufferRef Bitcode = Import->getMemBufferRef();
+         auto Summary = parseBitcodeFile(Bitcode, M.getContext());
+         if (!Summary) {
+            return Summary.takeError();
+         }
+         if (Linker::linkModules(M, std::move(*Summary), Linker::Flags::LinkOnlyNeeded)) {
+            return make_error<StringError>("Cannot import summary " + Bitcode.getBufferIdentifier(),
+               inconvertibleErrorCode());
+         }
+      }
+      return Error::success();
+   }
+
+   /// Forget the functions of a removed module: the modules added from now on
+   /// no longer import them.
+   void removeModule(llvm::StringRef identifier) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      for (unsigned index = 0; index < this->summaries.size(); index++) {
+         auto& Summary = this->summaries[index];
+         if (!Summary || Summary->getBufferIdentifier() != (identifier + "-summary").str()) continue;
+         for (auto it = this->functionSummaries.begin(); it != this->functionSummaries.end();) {
+            auto current = it++;
+            if (current->second == index) {
+               this->functionSummaries.erase(current);
+            }
+         }
+         Summary.reset();
+      }
+   }
+
+private:
+   bool isSummarizable(const llvm::Function& F) {
+      using namespace llvm;
+
+      if (F.isDeclaration() || !F.hasExternalLinkage() || F.isVarArg() ||
+         F.hasFnAttribute(Attribute::NoInline) ||
+         F.getInstructionCount() > this->maxInstructionCount) {
+         return false;
+      }
+
+      // The copied body must only refer to symbols visible from other modules
+      for (const BasicBlock& BB : F) {
+         for (const Instruction& I : BB) {
+            for (const Use& Op : I.operands()) {
+               auto GV = dyn_cast<GlobalValue>(Op->stripPointerCasts());
+               if (GV && GV->hasLocalLinkage()) {
+                  return false;
+               }
+            }
+         }
+      }
+      return true;
+   }
+};
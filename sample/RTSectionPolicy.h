@@ -0,0 +1,110 @@
+#pragma once
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ExecutionEngine/RuntimeDyld.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <mutex>
+
+/// Which sections of the objects are loaded in JIT memory. Only allocatable
+/// sections are needed to run the code, its unwind info and symbols included;
+/// the others, mostly debug sections, can be left out of line.
+enum class RTSectionPolicy {
+   // Every section is copied in JIT memory
+   LoadAll,
+   // Allocatable sections only: the others stay in the object of the cache,
+   // which is mapped to read them
+   MapFromCache,
+   // Allocatable sections only: the others are dropped
+   Drop,
+};
+
+/// Accounts per module for the sections of the objects loaded: the bytes
+/// copied in JIT memory, and the bytes of the sections left out, which are
+/// saved. With RTSectionPolicy::MapFromCache, keeps the mapping of the
+/// cached objects, where the sections left out can be read. The mapping is
+/// shared with the readers, such as the debug registrar, and outlives the
+/// removal of its module while they read it.
+class RTSectionAccounting {
+private:
+   struct ModuleSections {
+      uint64_t loadedBytes = 0;
+      uint64_t skippedBytes = 0;
+      unsigned skippedSections = 0;
+      std::shared_ptr<llvm::MemoryBuffer> mappedObject;
+   };
+   mutable std::mutex lock;
+   llvm::StringMap<ModuleSections> modules;
+
+public:
+   /// Account for an object linked from the module name, with all its
+   /// sections if allSectionsLoaded. cachedObjectPath is where the object was
+   /// cached, mapped if sections were left out. Returns the mapping, null if
+   /// none.
+   std::shared_ptr<llvm::MemoryBuffer> notifyLoaded(llvm::StringRef name, const llvm::object::ObjectFile& Object,
+      const llvm::RuntimeDyld::LoadedObjectInfo& LOS, bool allSectionsLoaded, llvm::StringRef cachedObjectPath) {
+      ModuleSections sections;
+      for (const llvm::object::SectionRef& Section : Object.sections()) {
+         // The sections not needed to run have no load address, loaded or not
+         if (LOS.getSectionLoadAddress(Section) || allSectionsLoaded) {
+            sections.loadedBytes += Section.getSize();
+         }
+         else if (!Section.isVirtual()) {
+            sections.skippedBytes += Section.getSize();
+            sections.skippedSections++;
+         }
+      }
+      if (sections.skippedSections && !cachedObjectPath.empty()) {
+         // Mapped rather than read, unless small: the pages are only touched
+         // when the sections are read
+         auto Mapped = llvm::MemoryBuffer::getFileSlice(cachedObjectPath, Object.getData().size(), 0);
+         if (Mapped) {
+            sections.mappedObject = std::move(*Mapped);
+         }
+      }
+
+      std::lock_guard<std::mutex> guard(this->lock);
+      auto& entry = this->modules[name];
+      entry.loadedBytes += sections.loadedBytes;
+      entry.skippedBytes += sections.skippedBytes;
+      entry.skippedSections += sections.skippedSections;
+      if (sections.mappedObject) {
+         entry.mappedObject = sections.mappedObject;
+      }
+      return sections.mappedObject;
+   }
+
+   /// Forget the modules for which removed returns true, unmapping their
+   /// cached objects.
+   void removeModules(llvm::function_ref<bool(llvm::StringRef)> removed) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      for (auto it = this->modules.begin(); it != this->modules.end();) {
+         auto current = it++;
+         if (removed(current->getKey())) {
+            this->modules.erase(current);
+         }
+      }
+   }
+
+   void printStatistics(llvm::raw_ostream& OS) const {
+      std::lock_guard<std::mutex> guard(this->lock);
+      uint64_t loaded = 0, skipped = 0;
+      for (auto& entry : this->modules) {
+         const ModuleSections& sections = entry.second;
+         OS << "Sections of " << entry.getKey() << ": " << sections.loadedBytes << " bytes loaded";
+         if (sections.skippedSections) {
+            OS << ", " << sections.skippedBytes << " bytes in " << sections.skippedSections << " sections "
+               << (sections.mappedObject ? "mapped" : "dropped");
+         }
+         OS << ".\n";
+         loaded += sections.loadedBytes;
+         skipped += sections.skippedBytes;
+      }
+      if (loaded + skipped) {
+         OS << "Sections: " << loaded << " bytes loaded, " << skipped << " bytes saved ("
+            << llvm::format("%.1f", 100.0 * skipped / (loaded + skipped)) << "%).\n";
+      }
+   }
+};
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Compiler.h>
+#include <llvm/Support/Debug.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#include <windows.h>
+#include <tlhelp32.h>
+
+/// The functions of JIT code by address, to name the frames of snapshots
+/// without DbgHelp, which knows nothing of them.
+class RTFunctionTable {
+private:
+   struct Function {
+      uint64_t end;
+      std::string name;
+      std::string module;
+   };
+   mutable std::shared_mutex lock;
+   std::map<uint64_t, Function> functions; // by start address
+   llvm::StringMap<std::vector<uint64_t>> modules; // start addresses by module
+
+public:
+   void addFunction(uint64_t address, uint64_t size, llvm::StringRef name, llvm::StringRef module) {
+      std::unique_lock<std::shared_mutex> guard(this->lock);
+      this->functions[address] = Function{ address + size, name.str(), module.str() };
+      this->modules[module].push_back(address);
+   }
+
+   /// Forget the functions of the modules for which removed returns true, in
+   /// time proportional to the number of modules and of functions removed.
+   void removeModules(llvm::function_ref<bool(llvm::StringRef)> removed) {
+      std::unique_lock<std::shared_mutex> guard(this->lock);
+      for (auto it = this->modules.begin(); it != this->modules.end();) {
+         auto current = it++;
+         if (!removed(current->getKey())) continue;
+         for (uint64_t address : current->second) {
+            auto function = this->functions.find(address);
+            if (function != this->functions.end() && function->second.module == current->getKey()) {
+               this->functions.erase(function);
+            }
+         }
+         this->modules.erase(current);
+      }
+   }
+
+   bool contains(uint64_t address) const {
+      std::shared_lock<std::shared_mutex> guard(this->lock);
+      auto it = this->functions.upper_bound(address);
+      return it != this->functions.begin() && address < std::prev(it)->second.end;
+   }
+
+   /// The function containing address, and the offset of address in it.
+   bool lookup(uint64_t address, std::string& name, uint64_t& offset) const {
+      std::shared_lock<std::shared_mutex> guard(this->lock);
+      auto it = this->functions.upper_bound(address);
+      if (it == this->functions.begin()) return false;
+      --it;
+      if (address >= it->second.end) return false;
+      name = it->second.name;
+      offset = address - it->first;
+      return true;
+   }
+};
+
+/// The lock of the function tables of JIT code, held by all the engines of the
+/// process around RtlAddFunctionTable and RtlDeleteFunctionTable, which take
+/// the lock of the dynamic function tables. Unwinding looks these tables up:
+/// threads are only suspended to be unwound with this lock held, so that none
+/// is suspended while it holds theirs.
+inline std::mutex& getFunctionTableLock() {
+   static std::mutex lock;
+   return lock;
+}
+
+/// The raw stack of a thread: return addresses, innermost first.
+struct RTStackSnapshot {
+   static constexpr unsigned MaxFrames = 62;
+   uint64_t id;
+   uint64_t timestamp; // microseconds, system clock
+   DWORD threadId;
+   unsigned frameCount = 0;
+   void* frames[MaxFrames];
+};
+
+/// Takes stack snapshots without stopping the program: the requesting
+/// thread only captures raw return addresses, in microseconds, and queues
+/// them. A background thread symbolizes them through symbolize, then appends
+/// them to a file which is rotated once it reaches maxFileBytes, keeping
+/// maxFiles of them: path, path.1, ...
+///
+/// Snapshots requested while too many are queued are dropped.
+class RTSnapshotService {
+public:
+   using Symbolizer = std::function<void(uint64_t, llvm::raw_ostream&)>;
+
+private:
+   static constexpr size_t MaxQueued = 256;
+
+   Symbolizer symbolize;
+   std::string path;
+   uint64_t maxFileBytes;
+   unsigned maxFiles;
+
+   std::mutex lock;
+   std::condition_variable wakeUp;
+   std::deque<std::vector<RTStackSnapshot>> queue;
+   bool stopping = false;
+   std::atomic<uint64_t> nextId;
+   std::atomic<uint64_t> dropped;
+   std::thread writer;
+
+public:
+   RTSnapshotService(Symbolizer symbolize, llvm::StringRef path, uint64_t maxFileBytes = 1 << 20, unsigned maxFiles = 4)
+      : symbolize(std::move(symbolize)), path(path.str()), maxFileBytes(maxFileBytes), maxFiles(maxFiles),
+      nextId(0), dropped(0) {
+      this->writer = std::thread([this]() { this->run(); });
+   }
+   ~RTSnapshotService() {
+      {
+         std::lock_guard<std::mutex> guard(this->lock);
+         this->stopping = true;
+      }
+      this->wakeUp.notify_one();
+      this->writer.join();
+   }
+
+   /// Snapshot the stack of the calling thread, from its caller, and return.
+   /// The 'skipFrames' frames above the caller are left out too: the ones of
+   /// the code reporting the snapshot, rather than asking for it.
+   LLVM_ATTRIBUTE_NOINLINE void captureCurrentThread(unsigned skipFrames = 0) {
+      std::vector<RTStackSnapshot> snapshots(1);
+      RTStackSnapshot& snapshot = snapshots.front();
+      snapshot.threadId = GetCurrentThreadId();
+      snapshot.frameCount = RtlCaptureStackBackTrace(1 + skipFrames, RTStackSnapshot::MaxFrames, snapshot.frames, NULL);
+      this->enqueue(std::move(snapshots));
+   }
+
+   /// Snapshot the stacks of all the threads of the process, each one being
+   /// suspended while its stack is walked, and return. The stack of the
+   /// calling thread skips 'skipFrames' frames above its caller.
+   LLVM_ATTRIBUTE_NOINLINE void captureAllThreads(unsigned skipFrames = 0) {
+      DWORD currentThreadId = GetCurrentThreadId();
+      std::vector<DWORD> threadIds;
+      HANDLE threads = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+      if (threads == INVALID_HANDLE_VALUE) return;
+      THREADENTRY32 entry;
+      entry.dwSize = sizeof(entry);
+      for (BOOL more = Thread32First(threads, &entry); more; more = Thread32Next(threads, &entry)) {
+         if (entry.th32OwnerProcessID == GetCurrentProcessId() && entry.th32ThreadID != currentThreadId) {
+            threadIds.push_back(entry.th32ThreadID);
+         }
+      }
+      CloseHandle(threads);
+
+      // Allocated ahead: a suspended thread may hold the heap lock
+      std::vector<RTStackSnapshot> snapshots(threadIds.size() + 1);
+      unsigned count = 0;
+      std::unique_lock<std::mutex> tablesGuard(getFunctionTableLock());
+      for (DWORD threadId : threadIds) {
+         HANDLE thread = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION, FALSE, threadId);
+         if (!thread) continue;
+         if (SuspendThread(thread) != (DWORD)-1) {
+            CONTEXT context;
+            memset(&context, 0, sizeof(CONTEXT));
+            context.ContextFlags = CONTEXT_FULL;
+            if (GetThreadContext(thread, &context)) {
+               RTStackSnapshot& snapshot = snapshots[count++];
+               snapshot.threadId = threadId;
+               walkStack(context, snapshot);
+            }
+            ResumeThread(thread);
+         }
+         CloseHandle(thread);
+      }
+      tablesGuard.unlock();
+      RTStackSnapshot& current = snapshots[count++];
+      current.threadId = currentThreadId;
+      current.frameCount = RtlCaptureStackBackTrace(1 + skipFrames, RTStackSnapshot::MaxFrames, current.frames, NULL);
+      snapshots.resize(count);
+      this->enqueue(std::move(snapshots));
+   }
+
+   uint64_t getDroppedCount() const {
+      return this->dropped;
+   }
+
+private:
+   void enqueue(std::vector<RTStackSnapshot> snapshots) {
+      uint64_t id = this->nextId++;
+      uint64_t timestamp = std::chrono::duration_cast<std::chrono::microseconds>(
+         std::chrono::system_clock::now().time_since_epoch()).count();
+      for (RTStackSnapshot& snapshot : snapshots) {
+         snapshot.id = id;
+         snapshot.timestamp = timestamp;
+      }
+      {
+         std::lock_guard<std::mutex> guard(this->lock);
+         if (this->queue.size() >= MaxQueued) {
+            this->dropped++;
+            return;
+         }
+         this->queue.push_back(std::move(snapshots));
+      }
+      this->wakeUp.notify_one();
+   }
+
+   /// Unwind a suspended thread through the function tables, JIT code
+   /// included, without allocating. The walk stops at the first frame without
+   /// function entry: its return address cannot be found reliably, a leaf
+   /// function and code without unwind info looking alike.
+   static void walkStack(CONTEXT& context, RTStackSnapshot& snapshot) {
+      while (snapshot.frameCount < RTStackSnapshot::MaxFrames && context.Rip) {
+         snapshot.frames[snapshot.frameCount++] = (void*)context.Rip;
+         DWORD64 ImageBase;
+         PRUNTIME_FUNCTION pFunctionEntry = ::RtlLookupFunctionEntry(context.Rip, &ImageBase, NULL);
+         if (!pFunctionEntry) break;
+         PVOID HandlerData;
+         DWORD64 EstablisherFrame;
+         ::RtlVirtualUnwind(UNW_FLAG_NHANDLER, ImageBase, context.Rip, pFunctionEntry,
+            &context, &HandlerData, &EstablisherFrame, NULL);
+      }
+   }
+
+   void run() {
+      std::unique_ptr<llvm::raw_fd_ostream> OS;
+      uint64_t appendedBytes = 0;
+      while (1) {
+         std::vector<RTStackSnapshot> snapshots;
+         {
+            std::unique_lock<std::mutex> guard(this->lock);
+            this->wakeUp.wait(guard, [this]() { return this->stopping || !this->queue.empty(); });
+            if (this->queue.empty()) return;
+            snapshots = std::move(this->queue.front());
+            this->queue.pop_front();
+         }
+
+         if (!OS || appendedBytes + OS->tell() >= this->maxFileBytes) {
+            bool rotate = OS != nullptr;
+            OS.reset();
+            OS = this->openFile(rotate, appendedBytes);
+            if (!OS) continue;
+         }
+         *OS << "------ snapshot " << snapshots.front().id << " @" << snapshots.front().timestamp << "us ------\n";
+         for (const RTStackSnapshot& snapshot : snapshots) {
+            *OS << "thread " << snapshot.threadId << ":\n";
+            for (unsigned i = 0; i < snapshot.frameCount; i++) {
+               *OS << "> " << llvm::format_hex((uint64_t)snapshot.frames[i], 18) << ": ";
+               this->symbolize((uint64_t)snapshot.frames[i], *OS);
+               *OS << "\n";
+            }
+         }
+         OS->flush();
+      }
+   }
+
+   /// Open the file to append to, rotating the files if it is full.
+   /// appendedBytes is set to the size of the file before appending.
+   std::unique_ptr<llvm::raw_fd_ostream> openFile(bool rotate, uint64_t& appendedBytes) {
+      using namespace llvm;
+
+      appendedBytes = 0;
+      if (!rotate && sys::fs::file_size(this->path, appendedBytes)) {
+         appendedBytes = 0;
+      }
+      if (rotate) {
+         for (unsigned i = this->maxFiles - 1; i > 0; i--) {
+            std::string from = i > 1 ? this->path + "." + std::to_string(i - 1) : this->path;
+            sys::fs::rename(from, this->path + "." + std::to_string(i));
+         }
+      }
+      std::error_code Err;
+      auto OS = std::make_unique<raw_fd_ostream>(this->path, Err, rotate ? sys::fs::OF_None : sys::fs::OF_Append);
+      if (Err) {
+         dbgs() << "Cannot write snapshots in " << this->path << ".\n";
+         return nullptr;
+      }
+      return OS;
+   }
+};
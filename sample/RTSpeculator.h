@@ -0,0 +1,208 @@
+#pragma once
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/Format.h>
+#include <atomic>
+#include <functional>
+#include <mutex>
+
+/// Static call graph of the modules added to an engine, used to compile the
+/// likely next callees of a function in the background before they are reached.
+///
+/// Callees defined in the same module as their caller are materialized with it
+/// and are not worth speculating, so speculation only targets the functions
+/// of other modules reachable within 'maxDepth' calls.
+///
+/// A speculated function is a hit when the engine client later looks it up.
+/// Functions resolved by the linker are demanded but not hits: modules
+/// materialized by speculation are linked as well. A speculated function is
+/// wasted when it is never looked up.
+///
+/// Functions are known within a scope, the dylib of their tenant: tenants
+/// defining the same names never share a call graph.
+class RTSpeculator {
+private:
+   struct Callee {
+      std::string name;
+      unsigned callSites;
+   };
+   struct FunctionInfo {
+      unsigned moduleId = 0;
+      std::vector<Callee> callees;
+      bool speculated = false;
+      bool demanded = false;
+      bool lookedUp = false;
+      double compileTime = 0;
+   };
+   std::mutex lock;
+   llvm::StringMap<FunctionInfo> functions;
+   std::function<std::string(llvm::StringRef)> mangle;
+   unsigned nextModuleId = 0;
+
+   std::atomic<unsigned> numSpeculated{ 0 };
+   std::atomic<unsigned> numCompleted{ 0 };
+   std::atomic<unsigned> numFailed{ 0 };
+   std::atomic<unsigned> numSkipped{ 0 };
+
+   /// Names are unique within a scope, and scopes are dylib names.
+   static std::string getKey(llvm::StringRef scope, llvm::StringRef name) {
+      return (scope + "\n" + name).str();
+   }
+
+public:
+   unsigned maxDepth;
+
+   RTSpeculator(std::function<std::string(llvm::StringRef)> mangle, unsigned maxDepth = 2)
+      : mangle(std::move(mangle)), maxDepth(maxDepth) {
+   }
+
+   /// Record the direct calls of the functions defined in M, in scope. The
+   /// caller must hold the lock of the module context.
+   void addModule(const llvm::Module& M, llvm::StringRef scope) {
+      using namespace llvm;
+
+      std::vector<std::pair<std::string, std::vector<Callee>>> graph;
+      for (const Function& F : M) {
+         if (F.isDeclaration() || F.hasLocalLinkage()) continue;
+         std::vector<Callee> callees;
+         for (const Instruction& I : instructions(F)) {
+            auto Call = dyn_cast<CallBase>(&I);
+            auto CalleeF = Call ? Call->getCalledFunction() : nullptr;
+            if (!CalleeF || CalleeF->isIntrinsic() || CalleeF->hasLocalLinkage() || CalleeF == &F) continue;
+            std::string name = this->mangle(CalleeF->getName());
+            auto it = std::find_if(callees.begin(), callees.end(), [&](const Callee& C) { return C.name == name; });
+            if (it != callees.end()) it->callSites++;
+            else callees.push_back(Callee{ name, 1 });
+         }
+         std::sort(callees.begin(), callees.end(), [](const Callee& A, const Callee& B) {
+            return A.callSites > B.callSites;
+            });
+         graph.emplace_back(getKey(scope, this->mangle(F.getName())), std::move(callees));
+      }
+
+      std::lock_guard<std::mutex> guard(this->lock);
+      unsigned moduleId = ++this->nextModuleId;
+      for (auto& node : graph) {
+         FunctionInfo& info = this->functions[node.first];
+         info.moduleId = moduleId;
+         info.callees = std::move(node.second);
+      }
+   }
+
+   /// Select the functions of scope to compile ahead of 'root', most called
+   /// first. They are marked as speculated and must be reported back with
+   /// 'notifySpeculationDone'.
+   std::vector<std::string> selectTargets(llvm::StringRef scope, llvm::StringRef root) {
+      std::vector<std::string> targets;
+      std::lock_guard<std::mutex> guard(this->lock);
+      auto rootIt = this->functions.find(getKey(scope, root));
+      if (rootIt == this->functions.end()) return targets;
+
+      std::vector<llvm::StringRef> visited = { rootIt->first() };
+      std::vector<std::pair<llvm::StringRef, unsigned>> worklist = { { rootIt->first(), 0 } };
+      for (size_t i = 0; i < worklist.size(); i++) {
+         auto callerIt = this->functions.find(worklist[i].first);
+         unsigned depth = worklist[i].second;
+         for (const Callee& callee : callerIt->second.callees) {
+            auto it = this->functions.find(getKey(scope, callee.name));
+            if (it == this->functions.end()) continue;
+            if (std::find(visited.begin(), visited.end(), it->first()) != visited.end()) continue;
+            visited.push_back(it->first());
+
+            FunctionInfo& info = it->second;
+            if (info.moduleId != rootIt->second.moduleId && !info.speculated && !info.demanded) {
+               info.speculated = true;
+               targets.push_back(callee.name);
+            }
+            if (depth + 1 < this->maxDepth) {
+               worklist.push_back({ it->first(), depth + 1 });
+            }
+         }
+      }
+      this->numSpeculated += targets.size();
+      return targets;
+   }
+
+   /// Report a speculated target which could not be scheduled.
+   void notifySpeculationSkipped(llvm::StringRef scope, llvm::StringRef name) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      auto it = this->functions.find(getKey(scope, name));
+      if (it != this->functions.end()) it->second.speculated = false;
+      this->numSpeculated--;
+      this->numSkipped++;
+   }
+
+   void notifySpeculationDone(llvm::StringRef scope, llvm::StringRef name, double seconds, bool failed) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      auto it = this->functions.find(getKey(scope, name));
+      if (it != this->functions.end()) it->second.compileTime = seconds;
+      (failed ? this->numFailed : this->numCompleted)++;
+   }
+
+   /// Record that a function is needed, by a client lookup if lookedUp, or
+   /// by the linker resolving the references of a module.
+   void notifyDemanded(llvm::StringRef scope, llvm::StringRef name, bool lookedUp) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      auto it = this->functions.find(getKey(scope, name));
+      if (it == this->functions.end()) return;
+      it->second.demanded = true;
+      it->second.lookedUp |= lookedUp;
+   }
+
+   /// Forget the functions of scope, once its dylib is removed.
+   void removeScope(llvm::StringRef scope) {
+      std::string prefix = getKey(scope, "");
+      std::lock_guard<std::mutex> guard(this->lock);
+      for (auto it = this->functions.begin(); it != this->functions.end();) {
+         auto current = it++;
+         if (current->getKey().startswith(prefix)) {
+            this->functions.erase(current);
+         }
+      }
+   }
+
+   struct Statistics {
+      unsigned speculated = 0;
+      unsigned completed = 0;
+      unsigned failed = 0;
+      unsigned skipped = 0;
+      unsigned hits = 0;
+      unsigned wasted = 0;
+      double wastedTime = 0; // in seconds
+   };
+
+   Statistics getStatistics() {
+      Statistics stats;
+      {
+         std::lock_guard<std::mutex> guard(this->lock);
+         for (auto& entry : this->functions) {
+            const FunctionInfo& info = entry.second;
+            if (!info.speculated) continue;
+            if (info.lookedUp) {
+               stats.hits++;
+            }
+            else {
+               stats.wasted++;
+               stats.wastedTime += info.compileTime;
+            }
+         }
+      }
+      stats.speculated = this->numSpeculated;
+      stats.completed = this->numCompleted;
+      stats.failed = this->numFailed;
+      stats.skipped = this->numSkipped;
+      return stats;
+   }
+
+   void printStatistics(llvm::raw_ostream& OS) {
+      Statistics stats = this->getStatistics();
+      OS << "speculation: " << stats.speculated << " speculated, "
+         << stats.completed << " completed, " << stats.failed << " failed, "
+         << stats.skipped << " skipped (no idle thread)\n";
+      OS << "speculation: " << stats.hits << " hits ("
+         << llvm::format("%.1f", stats.speculated ? 100.0 * stats.hits / stats.speculated : 0.0) << "%), "
+         << stats.wasted << " wasted (" << llvm::format("%.3f", stats.wastedTime * 1000) << " ms)\n";
+   }
+};
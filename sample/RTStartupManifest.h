@@ -0,0 +1,94 @@
+#pragma once
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+/// Records the JIT symbols demanded during the first seconds of a run, to be
+/// compiled eagerly at the next start before traffic arrives.
+///
+/// The manifest is a text file with one symbol per line, in the order they
+/// were first demanded: "<name> <first use in ms> <use count>".
+class RTStartupRecorder {
+private:
+   struct Entry {
+      std::string name;
+      double firstUse;
+      unsigned count;
+   };
+   std::mutex lock;
+   llvm::StringMap<unsigned> indexes;
+   std::vector<Entry> entries;
+   std::chrono::steady_clock::time_point startTime;
+   std::chrono::duration<double> window;
+   std::atomic<bool> recording;
+
+public:
+   RTStartupRecorder(double seconds)
+      : startTime(std::chrono::steady_clock::now()), window(seconds), recording(seconds > 0) {
+   }
+
+   bool isRecording() {
+      return this->recording.load(std::memory_order_relaxed);
+   }
+
+   /// Record a demanded symbol. Returns true when this call closes the
+   /// recording window, the manifest being then ready to be written.
+   bool record(llvm::StringRef name) {
+      if (!this->recording.load(std::memory_order_relaxed)) return false;
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - this->startTime;
+      if (elapsed > this->window) {
+         return this->recording.exchange(false);
+      }
+
+      std::lock_guard<std::mutex> guard(this->lock);
+      auto it = this->indexes.try_emplace(name, this->entries.size());
+      if (it.second) {
+         this->entries.push_back(Entry{ name.str(), elapsed.count() * 1000, 1 });
+      }
+      else {
+         this->entries[it.first->second].count++;
+      }
+      return false;
+   }
+
+   void stop() {
+      this->recording.store(false);
+   }
+
+   /// Write the symbols recorded for which keep returns true.
+   llvm::Error writeManifest(llvm::StringRef path, llvm::function_ref<bool(llvm::StringRef)> keep) {
+      std::error_code EC;
+      llvm::raw_fd_ostream OS(path, EC);
+      if (EC) {
+         return llvm::errorCodeToError(EC);
+      }
+      std::lock_guard<std::mutex> guard(this->lock);
+      for (const Entry& entry : this->entries) {
+         if (!keep(entry.name)) continue;
+         OS << entry.name << " " << llvm::format("%.3f", entry.firstUse) << " " << entry.count << "\n";
+      }
+      return llvm::Error::success();
+   }
+
+   static llvm::Expected<std::vector<std::string>> readManifest(llvm::StringRef path) {
+      auto Buffer = llvm::MemoryBuffer::getFile(path);
+      if (!Buffer) {
+         return llvm::errorCodeToError(Buffer.getError());
+      }
+      std::vector<std::string> names;
+      llvm::SmallVector<llvm::StringRef, 0> lines;
+      (*Buffer)->getBuffer().split(lines, '\n', -1, false);
+      for (llvm::StringRef line : lines) {
+         llvm::StringRef name = line.split(' ').first.trim();
+         if (!name.empty()) {
+            names.push_back(name.str());
+         }
+      }
+      return names;
+   }
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "./RTModuleSummary.h"
+#include <llvm/ExecutionEngine/Orc/Core.h>
+#include <mutex>
+
+/// A tenant of an engine: its modules live in a JITDylib of its own, which
+/// links against the runtime dylib only, so that its lookups never search the
+/// code of other tenants and it can be unloaded as a whole. Cross-module
+/// inlining stays within the tenant, with summaries of its own.
+class RTTenant {
+private:
+   std::mutex lock;
+   llvm::StringMap<llvm::orc::ResourceTrackerSP> trackers; // by module identifier
+
+public:
+   llvm::orc::JITDylib& JD;
+   RTModuleSummaryIndex Summaries;
+
+   RTTenant(llvm::orc::JITDylib& JD, unsigned summaryMaxInstructions)
+      : JD(JD), Summaries(summaryMaxInstructions) {
+   }
+
+   llvm::StringRef getName() const {
+      return this->JD.getName();
+   }
+
+   /// The resource tracker of a module, shared by the modules of the same
+   /// identifier: removing a module frees all its resources at once.
+   llvm::orc::ResourceTrackerSP getResourceTracker(llvm::StringRef identifier) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      auto& RT = this->trackers[identifier];
+      if (!RT) {
+         RT = this->JD.createResourceTracker();
+      }
+      return RT;
+   }
+
+   /// Take the resource tracker of a module, to remove it. Null if the module
+   /// was not added to this tenant.
+   llvm::orc::ResourceTrackerSP takeResourceTracker(llvm::StringRef identifier) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      auto it = this->trackers.find(identifier);
+      if (it == this->trackers.end()) {
+         return nullptr;
+      }
+      auto RT = std::move(it->second);
+      this->trackers.erase(it);
+      return RT;
+   }
+
+   std::vector<std::string> getModuleIdentifiers() {
+      std::lock_guard<std::mutex> guard(this->lock);
+      std::vector<std::string> identifiers;
+      for (auto& entry : this->trackers) {
+         identifiers.push_back(entry.getKey().str());
+      }
+      return identifiers;
+   }
+};
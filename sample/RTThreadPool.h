@@ -0,0 +1,308 @@
+#pragma once
+
+#include <llvm/ADT/FunctionExtras.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using RTTask = llvm::unique_function<void()>;
+
+/// Multi-producer single-consumer queue (Vyukov intrusive queue).
+/// Pushing is one atomic exchange, so submitting threads never take a lock
+/// and never wait on the consumer. Consumers may change, as long as they pop
+/// one at a time.
+class RTTaskQueue {
+private:
+   struct Node {
+      std::atomic<Node*> next;
+      RTTask task;
+   };
+   std::atomic<Node*> head;
+   Node* tail;
+   Node stub;
+
+public:
+   RTTaskQueue() {
+      this->stub.next.store(nullptr, std::memory_order_relaxed);
+      this->head.store(&this->stub, std::memory_order_relaxed);
+      this->tail = &this->stub;
+   }
+   ~RTTaskQueue() {
+      RTTask task;
+      while (this->pop(task));
+   }
+
+   /// Can be called from any thread.
+   void push(RTTask task) {
+      Node* node = new Node();
+      node->task = std::move(task);
+      this->pushNode(node);
+   }
+
+   /// Must only be called by one consumer at a time.
+   bool pop(RTTask& task) {
+      Node* tail = this->tail;
+      Node* next = tail->next.load(std::memory_order_acquire);
+      if (tail == &this->stub) {
+         if (!next) return false;
+         this->tail = tail = next;
+         next = next->next.load(std::memory_order_acquire);
+      }
+      if (!next) {
+         // The last node can only be taken once the stub is queued behind it,
+         // a producer being in the middle of a push otherwise.
+         if (tail != this->head.load(std::memory_order_acquire)) return false;
+         this->pushNode(&this->stub);
+         next = tail->next.load(std::memory_order_acquire);
+         if (!next) return false;
+      }
+      this->tail = next;
+      task = std::move(tail->task);
+      delete tail;
+      return true;
+   }
+
+private:
+   void pushNode(Node* node) {
+      node->next.store(nullptr, std::memory_order_relaxed);
+      Node* prev = this->head.exchange(node, std::memory_order_acq_rel);
+      prev->next.store(node, std::memory_order_release);
+   }
+};
+
+/// Work-stealing thread pool.
+///
+/// Each worker owns an MPSC submission queue and a local deque: submitted
+/// tasks are spread round-robin over the submission queues, a worker drains
+/// its own queue into its deque and runs tasks from its back, and idle
+/// workers steal from the front of the other deques, draining the submission
+/// queue of their victim first. The queue of a worker is drained under the
+/// lock of its deque, so it has one consumer at a time.
+///
+/// Idle workers block until a task is queued anywhere in the pool. A pool
+/// created stopped has no thread until it is started: its tasks are queued.
+class RTThreadPool {
+private:
+   struct Worker {
+      RTTaskQueue submissions;
+      std::mutex lock;
+      std::deque<RTTask> tasks;
+      std::thread thread;
+   };
+   std::vector<std::unique_ptr<Worker>> workers;
+   std::atomic<unsigned> nextWorker{ 0 };
+   std::atomic<bool> stopping{ false };
+   std::atomic<bool> draining{ false };
+   std::atomic<size_t> queued{ 0 }; // tasks submitted, not taken yet
+   std::atomic<unsigned> sleepers{ 0 };
+   std::mutex sleepLock;
+   std::condition_variable sleepCond;
+   std::once_flag startOnce;
+
+   static inline thread_local RTThreadPool* currentPool = nullptr;
+   static inline thread_local unsigned currentWorker = 0;
+
+public:
+   RTThreadPool(unsigned numThreads = std::thread::hardware_concurrency(), bool started = true) {
+      if (numThreads == 0) numThreads = 1;
+      for (unsigned i = 0; i < numThreads; i++) {
+         this->workers.push_back(std::make_unique<Worker>());
+      }
+      if (started) {
+         this->start();
+      }
+   }
+   ~RTThreadPool() {
+      {
+         std::lock_guard<std::mutex> guard(this->sleepLock);
+         this->stopping.store(true);
+      }
+      this->sleepCond.notify_all();
+      this->join();
+   }
+
+   /// Start the workers of a pool created stopped, once.
+   void start() {
+      std::call_once(this->startOnce, [this]() {
+         for (unsigned i = 0; i < this->workers.size(); i++) {
+            this->workers[i]->thread = std::thread([this, i]() { this->runWorker(i); });
+         }
+         });
+   }
+
+   /// Run the tasks queued, and the ones they queue, then stop the workers.
+   /// Tasks submitted once the workers are stopped are not run.
+   void join() {
+      if (this->queued.load()) {
+         this->start();
+      }
+      {
+         std::lock_guard<std::mutex> guard(this->sleepLock);
+         this->draining.store(true);
+      }
+      this->sleepCond.notify_all();
+      for (auto& worker : this->workers) {
+         if (worker->thread.joinable()) {
+            worker->thread.join();
+         }
+      }
+   }
+
+   unsigned getThreadCount() {
+      return this->workers.size();
+   }
+
+   /// Queue a task, from any thread. Tasks submitted from a worker go to its
+   /// own deque, so that nested work stays local until it is stolen.
+   void submit(RTTask task) {
+      if (currentPool == this) {
+         Worker& worker = *this->workers[currentWorker];
+         std::lock_guard<std::mutex> guard(worker.lock);
+         worker.tasks.push_back(std::move(task));
+      }
+      else {
+         unsigned index = this->nextWorker.fetch_add(1, std::memory_order_relaxed) % this->workers.size();
+         this->workers[index]->submissions.push(std::move(task));
+      }
+      this->queued.fetch_add(1);
+      this->wakeSleeper();
+   }
+
+   /// Whether some workers are waiting for work.
+   bool hasIdleWorkers() {
+      return this->sleepers.load(std::memory_order_relaxed) > 0;
+   }
+
+   /// Run one queued task on the calling thread, if any is available.
+   /// Used by threads waiting on tasks, so that waiting never starves the pool.
+   bool runPendingTask() {
+      RTTask task;
+      if (currentPool == this) {
+         if (!this->takeLocalTask(currentWorker, task) && !this->stealTask(currentWorker, task)) {
+            return false;
+         }
+      }
+      else if (!this->stealTask(-1, task)) {
+         return false;
+      }
+      task();
+      return true;
+   }
+
+private:
+   void runWorker(unsigned index) {
+      currentPool = this;
+      currentWorker = index;
+      while (!this->stopping.load(std::memory_order_acquire)) {
+         if (this->runPendingTask()) {
+            continue;
+         }
+         // The tasks queued by the tasks still running are run by their worker
+         if (this->draining.load() && this->queued.load() == 0) {
+            return;
+         }
+         // Pairs with 'submit': either the submitter sees this worker among
+         // the sleepers and wakes it, or the worker sees the task queued and
+         // does not wait. Every queued task can be stolen, so any worker can
+         // take the one it is woken for.
+         std::unique_lock<std::mutex> guard(this->sleepLock);
+         this->sleepers.fetch_add(1);
+         this->sleepCond.wait(guard, [&]() {
+            return this->stopping.load() || this->draining.load() || this->queued.load() > 0;
+            });
+         this->sleepers.fetch_sub(1);
+         if (this->queued.load() > 0) {
+            // The task may be held for a moment, by a push or a victim lock
+            guard.unlock();
+            std::this_thread::yield();
+         }
+      }
+   }
+
+   void wakeSleeper() {
+      if (this->sleepers.load() > 0) {
+         std::lock_guard<std::mutex> guard(this->sleepLock);
+         this->sleepCond.notify_one();
+      }
+   }
+
+   bool takeLocalTask(unsigned index, RTTask& task) {
+      Worker& worker = *this->workers[index];
+      size_t remaining;
+      {
+         std::lock_guard<std::mutex> guard(worker.lock);
+         while (worker.submissions.pop(task)) {
+            worker.tasks.push_back(std::move(task));
+         }
+         if (worker.tasks.empty()) return false;
+         task = std::move(worker.tasks.back());
+         worker.tasks.pop_back();
+         remaining = worker.tasks.size();
+      }
+      this->queued.fetch_sub(1);
+      if (remaining) {
+         this->wakeSleeper();
+      }
+      return true;
+   }
+
+   bool stealTask(unsigned thief, RTTask& task) {
+      unsigned count = this->workers.size();
+      unsigned start = thief < count ? thief + 1 : 0;
+      for (unsigned i = 0; i < count; i++) {
+         unsigned index = (start + i) % count;
+         if (index == thief) continue;
+         Worker& victim = *this->workers[index];
+         if (!victim.lock.try_lock()) continue;
+         // The victim may be busy with a long task: its submissions are
+         // taken over as well, in order
+         while (victim.submissions.pop(task)) {
+            victim.tasks.push_back(std::move(task));
+         }
+         bool found = !victim.tasks.empty();
+         if (found) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+         }
+         victim.lock.unlock();
+         if (found) {
+            this->queued.fetch_sub(1);
+            return true;
+         }
+      }
+      return false;
+   }
+};
+
+/// Counter of the tasks spawned for one job, waited on by helping the pool.
+class RTTaskGroup {
+private:
+   RTThreadPool& pool;
+   std::atomic<size_t> pending{ 0 };
+
+public:
+   RTTaskGroup(RTThreadPool& pool) : pool(pool) {
+   }
+   ~RTTaskGroup() {
+      this->wait();
+   }
+
+   void spawn(RTTask task) {
+      this->pending.fetch_add(1, std::memory_order_relaxed);
+      this->pool.submit([this, task = std::move(task)]() mutable {
+         task();
+         this->pending.fetch_sub(1, std::memory_order_release);
+      });
+   }
+
+   void wait() {
+      while (this->pending.load(std::memory_order_acquire)) {
+         if (!this->pool.runPendingTask()) {
+            std::this_thread::yield();
+         }
+      }
+   }
+};
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <windows.h>
+
+/// The events traced by the engine.
+enum class RTTraceEvent : uint16_t {
+   CompileStart,  // value: 0
+   CompileEnd,    // value: object bytes
+   CacheHit,      // value: object bytes
+   CacheMiss,     // value: 0
+   Link,          // value: object bytes
+   Finalize,      // value: object bytes
+   Lookup,        // value: 0
+   Resolve,       // value: address
+   ModuleRemoved, // value: 0
+};
+
+inline const char* getTraceEventName(RTTraceEvent kind) {
+   switch (kind) {
+   case RTTraceEvent::CompileStart: return "compile-start";
+   case RTTraceEvent::CompileEnd: return "compile-end";
+   case RTTraceEvent::CacheHit: return "cache-hit";
+   case RTTraceEvent::CacheMiss: return "cache-miss";
+   case RTTraceEvent::Link: return "link";
+   case RTTraceEvent::Finalize: return "finalize";
+   case RTTraceEvent::Lookup: return "lookup";
+   case RTTraceEvent::Resolve: return "resolve";
+   case RTTraceEvent::ModuleRemoved: return "module-removed";
+   }
+   return "unknown";
+}
+
+/// A traced event, of fixed size so that it is written in place. Its name, a
+/// module or a symbol, is truncated to fit.
+struct RTTraceRecord {
+   uint64_t timestamp; // nanoseconds, steady clock
+   uint64_t value;
+   uint32_t threadId;
+   RTTraceEvent kind;
+   uint16_t nameLength;
+   char name[40];
+};
+static_assert(sizeof(RTTraceRecord) == 64, "trace records fill a cache line");
+
+/// The events of one thread, its only writer. head counts the events written:
+/// a record is published by the release of head once written, and is
+/// overwritten 'Capacity' events later.
+struct alignas(64) RTTraceRing {
+   static constexpr uint32_t Capacity = 1024;
+   std::atomic<uint64_t> head;
+   std::atomic<uint32_t> owner; // thread id, 0 if free
+   alignas(64) RTTraceRecord records[Capacity];
+};
+
+/// The shared memory segment holding the rings, named after the process id.
+struct RTTraceSegment {
+   static constexpr uint32_t Magic = 0x52545452; // 'RTTR'
+   static constexpr uint32_t Version = 1;
+   static constexpr uint32_t RingCount = 64;
+   uint32_t magic;
+   uint32_t version;
+   uint32_t ringCount;
+   uint32_t ringCapacity;
+   std::atomic<uint64_t> dropped; // events of threads which found no free ring
+   RTTraceRing rings[RingCount];
+
+   static std::string getName(DWORD processId) {
+      return "Local\\RTTrace-" + std::to_string(processId);
+   }
+};
+
+/// Writes the events of the process in a shared memory segment, without lock
+/// nor system call: each thread claims a ring of its own on its first event,
+/// and releases it when it ends. Tracing is disabled, and costs a load per
+/// event, until the segment is opened.
+class RTTraceWriter {
+private:
+   std::atomic<RTTraceSegment*> segment;
+   HANDLE mapping = NULL;
+
+   struct ThreadRing {
+      RTTraceRing* ring = nullptr;
+      ~ThreadRing() {
+         if (this->ring) {
+            this->ring->owner.store(0, std::memory_order_release);
+         }
+      }
+   };
+
+   RTTraceWriter()
+      : segment(nullptr) {
+   }
+
+public:
+   static RTTraceWriter& get() {
+      static RTTraceWriter writer;
+      return writer;
+   }
+
+   /// Create the segment of the process and start tracing. Returns false if
+   /// the segment cannot be created.
+   bool open() {
+      if (this->segment) return true;
+      std::string name = RTTraceSegment::getName(GetCurrentProcessId());
+      this->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+         sizeof(RTTraceSegment), name.c_str());
+      if (!this->mapping) return false;
+      auto view = (RTTraceSegment*)MapViewOfFile(this->mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(RTTraceSegment));
+      if (!view) {
+         CloseHandle(this->mapping);
+         this->mapping = NULL;
+         return false;
+      }
+      // The pages are zeroed: only the header is written, the rings being
+      // touched as threads trace
+      view->ringCount = RTTraceSegment::RingCount;
+      view->ringCapacity = RTTraceRing::Capacity;
+      view->version = RTTraceSegment::Version;
+      std::atomic_thread_fence(std::memory_order_release);
+      view->magic = RTTraceSegment::Magic;
+      this->segment.store(view, std::memory_order_release);
+      return true;
+   }
+
+   bool isEnabled() const {
+      return this->segment.load(std::memory_order_relaxed) != nullptr;
+   }
+
+   void trace(RTTraceEvent kind, llvm::StringRef name, uint64_t value = 0) {
+      RTTraceSegment* segment = this->segment.load(std::memory_order_acquire);
+      if (!segment) return;
+      RTTraceRing* ring = this->getThreadRing(segment);
+      if (!ring) {
+         segment->dropped.fetch_add(1, std::memory_order_relaxed);
+         return;
+      }
+
+      uint64_t index = ring->head.load(std::memory_order_relaxed);
+      RTTraceRecord& record = ring->records[index % RTTraceRing::Capacity];
+      record.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+         std::chrono::steady_clock::now().time_since_epoch()).count();
+      record.value = value;
+      record.threadId = GetCurrentThreadId();
+      record.kind = kind;
+      record.nameLength = (uint16_t)std::min(name.size(), sizeof(record.name));
+      memcpy(record.name, name.data(), record.nameLength);
+      ring->head.store(index + 1, std::memory_order_release);
+   }
+
+private:
+   RTTraceRing* getThreadRing(RTTraceSegment* segment) {
+      static thread_local ThreadRing threadRing;
+      if (threadRing.ring) {
+         return threadRing.ring;
+      }
+      uint32_t threadId = GetCurrentThreadId();
+      for (RTTraceRing& ring : segment->rings) {
+         uint32_t owner = 0;
+         if (ring.owner.load(std::memory_order_relaxed) == 0 &&
+            ring.owner.compare_exchange_strong(owner, threadId, std::memory_order_acquire)) {
+            threadRing.ring = &ring;
+            return &ring;
+         }
+      }
+      return nullptr;
+   }
+};
+
+inline void traceEvent(RTTraceEvent kind, llvm::StringRef name, uint64_t value = 0) {
+   RTTraceWriter::get().trace(kind, name, value);
+}
+
+/// Tails the events of another process from its segment, without stopping
+/// it: rings are copied, and the records overwritten while being copied are
+/// counted as lost.
+class RTTraceReader {
+private:
+   HANDLE mapping = NULL;
+   const RTTraceSegment* segment = nullptr;
+   std::vector<uint64_t> positions;
+   uint64_t lost = 0;
+
+public:
+   ~RTTraceReader() {
+      if (this->segment) {
+         UnmapViewOfFile(this->segment);
+      }
+      if (this->mapping) {
+         CloseHandle(this->mapping);
+      }
+   }
+
+   /// Open the segment of a process. Returns false if it does not trace, or
+   /// traces with another layout.
+   bool open(DWORD processId) {
+      std::string name = RTTraceSegment::getName(processId);
+      this->mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name.c_str());
+      if (!this->mapping) return false;
+      this->segment = (const RTTraceSegment*)MapViewOfFile(this->mapping, FILE_MAP_READ, 0, 0, sizeof(RTTraceSegment));
+      if (!this->segment || this->segment->magic != RTTraceSegment::Magic ||
+         this->segment->version != RTTraceSegment::Version ||
+         this->segment->ringCount != RTTraceSegment::RingCount ||
+         this->segment->ringCapacity != RTTraceRing::Capacity) {
+         return false;
+      }
+      // Start from the oldest records still in the rings
+      for (const RTTraceRing& ring : this->segment->rings) {
+         uint64_t head = ring.head.load(std::memory_order_acquire);
+         this->positions.push_back(head > RTTraceRing::Capacity ? head - RTTraceRing::Capacity : 0);
+      }
+      return true;
+   }
+
+   /// Call OnEvent for the events written since the last poll, in time order.
+   /// Returns the number of events read.
+   size_t poll(llvm::function_ref<void(const RTTraceRecord&)> OnEvent) {
+      std::vector<RTTraceRecord> events;
+      for (uint32_t i = 0; i < RTTraceSegment::RingCount; i++) {
+         const RTTraceRing& ring = this->segment->rings[i];
+         uint64_t& position = this->positions[i];
+         uint64_t head = ring.head.load(std::memory_order_acquire);
+         if (head - position > RTTraceRing::Capacity) {
+            this->lost += head - RTTraceRing::Capacity - position;
+            position = head - RTTraceRing::Capacity;
+         }
+         size_t first = events.size();
+         for (uint64_t index = position; index < head; index++) {
+            events.push_back(ring.records[index % RTTraceRing::Capacity]);
+         }
+
+         // The writer overwrites the record 'Capacity' events behind the one
+         // it writes: the records copied from there on are not reliable
+         std::atomic_thread_fence(std::memory_order_acquire);
+         uint64_t after = ring.head.load(std::memory_order_relaxed);
+         if (after + 1 > position + RTTraceRing::Capacity) {
+            uint64_t overwritten = std::min(after + 1 - RTTraceRing::Capacity, head) - position;
+            events.erase(events.begin() + first, events.begin() + first + overwritten);
+            this->lost += overwritten;
+         }
+         position = head;
+      }
+      std::stable_sort(events.begin(), events.end(), [](const RTTraceRecord& a, const RTTraceRecord& b) {
+         return a.timestamp < b.timestamp;
+         });
+      for (const RTTraceRecord& event : events) {
+         OnEvent(event);
+      }
+      return events.size();
+   }
+
+   /// The events lost: overwritten before being read, or not written for lack
+   /// of a free ring.
+   uint64_t getLost() const {
+      return this->lost + this->segment->dropped.load(std::memory_order_relaxed);
+   }
+};
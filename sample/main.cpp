@@ -1,12 +1,32 @@
 
 #include "./headers.h"
+#include "./RTModuleSummary.h"
+#include "./RTModulePartitioner.h"
+#include "./RTThreadPool.h"
+#include "./RTSpeculator.h"
+#include "./RTStartupManifest.h"
+#include "./RTDebugInfo.h"
+#include "./RTSectionPolicy.h"
+#include "./RTDebugRegistration.h"
+#include "./RTTrace.h"
+#include "./RTSnapshot.h"
+#include "./RTTenant.h"
+#include "./RTEpoch.h"
+#include "./RTCompileServer.h"
+#include "./RTJITLink.h"
+#include <llvm/ExecutionEngine/Orc/IndirectionUtils.h>
 #include <llvm/Support/SmallVectorMemoryBuffer.h>
 #include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Transforms/IPO.h>
 #include <iostream>
+#include <future>
+#include <set>
+#include <thread>
 
 #include <windows.h>
 #include <Psapi.h>
 #include <dbghelp.h>
+#include <intrin.h>
 
 #pragma comment(lib, "psapi.lib")
 #pragma comment(lib, "Dbghelp.lib")
@@ -17,25 +37,45 @@ using namespace llvm::orc;
 ExitOnError ExitOnErr;
 
 ThreadSafeModule createDemoModule(LLJIT* J);
-void printStack();
+ThreadSafeModule createBenchModule(unsigned index, unsigned functions);
+ThreadSafeModule createVersionModule(const char* name, int version);
+ThreadSafeModule createCallerModule(const char* name, ArrayRef<const char*> callees,
+   ArrayRef<const char*> locals = {});
 
-extern"C" void doSnapshot() {
+// The engines taking snapshots. doSnapshot() snapshots the calling thread
+// for the engine whose code called it, Ctrl+Break all threads for each
+// engine, and both return at once. Engines may be built on other threads,
+// ahead of being used
+class RTExecutionEngine;
+static std::mutex SnapshotEnginesLock;
+static std::vector<RTExecutionEngine*> SnapshotEngines;
 
-   printf("\n------ snapshot ------\n");
-   printStack();
-   while (1);
-}
+extern"C" void doSnapshot();
+static BOOL WINAPI onConsoleControl(DWORD event);
 
 class RTModuleCompiler : public IRCompileLayer::IRCompiler {
 private:
-   TargetMachine& TM;
+   JITTargetMachineBuilder JTMB;
+   std::mutex TMLock;
+   std::vector<std::unique_ptr<TargetMachine>> IdleTMs;
    std::string cacheDir;
+   RTLeanDebugInfo* leanDebugInfo;
+   RTCompileClient* compileClient;
+   static constexpr const char* ObjectBufferSuffix = "-jitted-objectbuffer";
 public:
    using CompileResult = std::unique_ptr<MemoryBuffer>;
 
    /// Construct a simple compile functor with the given target.
-   RTModuleCompiler(TargetMachine& TM, const char* cacheDir)
-      : IRCompiler(orc::irManglingOptionsFromTargetOptions(TM.Options)), TM(TM), cacheDir(cacheDir) {
+   /// Modules may be compiled from several threads at once: each compilation
+   /// borrows a target machine, and more are created from JTMB when needed.
+   /// With leanDebugInfo, modules are compiled without their debug info.
+   /// With compileClient, modules are compiled by the compile server, and in
+   /// process only when it cannot.
+   RTModuleCompiler(JITTargetMachineBuilder JTMB, std::unique_ptr<TargetMachine> TM, const char* cacheDir,
+      RTLeanDebugInfo* leanDebugInfo = nullptr, RTCompileClient* compileClient = nullptr)
+      : IRCompiler(orc::irManglingOptionsFromTargetOptions(TM->Options)), JTMB(std::move(JTMB)), cacheDir(cacheDir),
+      leanDebugInfo(leanDebugInfo), compileClient(compileClient) {
+      this->IdleTMs.push_back(std::move(TM));
    }
 
    ~RTModuleCompiler() override {
@@ -44,12 +84,106 @@ public:
 
    /// Compile a Module to an ObjectFile.
    Expected<CompileResult> operator()(Module& M) override {
+      return this->withTargetMachine([&](TargetMachine& TM) {
+         return this->compile(M, TM);
+         });
+   }
+
+   /// Compile a Module to an ObjectFile with its debug info, whatever the mode
+   /// and bypassing the cache: this is how the DWARF of lean code is rebuilt.
+   Expected<CompileResult> compileWithDebugInfo(Module& M) {
+      return this->withTargetMachine([&](TargetMachine& TM) {
+         return this->emitObject(M, TM);
+         });
+   }
+
+   /// Run a compilation with a target machine borrowed for its duration.
+   Expected<CompileResult> withTargetMachine(function_ref<Expected<CompileResult>(TargetMachine&)> compileWith) {
+      std::unique_ptr<TargetMachine> TM;
+      {
+         std::lock_guard<std::mutex> guard(this->TMLock);
+         if (!this->IdleTMs.empty()) {
+            TM = std::move(this->IdleTMs.back());
+            this->IdleTMs.pop_back();
+         }
+      }
+      if (!TM) {
+         auto NewTM = this->JTMB.createTargetMachine();
+         if (!NewTM) {
+            return NewTM.takeError();
+         }
+         TM = std::move(*NewTM);
+      }
+
+      auto Result = compileWith(*TM);
 
-      CompileResult CachedObject = this->readPrecompiledObject(&M);
+      std::lock_guard<std::mutex> guard(this->TMLock);
+      this->IdleTMs.push_back(std::move(TM));
+      return Result;
+   }
+
+   /// Compile a Module to an ObjectFile with the given target machine, so that
+   /// several modules can be compiled at once, each with its own target.
+   Expected<CompileResult> compile(Module& M, TargetMachine& TM) {
+      traceEvent(RTTraceEvent::CompileStart, M.getModuleIdentifier());
+
+      if (this->leanDebugInfo) {
+         this->leanDebugInfo->stripModule(M, getObjectBufferName(M));
+      }
+
+      std::string hash = getModuleHash(M, TM);
+      CompileResult CachedObject = this->readPrecompiledObject(&M, hash);
       if (CachedObject) {
+         traceEvent(RTTraceEvent::CompileEnd, M.getModuleIdentifier(), CachedObject->getBufferSize());
          return std::move(CachedObject);
       }
 
+      auto Result = this->emitObjectRemotely(M, TM);
+      if (Result) {
+         traceEvent(RTTraceEvent::CompileEnd, M.getModuleIdentifier(), (*Result)->getBufferSize());
+         this->writePrecompiledObject(&M, (*Result)->getMemBufferRef(), hash);
+      }
+      return Result;
+   }
+
+   /// The hash of what an object is compiled from: the module as compiled,
+   /// and the code generation settings.
+   static std::string getModuleHash(const Module& M, const TargetMachine& TM) {
+      SmallVector<char, 0> BitcodeSV;
+      raw_svector_ostream BitcodeStream(BitcodeSV);
+      WriteBitcodeToFile(M, BitcodeStream);
+      SHA1 Hasher;
+      Hasher.update(getCompileTarget(TM));
+      Hasher.update(arrayRefFromStringRef(StringRef(BitcodeSV.data(), BitcodeSV.size())));
+      return toHex(Hasher.final());
+   }
+
+   static std::string getObjectBufferName(const Module& M) {
+      return M.getModuleIdentifier() + ObjectBufferSuffix;
+   }
+
+   /// The identifier of the module an object buffer was compiled from.
+   static StringRef getModuleIdentifier(StringRef objectName) {
+      objectName.consume_back(ObjectBufferSuffix);
+      return objectName;
+   }
+
+   /// Emit the object on the compile server if any, in process otherwise or
+   /// if it fails.
+   Expected<CompileResult> emitObjectRemotely(Module& M, TargetMachine& TM) {
+      if (this->compileClient) {
+         auto Object = this->compileClient->compile(M, getObjectBufferName(M));
+         if (!Object) {
+            logAllUnhandledErrors(Object.takeError(), dbgs(), "Compile server failed on " + M.getModuleIdentifier() + ": ");
+         }
+         else if (*Object) {
+            return std::move(*Object);
+         }
+      }
+      return this->emitObject(M, TM);
+   }
+
+   Expected<CompileResult> emitObject(Module& M, TargetMachine& TM) {
       SmallVector<char, 0> ObjBufferSV;
       {
          raw_svector_ostream ObjStream(ObjBufferSV);
@@ -64,47 +198,72 @@ public:
       }
 
       auto ObjBuffer = std::make_unique<SmallVectorMemoryBuffer>(
-         std::move(ObjBufferSV), M.getModuleIdentifier() + "-jitted-objectbuffer");
+         std::move(ObjBufferSV), getObjectBufferName(M));
 
       auto Obj = object::ObjectFile::createObjectFile(ObjBuffer->getMemBufferRef());
       if (!Obj) {
          return Obj.takeError();
       }
-
-      this->writePrecompiledObject(&M, *ObjBuffer);
-      return std::move(ObjBuffer);
+      return CompileResult(std::move(ObjBuffer));
    }
 
-   void writePrecompiledObject(const Module* M, MemoryBufferRef Obj) {
-      auto filename = this->getModuleFilename(M);
-      while (sys::fs::exists(filename)) {
-         sys::fs::remove(filename);
-      }
-      std::error_code Err;
-      raw_fd_ostream OStream(filename, Err);
+   /// Cache the object of M, with the hash of what it was compiled from
+   /// beside it.
+   void writePrecompiledObject(const Module* M, MemoryBufferRef Obj, StringRef hash) {
+      auto filename = this->getModuleFilename(M->getModuleIdentifier());
+
+      // The previous object may be mapped, by this engine or another one:
+      // it cannot be removed nor written then, but it can be renamed over
+      int FD;
+      SmallString<128> tempPath;
+      std::error_code Err = sys::fs::createUniqueFile(filename + ".%%%%%%.tmp", FD, tempPath);
       if (!Err) {
+         raw_fd_ostream OStream(FD, /*shouldClose=*/true);
          OStream.write(Obj.getBufferStart(), Obj.getBufferSize());
+         OStream.close();
+         if (OStream.has_error()) {
+            Err = OStream.error();
+            OStream.clear_error();
+         }
       }
-      else {
+      if (!Err) {
+         // No reader may match the previous hash with the new object
+         sys::fs::remove(filename + ".hash");
+         Err = sys::fs::rename(tempPath, filename);
+      }
+      if (Err && !tempPath.empty()) {
+         sys::fs::remove(tempPath);
+      }
+      if (!Err) {
+         raw_fd_ostream HashStream(filename + ".hash", Err);
+         if (!Err) {
+            HashStream << hash;
+         }
+      }
+      if (Err) {
          dbgs() << "Cannot write object for " << filename << " in cache.\n";
       }
    }
-   std::unique_ptr<MemoryBuffer> readPrecompiledObject(const Module* M) {
-      auto filename = this->getModuleFilename(M);
-      auto _Result = MemoryBuffer::getFile(filename);
-      if (_Result) {
-         auto bin = _Result->get();
-         if (0 && !_Result.getError()) {
-            dbgs() << "Object for " << filename << " loaded from cache.\n";
-            return std::move(*_Result);
+   /// The cached object of M, if it was compiled from what hashes to hash.
+   std::unique_ptr<MemoryBuffer> readPrecompiledObject(const Module* M, StringRef hash) {
+      auto filename = this->getModuleFilename(M->getModuleIdentifier());
+      auto CachedHash = MemoryBuffer::getFile(filename + ".hash");
+      if (CachedHash && (*CachedHash)->getBuffer() == hash) {
+         auto _Result = MemoryBuffer::getFile(filename);
+         if (_Result) {
+            // Named like a compiled object, which names its module when linked
+            auto bin = MemoryBuffer::getMemBufferCopy((*_Result)->getBuffer(), getObjectBufferName(*M));
+            traceEvent(RTTraceEvent::CacheHit, M->getModuleIdentifier(), bin->getBufferSize());
+            return bin;
          }
       }
-      dbgs() << "No object for " << filename << " in cache. Compiling.\n";
+      traceEvent(RTTraceEvent::CacheMiss, M->getModuleIdentifier());
       return nullptr;
    }
-   std::string getModuleFilename(const Module* M) {
+   /// The cache file of a module, named by getCacheName.
+   std::string getModuleFilename(StringRef identifier) {
       std::string filename;
-      raw_string_ostream(filename) << this->cacheDir << "/" << M->getModuleIdentifier() << ".obj";
+      raw_string_ostream(filename) << this->cacheDir << "/" << getCacheName(identifier) << ".obj";
       return filename;
    }
 };
@@ -176,17 +335,141 @@ public:
    }
 };
 
+struct RTEngineOptions {
+   const char* cacheDir = "d:/dump";
+
+   // Cross-module inlining: small exported functions of added modules are
+   // imported as 'available_externally' into the modules added after them
+   bool crossModuleInlining = true;
+   unsigned summaryMaxInstructions = 32;
+   unsigned inlineThreshold = 225;
+
+   // Parallel codegen: modules with at least 2 x 'partitionMinFunctions'
+   // definitions are split in up to 'compileThreads' partitions compiled at once
+   unsigned partitionMinFunctions = 1000;
+   unsigned compileThreads = std::thread::hardware_concurrency();
+
+   // Speculation: on lookup, compile the functions of other modules reachable
+   // within 'speculationDepth' calls on the idle compile threads
+   bool speculation = true;
+   unsigned speculationDepth = 2;
+
+   // Startup manifest: the symbols demanded during the first
+   // 'startupRecordSeconds' are written to 'startupManifest', and 'warmup'
+   // compiles them at the next start
+   const char* startupManifest = nullptr;
+   double startupRecordSeconds = 30;
+
+   // Lean mode: modules are compiled without debug info and value names, with
+   // a line table per function only; their DWARF is regenerated from bitcode
+   // saved in 'cacheDir' once a snapshot needs it
+   bool leanDebugInfo = false;
+
+   // Sections loaded in JIT memory: by default the allocatable ones only, the
+   // others being read from the object cache when needed
+   RTSectionPolicy sectionPolicy = RTSectionPolicy::MapFromCache;
+
+   // Debugger registration: the DWARF of the modules in 'debugModules' (all
+   // if empty) is registered through the GDB JIT interface, from the first
+   // flush once 'registerDebugInfo' is set or a debugger is attached. Only
+   // ELF and MachO objects have debug objects: COFF ones report an error
+   bool registerDebugInfo = false;
+   std::vector<std::string> debugModules;
+
+   // Tracing: compile, cache, link, lookup and removal events are written to
+   // per-thread rings in a shared memory segment, tailed with '--tail-trace'
+   bool trace = false;
+
+   // Snapshots: doSnapshot() from JIT code, or Ctrl+Break for all threads,
+   // capture stacks without stopping them; they are symbolized in the
+   // background to 'snapshotFile', rotated every 'snapshotFileBytes' over
+   // 'snapshotFiles' files
+   const char* snapshotFile = nullptr;
+   uint64_t snapshotFileBytes = 1 << 20;
+   unsigned snapshotFiles = 4;
+
+   // Compile server, off by default: modules are sent to the server listening
+   // on the pipe 'compileServer', started with '--compile-server', and compiled in process
+   // while it is not available or when it fails, or answers later than
+   // 'compileServerTimeout' milliseconds
+   const char* compileServer = nullptr;
+   unsigned compileServerTimeout = 60000;
+
+   // Object linker: RuntimeDyld links COFF objects, with their function
+   // tables, debug registration and section policy. JITLink links ELF objects
+   // of the small code model in a slab of 'jitLinkSlabSize' bytes, registers
+   // their EH frames, and writes their functions to the perf map of the
+   // process in 'perfMapDir'. It is refused where the runtime cannot register
+   // EH frames, as with MSVC, since its code could not unwind
+   RTObjectLinker objectLinker = RTObjectLinker::RuntimeDyld;
+   uint64_t jitLinkSlabSize = 256 << 20;
+   const char* perfMapDir = nullptr;
+};
+
 class RTExecutionEngine {
 public:
    std::unique_ptr<LLJIT> JIT;
    RTModuleCompiler* Compiler = 0;
+   RTSlabMemoryManager* SlabMemory = 0;
+   RTEngineOptions Options;
+   RTThreadPool Pool;
+   std::unique_ptr<RTSpeculator> Speculator;
+   std::unique_ptr<RTStartupRecorder> Recorder;
+   std::unique_ptr<RTLeanDebugInfo> LeanDebugInfo;
+   std::unique_ptr<RTCompileClient> CompileClient;
+   RTDebugRegistrar DebugRegistrar;
+   RTSectionAccounting Sections;
+   RTFunctionTable Functions;
+   std::unique_ptr<RTSnapshotService> Snapshots;
+
+   // The runtime dylib holds the symbols of the engine, shared by all tenants
+   // which cannot add to it. The main dylib is the one of the default tenant,
+   // used when no tenant is given.
+   JITDylib* Runtime = nullptr;
+   std::unique_ptr<RTTenant> MainTenant;
+
+   // Stable entry stubs of the functions which can be redefined
+   std::unique_ptr<IndirectStubsManager> Stubs;
+
+   /// An engine built stopped, to be handed out later, starts no compile
+   /// thread and takes no snapshot until start() is called.
+   RTExecutionEngine(const RTEngineOptions& Options = RTEngineOptions(), bool started = true)
+      : Options(Options), Pool(Options.compileThreads, started) {
+      if (this->Options.leanDebugInfo) {
+         this->LeanDebugInfo = std::make_unique<RTLeanDebugInfo>(this->Options.cacheDir);
+      }
+      for (auto& name : this->Options.debugModules) {
+         this->DebugRegistrar.select(name);
+      }
+      if (this->Options.trace && !RTTraceWriter::get().open()) {
+         dbgs() << "Cannot open trace segment: " << GetLastError() << ".\n";
+      }
 
-   RTExecutionEngine() {
       LLJITBuilder JBuilder;
-      auto JTMB = ExitOnErr(JITTargetMachineBuilder::detectHost());
+      JITTargetMachineBuilder JTMB = getHostTarget();
       // JTMB.getTargetTriple().setObjectFormat(Triple::ObjectFormatType::ELF);
       // JTMB.getOptions().ExceptionModel = ExceptionHandling::WinEH;
       // JTMB.getOptions().WinEHEncodingType = ExceptionHandling::WinEH;
+      if (this->Options.objectLinker == RTObjectLinker::JITLink) {
+         // Everything is linked in one slab: 32-bit relative references
+         // reach, the ones out of the slab going through the GOT
+         JTMB.getTargetTriple().setObjectFormat(Triple::ELF);
+         JTMB.setCodeModel(CodeModel::Small);
+         JTMB.setRelocationModel(Reloc::PIC_);
+      }
+
+      // Debug objects are built by RuntimeDyld, for ELF and MachO objects only
+      if (this->Options.objectLinker == RTObjectLinker::JITLink) {
+         this->DebugRegistrar.setUnsupported("the objects linked by JITLink are not registered");
+      }
+      else if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
+         this->DebugRegistrar.setUnsupported("COFF objects have no debug object");
+      }
+      if (this->Options.registerDebugInfo) {
+         if (auto Err = this->DebugRegistrar.enable()) {
+            logAllUnhandledErrors(std::move(Err), errs(), "Cannot register debug info: ");
+         }
+      }
 
       // Create a LLJIT builder & instance
       JBuilder.setJITTargetMachineBuilder(JTMB);
@@ -198,13 +481,38 @@ public:
          });
       this->JIT = ExitOnErr(JBuilder.create());
 
+      // Handle 'before compile': run the inliner over imported summaries
+      if (this->Options.crossModuleInlining) {
+         this->JIT->getIRTransformLayer().setTransform(
+            [this](ThreadSafeModule TSM, MaterializationResponsibility& R) {
+               return this->optimizeModule(std::move(TSM), R);
+            });
+      }
+
+      if (this->Options.speculation) {
+         this->Speculator = std::make_unique<RTSpeculator>(
+            [this](StringRef name) { return this->JIT->mangle(name); },
+            this->Options.speculationDepth);
+      }
+
+      if (this->Options.startupManifest) {
+         this->Recorder = std::make_unique<RTStartupRecorder>(this->Options.startupRecordSeconds);
+      }
+
       auto triple = JIT->getTargetTriple();
 
       auto& ES = this->JIT->getExecutionSession();
       auto& DL = this->JIT->getMainJITDylib();
+      this->Runtime = &ES.createBareJITDylib("runtime");
+      DL.addToLinkOrder(*this->Runtime);
+      this->MainTenant = std::make_unique<RTTenant>(DL, this->Options.summaryMaxInstructions);
+
+      if (auto StubsBuilder = createLocalIndirectStubsManagerBuilder(triple)) {
+         this->Stubs = StubsBuilder();
+      }
 
       // Declare public symbols from engine
-      ExitOnErr(DL.define(orc::absoluteSymbols(
+      ExitOnErr(this->Runtime->define(orc::absoluteSymbols(
          {
             {
                this->JIT->mangleAndIntern("doSnapshot"),
@@ -213,33 +521,762 @@ public:
          }
       )));
 
+      // Handle 'snapshot': capture now, symbolize in the background
+      if (this->Options.snapshotFile) {
+         SymRefreshModuleList(GetCurrentProcess());
+         this->Snapshots = std::make_unique<RTSnapshotService>(
+            [this](uint64_t address, raw_ostream& OS) { this->symbolize(address, OS); },
+            this->Options.snapshotFile, this->Options.snapshotFileBytes, this->Options.snapshotFiles);
+      }
+
       // Handle 'Error': manage error logging
       // TODO: ES.setErrorReporter([](Error err) {      printf("error\n");      });
 
+      if (started) {
+         this->start();
+      }
    }
-   void addModule(ThreadSafeModule M) {
-      this->JIT->addIRModule(std::move(M));
-      // ExitOnErr(this->J->getIRCompileLayer().add(*this->JD, std::move(M)));
+
+   /// Start serving work: the compile pool runs, and snapshots reach the
+   /// engine. Calling it again does nothing.
+   void start() {
+      this->Pool.start();
+      if (this->Snapshots) {
+         std::lock_guard<std::mutex> guard(SnapshotEnginesLock);
+         if (llvm::is_contained(SnapshotEngines, this)) return;
+         if (SnapshotEngines.empty()) {
+            SetConsoleCtrlHandler(onConsoleControl, TRUE);
+         }
+         SnapshotEngines.push_back(this);
+      }
+   }
+   /// The host target, detected once for all the engines of the process:
+   /// detection queries the CPU name and features of the host.
+   static const JITTargetMachineBuilder& getHostTarget() {
+      static const JITTargetMachineBuilder HostJTMB = []() {
+         InitializeNativeTarget();
+         InitializeNativeTargetAsmPrinter();
+         return ExitOnErr(JITTargetMachineBuilder::detectHost());
+      }();
+      return HostJTMB;
    }
-   JITTargetAddress getSymbolAddress(const char* name) {
+
+   ~RTExecutionEngine() {
+      // Pool tasks use the members declared after the pool: finish them first
+      this->Pool.join();
+
+      if (this->Snapshots) {
+         std::lock_guard<std::mutex> guard(SnapshotEnginesLock);
+         // Engines never started were not registered
+         auto it = llvm::find(SnapshotEngines, this);
+         if (it != SnapshotEngines.end()) {
+            SnapshotEngines.erase(it);
+            if (SnapshotEngines.empty()) {
+               SetConsoleCtrlHandler(onConsoleControl, FALSE);
+            }
+         }
+      }
+      this->Snapshots.reset();
+
+      // Free the versions replaced once the threads running them are out: the
+      // manager outlives the engine and must not keep entries pointing to it
+      RTEpochManager::get().drain(this->MainTenant.get());
+      for (auto& tenant : this->Tenants) {
+         RTEpochManager::get().drain(tenant.second.get());
+      }
+
+      // Short runs end before the recording window: keep what was recorded
+      if (this->Recorder && this->Recorder->isRecording()) {
+         this->Recorder->stop();
+         if (auto Err = this->writeStartupManifest()) {
+            logAllUnhandledErrors(std::move(Err), errs(), "Cannot write startup manifest: ");
+         }
+      }
+   }
+   /// Create a tenant, whose modules live in a JITDylib of their own which
+   /// links against the runtime dylib only.
+   Expected<RTTenant*> createTenant(StringRef name) {
       auto& ES = this->JIT->getExecutionSession();
-      auto& DL = this->JIT->getMainJITDylib();
-      auto sym = ExitOnErr(ES.lookup({ &DL }, name));
+      std::unique_lock<std::shared_mutex> guard(this->TenantsLock);
+      if (this->Tenants.count(name) || ES.getJITDylibByName(name)) {
+         return make_error<StringError>("Tenant " + name + " already exists", inconvertibleErrorCode());
+      }
+      auto JD = this->JIT->createJITDylib(name.str());
+      if (!JD) {
+         return JD.takeError();
+      }
+      JD->addToLinkOrder(*this->Runtime);
+      auto& tenant = this->Tenants[name];
+      tenant = std::make_unique<RTTenant>(*JD, this->Options.summaryMaxInstructions);
+      return tenant.get();
+   }
+
+   RTTenant* getTenant(StringRef name) {
+      std::shared_lock<std::shared_mutex> guard(this->TenantsLock);
+      auto it = this->Tenants.find(name);
+      return it != this->Tenants.end() ? it->second.get() : nullptr;
+   }
+
+   /// Unload a tenant with all its modules, which must no longer be in use.
+   /// Other tenants are not touched.
+   Error removeTenant(StringRef name) {
+      std::unique_ptr<RTTenant> tenant;
+      {
+         std::unique_lock<std::shared_mutex> guard(this->TenantsLock);
+         auto it = this->Tenants.find(name);
+         if (it == this->Tenants.end()) {
+            return make_error<StringError>("No tenant " + name + " to remove", inconvertibleErrorCode());
+         }
+         tenant = std::move(it->second);
+         this->Tenants.erase(it);
+      }
+      // The versions it replaced are freed with their trackers, before the dylib
+      RTEpochManager::get().drain(tenant.get());
+      {
+         std::string prefix = (name + "/").str();
+         std::lock_guard<std::mutex> guard(this->StubsLock);
+         for (auto it = this->StubVersions.begin(); it != this->StubVersions.end();) {
+            auto current = it++;
+            if (current->getKey().startswith(prefix)) {
+               this->StubVersions.erase(current);
+            }
+         }
+      }
+      auto identifiers = tenant->getModuleIdentifiers();
+      if (auto Err = this->JIT->getExecutionSession().removeJITDylib(tenant->JD)) {
+         return Err;
+      }
+      for (auto& identifier : identifiers) {
+         traceEvent(RTTraceEvent::ModuleRemoved, identifier);
+      }
+      this->releaseModules([&](StringRef module) {
+         return llvm::any_of(identifiers, [&](const std::string& identifier) {
+            return isPartitionOf(module, identifier);
+            });
+         });
+      if (this->Speculator) {
+         this->Speculator->removeScope(name);
+      }
+      return Error::success();
+   }
+
+   void addModule(ThreadSafeModule M, RTTenant* tenant = nullptr) {
+      ExitOnErr(this->tryAddModule(std::move(M), tenant));
+   }
+
+   Error tryAddModule(ThreadSafeModule M, RTTenant* tenant = nullptr) {
+      RTTenant& T = tenant ? *tenant : *this->MainTenant;
+      unsigned numFunctions = M.withModuleDo([](Module& M) { return getDefinedFunctionCount(M); });
+      auto RT = T.getResourceTracker(M.withModuleDo([this, &T](Module& M) {
+         M.setModuleIdentifier(this->getModuleName(T, M.getModuleIdentifier()));
+         return M.getModuleIdentifier();
+         }));
+      unsigned numPartitions = 1;
+      if (this->Options.partitionMinFunctions && this->Options.compileThreads > 1) {
+         numPartitions = std::min(this->Options.compileThreads, numFunctions / this->Options.partitionMinFunctions);
+      }
+
+      if (this->Speculator) {
+         M.withModuleDo([this, &T](Module& M) { this->Speculator->addModule(M, T.getName()); });
+      }
+      if (this->Options.crossModuleInlining) {
+         auto Err = M.withModuleDo([this, &T](Module& M) -> Error {
+            if (M.getDataLayout().isDefault()) {
+               M.setDataLayout(this->JIT->getDataLayout());
+            }
+            if (auto Err = T.Summaries.importInto(M)) {
+               return Err;
+            }
+            T.Summaries.addModule(M);
+            return Error::success();
+            });
+         if (Err) {
+            return Err;
+         }
+      }
+      if (numPartitions > 1) {
+         return this->addModulePartitioned(std::move(M), numPartitions, RT);
+      }
+      return this->JIT->addIRModule(RT, std::move(M));
+      // ExitOnErr(this->J->getIRCompileLayer().add(*this->JD, std::move(M)));
+   }
+
+   /// Add a large module to be split and compiled as partitions on the
+   /// compile pool, each in its own context and with its own target machine,
+   /// once one of its symbols is looked up. Returns without compiling.
+   Error addModulePartitioned(ThreadSafeModule TSM, unsigned numPartitions, ResourceTrackerSP RT) {
+      TSM.withModuleDo([this](Module& M) {
+         if (M.getDataLayout().isDefault()) {
+            M.setDataLayout(this->JIT->getDataLayout());
+         }
+         });
+      auto MU = std::make_unique<RTPartitionedMaterializationUnit>(this->JIT->getExecutionSession(),
+         this->Compiler->getManglingOptions(), std::move(TSM), numPartitions, this->JIT->getObjLinkingLayer(), this->Pool,
+         [this](MemoryBufferRef Bitcode) { return this->compilePartition(Bitcode); });
+      return RT->getJITDylib().define(std::move(MU), RT);
+   }
+
+   /// Remove a module added before, partitions included: its code, the copies
+   /// of its functions kept for inlining, and its debug objects are freed.
+   /// Its symbols must no longer be in use.
+   Error removeModule(StringRef name, RTTenant* tenant = nullptr) {
+      RTTenant& T = tenant ? *tenant : *this->MainTenant;
+      std::string moduleName = this->getModuleName(T, name);
+      ResourceTrackerSP RT = T.takeResourceTracker(moduleName);
+      if (!RT) {
+         return make_error<StringError>("No module " + name + " to remove", inconvertibleErrorCode());
+      }
+      if (auto Err = RT->remove()) {
+         return Err;
+      }
+      traceEvent(RTTraceEvent::ModuleRemoved, moduleName);
+
+      T.Summaries.removeModule(moduleName);
+      this->releaseModules([&](StringRef module) { return isPartitionOf(module, moduleName); });
+      return Error::success();
+   }
+
+   /// The name the engine knows a module of tenant T by: the modules of the
+   /// tenants other than the main one are qualified as "tenant/module", so
+   /// that the cache files and the tables of the engine, keyed by module, keep
+   /// apart the modules of the same name from different tenants.
+   std::string getModuleName(RTTenant& T, StringRef identifier) {
+      if (&T == this->MainTenant.get()) {
+         return identifier.str();
+      }
+      return (T.getName() + "/" + identifier).str();
+   }
+
+   /// Release what the engine keeps of removed modules, beside their code.
+   void releaseModules(function_ref<bool(StringRef)> isRemoved) {
+      this->DebugRegistrar.removeModules(isRemoved);
+      this->Sections.removeModules(isRemoved);
+      this->Functions.removeModules(isRemoved);
+      {
+         std::lock_guard<std::mutex> guard(this->NotifyLock);
+         for (auto it = this->FunctionTables.begin(); it != this->FunctionTables.end();) {
+            auto current = it++;
+            if (!isRemoved(current->getKey())) continue;
+            std::lock_guard<std::mutex> tablesGuard(getFunctionTableLock());
+            for (PRUNTIME_FUNCTION table : current->second) {
+               RtlDeleteFunctionTable(table);
+            }
+            this->FunctionTables.erase(current);
+         }
+      }
+   }
+
+   /// Enter JIT code which can be redefined: the versions replaced while the
+   /// guard is held are kept until it is released. Takes no lock.
+   RTEpochManager::Guard enterCode() {
+      return RTEpochManager::get().enter();
+   }
+
+   /// Redefine a function without stopping its callers, with the definition
+   /// of M. M is compiled on the compile pool, under a name of its own version
+   /// and with its other definitions made internal, then the stable stub that
+   /// callers resolve 'name' to is repointed at once. The first definition
+   /// creates the stub: 'name' must not be defined by a regular module. The
+   /// version replaced is freed once no thread entered through enterCode()
+   /// can still run it.
+   std::future<Error> redefine(StringRef name, ThreadSafeModule M, RTTenant* tenant = nullptr) {
+      auto Promise = std::make_shared<std::promise<Error>>();
+      auto Result = Promise->get_future();
+      this->Pool.submit([this, Promise, name = name.str(), M = std::move(M), tenant]() mutable {
+         Promise->set_value(this->tryRedefine(name, std::move(M), tenant));
+         });
+      return Result;
+   }
+
+   /// Whole-program mode: link a batch of modules into one before optimization,
+   /// so calls between them can be inlined like calls within a single module.
+   /// A module which cannot be moved or linked fails the batch, which is then
+   /// not added.
+   void addModuleBatch(std::vector<ThreadSafeModule> Batch, RTTenant* tenant = nullptr) {
+      ExitOnErr(this->tryAddModuleBatch(std::move(Batch), tenant));
+   }
+
+   Error tryAddModuleBatch(std::vector<ThreadSafeModule> Batch, RTTenant* tenant = nullptr) {
+      if (Batch.empty()) return Error::success();
+
+      auto Context = std::make_unique<LLVMContext>();
+      auto Linked = std::make_unique<Module>("batch", *Context);
+      Linked->setDataLayout(this->JIT->getDataLayout());
+
+      for (auto& TSM : Batch) {
+         // Modules own distinct contexts: move them across through bitcode
+         SmallVector<char, 0> BitcodeSV;
+         std::string Name;
+         TSM.withModuleDo([&](Module& M) {
+            raw_svector_ostream BitcodeStream(BitcodeSV);
+            WriteBitcodeToFile(M, BitcodeStream);
+            Name = M.getModuleIdentifier();
+            });
+         auto M = parseBitcodeFile(MemoryBufferRef(StringRef(BitcodeSV.data(), BitcodeSV.size()), Name), *Context);
+         if (!M) {
+            return M.takeError();
+         }
+         if (Linker::linkModules(*Linked, std::move(*M))) {
+            return make_error<StringError>("Cannot link module " + Name + " in batch", inconvertibleErrorCode());
+         }
+         Linked->setModuleIdentifier(Linked->getModuleIdentifier() + "+" + Name);
+      }
+
+      return this->tryAddModule(ThreadSafeModule(std::move(Linked), std::move(Context)), tenant);
+   }
+
+   JITTargetAddress getSymbolAddress(const char* name, RTTenant* tenant = nullptr) {
+      auto sym = ExitOnErr(this->lookup(name, tenant));
       return sym.getAddress();
    }
+
+   /// Look up a symbol in the dylib of a tenant only, whatever the number of
+   /// tenants.
+   Expected<JITEvaluatedSymbol> lookup(StringRef name, RTTenant* tenant = nullptr) {
+      auto& ES = this->JIT->getExecutionSession();
+      auto& JD = (tenant ? *tenant : *this->MainTenant).JD;
+      auto Name = this->JIT->mangleAndIntern(name);
+      traceEvent(RTTraceEvent::Lookup, name);
+      this->notifyDemanded(*Name, JD, true);
+      this->speculate(*Name, JD);
+      auto Sym = ES.lookup({ &JD }, Name);
+      if (Sym) {
+         traceEvent(RTTraceEvent::Resolve, name, Sym->getAddress());
+      }
+      this->flushDebugInfo();
+      return Sym;
+   }
+
+   /// Add a module from the compile pool, without blocking the calling thread.
+   /// Errors are reported through the returned future or the callback.
+   std::future<Error> addModuleAsync(ThreadSafeModule M, RTTenant* tenant = nullptr) {
+      auto Promise = std::make_shared<std::promise<Error>>();
+      auto Result = Promise->get_future();
+      this->addModuleAsync(std::move(M), [Promise](Error Err) {
+         Promise->set_value(std::move(Err));
+         }, tenant);
+      return Result;
+   }
+   void addModuleAsync(ThreadSafeModule M, unique_function<void(Error)> OnAdded, RTTenant* tenant = nullptr) {
+      uint64_t ticket;
+      {
+         std::lock_guard<std::mutex> guard(this->AsyncLock);
+         ticket = ++this->lastAdd;
+         this->addsInFlight.insert(ticket);
+      }
+      this->Pool.submit([this, ticket, M = std::move(M), OnAdded = std::move(OnAdded), tenant]() mutable {
+         OnAdded(this->tryAddModule(std::move(M), tenant));
+
+         // Release the lookups which waited for this add and the ones before
+         // it only: adds issued after a lookup never hold it back
+         std::vector<RTTask> Deferred;
+         {
+            std::lock_guard<std::mutex> guard(this->AsyncLock);
+            this->addsInFlight.erase(ticket);
+            uint64_t oldest = this->addsInFlight.empty() ? UINT64_MAX : *this->addsInFlight.begin();
+            while (!this->deferredLookups.empty() && this->deferredLookups.front().first < oldest) {
+               Deferred.push_back(std::move(this->deferredLookups.front().second));
+               this->deferredLookups.pop_front();
+            }
+         }
+         for (auto& task : Deferred) {
+            this->Pool.submit(std::move(task));
+         }
+         });
+   }
+
+   /// Look up a symbol from the compile pool. Completes once the symbol is
+   /// materialized, after the modules added asynchronously before the call.
+   std::future<Expected<JITEvaluatedSymbol>> lookupAsync(StringRef name, RTTenant* tenant = nullptr) {
+      auto Promise = std::make_shared<std::promise<Expected<JITEvaluatedSymbol>>>();
+      auto Result = Promise->get_future();
+      this->lookupAsync(name, [Promise](Expected<JITEvaluatedSymbol> Sym) {
+         Promise->set_value(std::move(Sym));
+         }, tenant);
+      return Result;
+   }
+   void lookupAsync(StringRef name, unique_function<void(Expected<JITEvaluatedSymbol>)> OnResolved, RTTenant* tenant = nullptr) {
+      auto Name = this->JIT->mangleAndIntern(name);
+      auto& JD = (tenant ? *tenant : *this->MainTenant).JD;
+      traceEvent(RTTraceEvent::Lookup, name);
+      RTTask task = [this, Name, &JD, OnResolved = std::move(OnResolved)]() mutable {
+         this->notifyDemanded(*Name, JD, true);
+         this->speculate(*Name, JD);
+         this->materializeAsync(Name, JD, std::move(OnResolved));
+      };
+      this->whenModulesAdded(std::move(task));
+   }
+
+   /// Compile eagerly and in parallel the symbols listed in the startup
+   /// manifest of a previous run. Blocks until they are all materialized.
+   Error warmup() {
+      if (!this->Options.startupManifest || !sys::fs::exists(this->Options.startupManifest)) {
+         return Error::success();
+      }
+      auto Names = RTStartupRecorder::readManifest(this->Options.startupManifest);
+      if (!Names) {
+         return Names.takeError();
+      }
+
+      // Shared with the callbacks, which may still run once Done is set
+      struct WarmupState {
+         std::atomic<size_t> pending;
+         std::atomic<unsigned> missing{ 0 };
+         std::promise<void> Done;
+      };
+      auto start = std::chrono::steady_clock::now();
+      auto State = std::make_shared<WarmupState>();
+      State->pending = Names->size();
+      auto DoneFuture = State->Done.get_future();
+      if (Names->empty()) {
+         State->Done.set_value();
+      }
+      for (auto& name : *Names) {
+         // The manifest can be stale: symbols no longer defined are skipped
+         auto task = [this, State, Name = this->JIT->getExecutionSession().intern(name)]() {
+            this->materializeAsync(Name, this->MainTenant->JD, [State](Expected<JITEvaluatedSymbol> Sym) {
+               if (!Sym) {
+                  consumeError(Sym.takeError());
+                  State->missing++;
+               }
+               if (--State->pending == 0) {
+                  State->Done.set_value();
+               }
+               });
+         };
+         this->whenModulesAdded(std::move(task));
+      }
+      DoneFuture.wait();
+
+      unsigned missing = State->missing;
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      dbgs() << "Warmup: " << (Names->size() - missing) << " symbols compiled in "
+         << format("%.3f", elapsed.count() * 1000) << " ms, " << missing << " missing.\n";
+      return Error::success();
+   }
+
+   /// Regenerate and register the DWARF of the lean code loaded so far, for
+   /// debuggers. Does nothing when not in lean mode.
+   Error loadDebugInfo() {
+      if (!this->LeanDebugInfo) {
+         return Error::success();
+      }
+      // Asked for explicitly: registration is enabled from now on
+      if (auto Err = this->DebugRegistrar.enable()) {
+         return Err;
+      }
+      auto Err = this->LeanDebugInfo->regenerate([this](Module& M) {
+         return this->Compiler->compileWithDebugInfo(M);
+         }, [this](StringRef objectName, object::OwningBinary<object::ObjectFile> Debug) {
+            return this->DebugRegistrar.addDebugObject(RTModuleCompiler::getModuleIdentifier(objectName), std::move(Debug));
+         });
+      return joinErrors(std::move(Err), this->DebugRegistrar.flush());
+   }
+
+   /// Register the debug objects loaded since the last flush, once
+   /// registration is enabled or a debugger is attached.
+   void flushDebugInfo() {
+      if (!this->DebugRegistrar.isEnabled() && this->DebugRegistrar.isSupported() && IsDebuggerPresent()) {
+         ExitOnErr(this->DebugRegistrar.enable());
+      }
+      if (auto Err = this->DebugRegistrar.flush()) {
+         logAllUnhandledErrors(std::move(Err), errs(), "Cannot register debug info: ");
+      }
+   }
+
+   /// Snapshot the stack of the calling thread, or of all threads, to the
+   /// snapshot file. Returns once captured, before being symbolized. The
+   /// stack of the calling thread starts 'skipFrames' frames above the caller.
+   LLVM_ATTRIBUTE_NOINLINE void snapshot(bool allThreads = false, unsigned skipFrames = 0) {
+      if (!this->Snapshots) return;
+      if (allThreads) {
+         this->Snapshots->captureAllThreads(skipFrames + 1);
+      }
+      else {
+         this->Snapshots->captureCurrentThread(skipFrames + 1);
+      }
+   }
+
+   /// Whether address is in the code this engine loaded.
+   bool ownsCode(uint64_t address) const {
+      return this->Functions.contains(address);
+   }
+
+   void printStatistics(raw_ostream& OS) {
+      if (this->Speculator) {
+         this->Speculator->printStatistics(OS);
+      }
+      this->Sections.printStatistics(OS);
+      this->DebugRegistrar.printStatistics(OS);
+      if (this->SlabMemory) {
+         this->SlabMemory->printStatistics(OS);
+      }
+      if (this->CompileClient) {
+         this->CompileClient->printStatistics(OS);
+      }
+   }
+
 private:
+   std::mutex AsyncLock;
+   uint64_t lastAdd = 0;
+   std::set<uint64_t> addsInFlight;
+   std::deque<std::pair<uint64_t, RTTask>> deferredLookups; // by last add issued before
+   std::mutex NotifyLock;
+   StringMap<std::vector<PRUNTIME_FUNCTION>> FunctionTables;
+   std::shared_mutex TenantsLock;
+   StringMap<std::unique_ptr<RTTenant>> Tenants;
+   std::mutex StubsLock;
+   StringMap<std::string> StubVersions; // current version by stub
+   std::atomic<unsigned> lastVersion = 0;
+
+   Error tryRedefine(StringRef name, ThreadSafeModule M, RTTenant* tenant) {
+      if (!this->Stubs) {
+         return make_error<StringError>("Target does not support stubs", inconvertibleErrorCode());
+      }
+      RTTenant& T = tenant ? *tenant : *this->MainTenant;
+      std::string version = (name + "$v" + Twine(++this->lastVersion)).str();
+
+      // Only the new version is exported, under a name of its own
+      auto Err = M.withModuleDo([&](Module& M) -> Error {
+         Function* F = M.getFunction(name);
+         if (!F || F->isDeclaration()) {
+            return make_error<StringError>("Module " + M.getModuleIdentifier() + " does not define " + name,
+               inconvertibleErrorCode());
+         }
+         for (GlobalValue& GV : M.global_values()) {
+            if (&GV != F && !GV.isDeclaration()) {
+               GV.setLinkage(GlobalValue::InternalLinkage);
+            }
+         }
+         F->setName(version);
+         M.setModuleIdentifier(version);
+         return Error::success();
+         });
+      if (Err) {
+         return Err;
+      }
+      if (auto Err = this->tryAddModule(std::move(M), &T)) {
+         return Err;
+      }
+      // Versions are internal names: not demanded, neither recorded nor speculated on
+      auto Impl = this->JIT->getExecutionSession().lookup({ &T.JD }, this->JIT->mangleAndIntern(version));
+      if (!Impl) {
+         return Impl.takeError();
+      }
+      this->flushDebugInfo();
+
+      std::string stubName = (T.getName() + "/" + name).str();
+      std::string previous;
+      {
+         std::lock_guard<std::mutex> guard(this->StubsLock);
+         auto& current = this->StubVersions[stubName];
+         if (current.empty()) {
+            auto flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+            if (auto Err = this->Stubs->createStub(stubName, Impl->getAddress(), flags)) {
+               return Err;
+            }
+            auto Stub = this->Stubs->findStub(stubName, true);
+            if (auto Err = T.JD.define(absoluteSymbols({ { this->JIT->mangleAndIntern(name), Stub } }))) {
+               return Err;
+            }
+         }
+         else if (auto Err = this->Stubs->updatePointer(stubName, Impl->getAddress())) {
+            return Err;
+         }
+         previous = std::move(current);
+         current = version;
+      }
+      traceEvent(RTTraceEvent::Resolve, name, Impl->getAddress());
+
+      if (!previous.empty()) {
+         // Threads entering from now on only reach the new version
+         std::string previousModule = this->getModuleName(T, previous);
+         ResourceTrackerSP RT = T.takeResourceTracker(previousModule);
+         T.Summaries.removeModule(previousModule);
+         RTEpochManager::get().retire(&T, [this, RT, previousModule]() {
+            if (auto Err = RT->remove()) {
+               logAllUnhandledErrors(std::move(Err), errs(), "Cannot free " + previousModule + ": ");
+            }
+            traceEvent(RTTraceEvent::ModuleRemoved, previousModule);
+            this->releaseModules([&](StringRef module) { return isPartitionOf(module, previousModule); });
+            });
+      }
+      return Error::success();
+   }
+
+   /// Name the code at address for snapshots: JIT functions from their table,
+   /// with their line for lean code, and the others through DbgHelp.
+   void symbolize(uint64_t address, raw_ostream& OS) {
+      std::string name, file;
+      uint64_t offset;
+      unsigned line;
+      if (this->Functions.lookup(address, name, offset)) {
+         OS << name << "+" << offset;
+         if (this->LeanDebugInfo && this->LeanDebugInfo->Lines.lookup(name, file, line)) {
+            OS << " (" << file << ":" << line << ")";
+         }
+         return;
+      }
+
+      struct tSymbol : IMAGEHLP_SYMBOL64 {
+         char SymBytes[1024];
+         tSymbol() {
+            memset(this, 0, sizeof(IMAGEHLP_SYMBOL64) + 1024);
+            SizeOfStruct = sizeof(IMAGEHLP_SYMBOL64);
+            MaxNameLength = 1024;
+            Name[0] = 0;
+         }
+      };
+      tSymbol symbol;
+      DWORD64 offsetFromSymbol;
+      // DbgHelp is not thread-safe
+      std::lock_guard<std::mutex> guard(this->NotifyLock);
+      if (SymGetSymFromAddr64(GetCurrentProcess(), address, &offsetFromSymbol, &symbol)) {
+         OS << symbol.Name << "+" << offsetFromSymbol;
+      }
+      else {
+         OS << "?";
+      }
+   }
+
+   /// Run a task on the compile pool once the modules being added are added.
+   /// Only the adds issued so far are waited for.
+   void whenModulesAdded(RTTask task) {
+      {
+         std::lock_guard<std::mutex> guard(this->AsyncLock);
+         if (!this->addsInFlight.empty()) {
+            this->deferredLookups.emplace_back(this->lastAdd, std::move(task));
+            return;
+         }
+      }
+      this->Pool.submit(std::move(task));
+   }
+
+   /// Look up a symbol without blocking: materialization runs on the calling
+   /// thread and the callback is called once the symbol is ready.
+   void materializeAsync(SymbolStringPtr Name, JITDylib& JD, unique_function<void(Expected<JITEvaluatedSymbol>)> OnResolved) {
+      auto& ES = this->JIT->getExecutionSession();
+      ES.lookup(LookupKind::Static, makeJITDylibSearchOrder(&JD),
+         SymbolLookupSet(Name), SymbolState::Ready,
+         [this, Name, OnResolved = std::move(OnResolved)](Expected<SymbolMap> Result) mutable {
+            if (!Result) {
+               return OnResolved(Result.takeError());
+            }
+            this->flushDebugInfo();
+            traceEvent(RTTraceEvent::Resolve, *Name, (*Result)[Name].getAddress());
+            OnResolved((*Result)[Name]);
+         },
+         NoDependenciesToRegister);
+   }
+
+   /// Record a symbol of JD needed by the client, if lookedUp, or by a module
+   /// being linked. Only the main dylib is recorded for the startup manifest.
+   void notifyDemanded(StringRef name, JITDylib& JD, bool lookedUp = false) {
+      if (this->Speculator) {
+         this->Speculator->notifyDemanded(JD.getName(), name, lookedUp);
+      }
+      if (this->Recorder && &JD == &this->MainTenant->JD && this->Recorder->record(name)) {
+         // The recording window is over: write the manifest off the request path
+         this->Pool.submit([this]() {
+            if (auto Err = this->writeStartupManifest()) {
+               logAllUnhandledErrors(std::move(Err), errs(), "Cannot write startup manifest: ");
+            }
+            });
+      }
+   }
+
+   /// Write the symbols recorded which the main dylib defines, the ones warmup
+   /// compiles: the symbols of the runtime dylib, and the host or CRT symbols
+   /// objects refer to, are left out.
+   Error writeStartupManifest() {
+      auto& ES = this->JIT->getExecutionSession();
+      auto& JD = this->MainTenant->JD;
+      return this->Recorder->writeManifest(this->Options.startupManifest, [&](StringRef name) {
+         auto Flags = ES.lookupFlags(LookupKind::Static, makeJITDylibSearchOrder(&JD),
+            SymbolLookupSet(ES.intern(name), SymbolLookupFlags::WeaklyReferencedSymbol));
+         if (!Flags) {
+            consumeError(Flags.takeError());
+            return false;
+         }
+         return !Flags->empty();
+         });
+   }
+
+   /// Compile ahead the likely callees of a symbol being looked up in JD, as
+   /// long as compile threads are idle.
+   void speculate(StringRef name, JITDylib& JD) {
+      if (!this->Speculator) return;
+
+      for (auto& target : this->Speculator->selectTargets(JD.getName(), name)) {
+         if (!this->Pool.hasIdleWorkers()) {
+            this->Speculator->notifySpeculationSkipped(JD.getName(), target);
+            continue;
+         }
+         this->Pool.submit([this, target, &JD]() {
+            auto start = std::chrono::steady_clock::now();
+            this->materializeAsync(this->JIT->getExecutionSession().intern(target), JD,
+               [this, scope = JD.getName(), target, start](Expected<JITEvaluatedSymbol> Sym) {
+                  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                  bool failed = !Sym;
+                  if (failed) {
+                     consumeError(Sym.takeError());
+                  }
+                  this->Speculator->notifySpeculationDone(scope, target, elapsed.count(), failed);
+               });
+            });
+      }
+   }
+
+   Expected<RTModuleCompiler::CompileResult> compilePartition(MemoryBufferRef Bitcode) {
+      LLVMContext Context;
+      auto M = parseBitcodeFile(Bitcode, Context);
+      if (!M) {
+         return M.takeError();
+      }
+      if (this->Options.crossModuleInlining) {
+         this->inlineModule(**M);
+      }
+      return (*this->Compiler)(**M);
+   }
+
+   Expected<ThreadSafeModule> optimizeModule(ThreadSafeModule TSM, MaterializationResponsibility& R) {
+      TSM.withModuleDo([this](Module& M) {
+         this->inlineModule(M);
+         });
+      return std::move(TSM);
+   }
+
+   void inlineModule(Module& M) {
+      legacy::PassManager PM;
+      PM.add(createFunctionInliningPass(this->Options.inlineThreshold));
+      PM.add(createEliminateAvailableExternallyPass());
+      PM.run(M);
+   }
 
    Expected<std::unique_ptr<IRCompileLayer::IRCompiler>>
       createModuleCompiler(JITTargetMachineBuilder& JTMB)
    {
       auto TM = ExitOnErr(JTMB.createTargetMachine());
-      this->Compiler = new RTModuleCompiler(*TM.release(), "d:/dump");
+      if (this->Options.compileServer) {
+         this->CompileClient = std::make_unique<RTCompileClient>(this->Options.compileServer, getCompileTarget(*TM),
+            this->Options.compileServerTimeout);
+      }
+      this->Compiler = new RTModuleCompiler(JTMB, std::move(TM), this->Options.cacheDir, this->LeanDebugInfo.get(),
+         this->CompileClient.get());
       return std::unique_ptr<IRCompileLayer::IRCompiler>(this->Compiler);
    }
 
+   bool processesAllSections() {
+      return this->Options.sectionPolicy == RTSectionPolicy::LoadAll && !this->LeanDebugInfo;
+   }
+
    Expected<std::unique_ptr<ObjectLayer>>
       createObjectLinker(ExecutionSession& ES, const Triple& T)
    {
+      if (this->Options.objectLinker == RTObjectLinker::JITLink) {
+         return this->createJITLinkLinker(ES, T);
+      }
+
       // Otherwise default to creating an RTDyldObjectLinkingLayer that constructs
       // a new SectionMemoryManager for each object.
       auto GetMemMgr = []() -> std::unique_ptr<RuntimeDyld::MemoryManager> {
@@ -251,25 +1288,128 @@ private:
          ObjLinkingLayer->setOverrideObjectFlagsWithResponsibilityFlags(true);
          ObjLinkingLayer->setAutoClaimResponsibilityForObjectSymbols(true);
       }
-      ObjLinkingLayer->setProcessAllSections(true);
-      ObjLinkingLayer->registerJITEventListener(*JITEventListener::createGDBRegistrationListener());
+      // Only the allocatable sections are needed to run the code, the
+      // debugger reads the others from its copy of the object
+      ObjLinkingLayer->setProcessAllSections(this->processesAllSections());
 
       // Handle 'when object sections are linked in memory': register EH Frames
       ObjLinkingLayer->setNotifyLoaded(
          [this](orc::MaterializationResponsibility& MR, const object::ObjectFile& Object, const RuntimeDyld::LoadedObjectInfo& LOS) {
-            this->NotifyObjectEmitted(Object, LOS);
+            this->NotifyObjectEmitted(MR.getTargetJITDylib(), Object, LOS);
+         });
+
+      // Handle 'when object is finalized': its code can run
+      ObjLinkingLayer->setNotifyEmitted(
+         [](orc::MaterializationResponsibility& MR, std::unique_ptr<MemoryBuffer> ObjBuffer) {
+            traceEvent(RTTraceEvent::Finalize, RTModuleCompiler::getModuleIdentifier(ObjBuffer->getBufferIdentifier()),
+               ObjBuffer->getBufferSize());
          });
 
       return std::unique_ptr<ObjectLayer>(std::move(ObjLinkingLayer));
    }
 
-   virtual void NotifyObjectEmitted(const object::ObjectFile& Object,
+   Expected<std::unique_ptr<ObjectLayer>>
+      createJITLinkLinker(ExecutionSession& ES, const Triple& T)
+   {
+      if (!T.isOSBinFormatELF() || T.getArch() != Triple::x86_64) {
+         return make_error<StringError>("JITLink is only used for ELF x86-64, not " + T.str(),
+            inconvertibleErrorCode());
+      }
+      // Code which cannot unwind would crash on exceptions and stop snapshots
+      if (!canRegisterEHFrames()) {
+         return make_error<StringError>("JITLink cannot register the unwind info of its code with this runtime",
+            inconvertibleErrorCode());
+      }
+      auto MemMgr = RTSlabMemoryManager::Create(this->Options.jitLinkSlabSize);
+      if (!MemMgr) {
+         return MemMgr.takeError();
+      }
+      this->SlabMemory = MemMgr->get();
+      auto ObjLinkingLayer = std::make_unique<ObjectLinkingLayer>(ES, std::move(*MemMgr));
+
+      ObjLinkingLayer->addPlugin(createEHFramePlugin(ES));
+      if (this->Options.perfMapDir) {
+         ObjLinkingLayer->addPlugin(std::make_unique<RTPerfMapPlugin>(this->Options.perfMapDir));
+      }
+      ObjLinkingLayer->addPlugin(std::make_unique<RTLinkGraphPlugin>(
+         [this](JITDylib& JD, jitlink::LinkGraph& G) {
+            this->NotifyGraphLinked(JD, G);
+         },
+         [](StringRef objectName) {
+            traceEvent(RTTraceEvent::Finalize, RTModuleCompiler::getModuleIdentifier(objectName));
+         }));
+      return std::unique_ptr<ObjectLayer>(std::move(ObjLinkingLayer));
+   }
+
+   /// The counterpart of NotifyObjectEmitted for JITLink: ELF objects have no
+   /// function table for Windows to unwind, nor DWARF registered.
+   void NotifyGraphLinked(JITDylib& JD, jitlink::LinkGraph& G) {
+      if (this->Speculator || this->Recorder) {
+         for (jitlink::Symbol* Sym : G.external_symbols()) {
+            this->notifyDemanded(Sym->getName(), JD);
+         }
+      }
+
+      StringRef moduleName = RTModuleCompiler::getModuleIdentifier(G.getName());
+      uint64_t size = 0;
+      for (jitlink::Block* B : G.blocks()) {
+         size += B->getSize();
+      }
+      traceEvent(RTTraceEvent::Link, moduleName, size);
+
+      for (jitlink::Symbol* Sym : G.defined_symbols()) {
+         if (Sym->isCallable() && Sym->hasName()) {
+            this->Functions.addFunction(Sym->getAddress().getValue(), Sym->getSize(), Sym->getName(), moduleName);
+         }
+      }
+   }
+
+   virtual void NotifyObjectEmitted(JITDylib& JD, const object::ObjectFile& Object,
       const RuntimeDyld::LoadedObjectInfo& LOS)
    {
-      printf("\nobject %s: %d bytes @%p\n", Object.getFileFormatName().data(), Object.getData().size(), Object.getData().data());
+      // Record the functions this object needs, for speculation and startup manifest
+      if (this->Speculator || this->Recorder) {
+         for (const object::SymbolRef& sym : Object.symbols()) {
+            auto flags = sym.getFlags();
+            if (flags && (*flags & object::SymbolRef::SF_Undefined)) {
+               if (auto name = sym.getName()) {
+                  this->notifyDemanded(*name, JD);
+               }
+            }
+            else if (!flags) {
+               consumeError(flags.takeError());
+            }
+         }
+      }
 
-      if (!LOS.getObjectForDebug(Object).getBinary()) {
-         printf("> debug info missing !!!\n");
+      StringRef moduleName = RTModuleCompiler::getModuleIdentifier(Object.getFileName());
+      traceEvent(RTTraceEvent::Link, moduleName, Object.getData().size());
+
+      // Objects may be linked from several compile threads, DbgHelp is not thread-safe
+      std::lock_guard<std::mutex> guard(this->NotifyLock);
+
+      // Account for the sections left out of JIT memory
+      std::string cachedObjectPath;
+      if (this->Options.sectionPolicy == RTSectionPolicy::MapFromCache) {
+         cachedObjectPath = this->Compiler->getModuleFilename(moduleName);
+      }
+      auto mappedObject = this->Sections.notifyLoaded(moduleName, Object, LOS, this->processesAllSections(), cachedObjectPath);
+
+      // Lean objects have no debug info, their DWARF is registered once
+      // regenerated. Debug objects are only copied once registration is
+      // enabled, rebuilt until then from the mapped object, or the cache file
+      // if all sections were loaded, not at all if they were dropped
+      if (this->LeanDebugInfo) {
+         this->LeanDebugInfo->notifyLoaded(Object, LOS);
+      }
+      else {
+         std::string rebuildPath;
+         if (this->Options.sectionPolicy == RTSectionPolicy::LoadAll) {
+            rebuildPath = this->Compiler->getModuleFilename(moduleName);
+         }
+         if (auto Err = this->DebugRegistrar.notifyLoaded(moduleName, Object, LOS, std::move(mappedObject), rebuildPath)) {
+            logAllUnhandledErrors(std::move(Err), errs(), "Cannot register debug info: ");
+         }
       }
 
       // Register COFF EH frames data
@@ -278,7 +1418,6 @@ private:
       uintptr_t EHFramePtr = 0;
       for (const object::SectionRef& lSection : Object.sections()) {
          auto sName = *lSection.getName();
-         printf("section '%s': %p [%d bytes @%p]\n", sName.data(), LOS.getSectionLoadAddress(lSection), lSection.getSize(), lSection.getRawDataRefImpl());
          if (sName == ".text") {
             RangeBase = LOS.getSectionLoadAddress(lSection);
             RangeEnd = RangeBase + lSection.getSize();
@@ -287,10 +1426,15 @@ private:
             EHFramePtr = LOS.getSectionLoadAddress(lSection);
          }
       }
-      printf("eh_frame [%p - %p]: %p\n", RangeBase, RangeEnd, EHFramePtr);
       //--- Register function table
-      if (!RtlAddFunctionTable(PRUNTIME_FUNCTION(EHFramePtr), 1, RangeBase)) {
-         printf("EH frame mis registered !!!\n");
+      std::unique_lock<std::mutex> tablesGuard(getFunctionTableLock());
+      BOOL tableAdded = RtlAddFunctionTable(PRUNTIME_FUNCTION(EHFramePtr), 1, RangeBase);
+      tablesGuard.unlock();
+      if (!tableAdded) {
+         errs() << "Cannot register the function table of " << moduleName << ": exceptions will not unwind through it.\n";
+      }
+      else {
+         this->FunctionTables[moduleName].push_back(PRUNTIME_FUNCTION(EHFramePtr));
       }
 
       auto symbols = object::computeSymbolSizes(Object);
@@ -302,17 +1446,408 @@ private:
          auto BaseAddr = LOS.getSectionLoadAddress(*sym.getSection().get());
          auto Addr = sym.getAddress().get();
          auto Size = sym_kv.second;
+         this->Functions.addFunction(BaseAddr + Addr - lSection.getAddress(), Size, *sym.getName(), moduleName);
          if (!SymAddSymbol(GetCurrentProcess(), (ULONG64)BaseAddr, sym.getName().get().data(),
             (DWORD64)Addr, (DWORD)Size, 0)) {
-            printf("WARNING: failed to insert function name '%s' into debug info: %lu\n", sym.getName().get().data(), GetLastError());
+            errs() << "Cannot add symbol " << *sym.getName() << " of " << moduleName << " to DbgHelp: " << GetLastError() << ".\n";
+         }
+      }
+   }
+};
+
+/// Builds engines ahead, on a thread of its own, so that getting a fresh one,
+/// for a tenant of its own or a test, costs a pop rather than the bring-up of
+/// the JIT and its target machine. Engines wait stopped, without compile
+/// threads and out of snapshots, and are started when handed out. Engines
+/// are handed out once: a used engine is destroyed, never recycled. When
+/// none is ready, one is built on the calling thread.
+class RTEngineFactory {
+private:
+   RTEngineOptions Options;
+   unsigned prewarmed;
+   std::mutex lock;
+   std::condition_variable wakeUp;
+   std::condition_variable filled;
+   std::deque<std::unique_ptr<RTExecutionEngine>> ready;
+   bool stopping = false;
+   unsigned builtCount = 0;
+   double buildMicroseconds = 0;
+   std::atomic<uint64_t> hitCount;
+   std::atomic<uint64_t> missCount;
+   std::thread builder;
+
+public:
+   RTEngineFactory(const RTEngineOptions& Options, unsigned prewarmed = 2)
+      : Options(Options), prewarmed(prewarmed), hitCount(0), missCount(0) {
+      this->builder = std::thread([this]() { this->run(); });
+   }
+   ~RTEngineFactory() {
+      {
+         std::lock_guard<std::mutex> guard(this->lock);
+         this->stopping = true;
+      }
+      this->wakeUp.notify_one();
+      this->builder.join();
+   }
+
+   std::unique_ptr<RTExecutionEngine> create() {
+      std::unique_ptr<RTExecutionEngine> engine;
+      {
+         std::lock_guard<std::mutex> guard(this->lock);
+         if (!this->ready.empty()) {
+            engine = std::move(this->ready.front());
+            this->ready.pop_front();
+            this->hitCount++;
+            this->wakeUp.notify_one();
          }
       }
+      if (engine) {
+         engine->start();
+         return engine;
+      }
+      this->missCount++;
+      return this->build(true);
+   }
+
+   /// Wait until 'prewarmed' engines are ready.
+   void waitUntilPrewarmed() {
+      std::unique_lock<std::mutex> guard(this->lock);
+      this->filled.wait(guard, [this]() { return this->ready.size() >= this->prewarmed; });
+   }
+
+   /// The mean bring-up of the engines built, in microseconds.
+   double getMeanBringUp() {
+      std::lock_guard<std::mutex> guard(this->lock);
+      return this->builtCount ? this->buildMicroseconds / this->builtCount : 0;
+   }
+
+   void printStatistics(raw_ostream& OS) {
+      OS << "Engine factory: " << this->hitCount << " engines prewarmed, " << this->missCount << " built on demand, "
+         << format("%.1f", this->getMeanBringUp() / 1000) << " ms bring-up.\n";
+   }
+
+private:
+   std::unique_ptr<RTExecutionEngine> build(bool started) {
+      auto start = std::chrono::steady_clock::now();
+      auto engine = std::make_unique<RTExecutionEngine>(this->Options, started);
+      double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+      std::lock_guard<std::mutex> guard(this->lock);
+      this->builtCount++;
+      this->buildMicroseconds += elapsed;
+      return engine;
+   }
+
+   void run() {
+      std::unique_lock<std::mutex> guard(this->lock);
+      while (1) {
+         this->wakeUp.wait(guard, [this]() { return this->stopping || this->ready.size() < this->prewarmed; });
+         if (this->stopping) return;
+         guard.unlock();
+         auto engine = this->build(false);
+         guard.lock();
+         this->ready.push_back(std::move(engine));
+         this->filled.notify_all();
+      }
    }
 };
 
+extern"C" LLVM_ATTRIBUTE_NOINLINE void doSnapshot() {
+   uint64_t caller = (uint64_t)_ReturnAddress();
+   std::lock_guard<std::mutex> guard(SnapshotEnginesLock);
+   for (RTExecutionEngine* engine : SnapshotEngines) {
+      if (engine->ownsCode(caller)) {
+         // The snapshot starts at the JIT code which asked for it
+         engine->snapshot(false, 1);
+         return;
+      }
+   }
+}
+
+static BOOL WINAPI onConsoleControl(DWORD event) {
+   if (event != CTRL_BREAK_EVENT) return FALSE;
+   std::lock_guard<std::mutex> guard(SnapshotEnginesLock);
+   for (RTExecutionEngine* engine : SnapshotEngines) {
+      engine->snapshot(true, 1);
+   }
+   return TRUE;
+}
+
 //extern"C" int fib(int);
 
+/// Print the events traced by another process as they come.
+int tailTrace(DWORD processId) {
+   RTTraceReader Reader;
+   if (!Reader.open(processId)) {
+      printf("No trace for process %d\n", processId);
+      return 1;
+   }
+   uint64_t lost = 0;
+   while (1) {
+      size_t count = Reader.poll([](const RTTraceRecord& event) {
+         outs() << format("%.6f", event.timestamp / 1e9) << " [" << event.threadId << "] "
+            << getTraceEventName(event.kind) << " " << StringRef(event.name, event.nameLength);
+         if (event.kind == RTTraceEvent::Resolve) {
+            outs() << " @" << format_hex(event.value, 18);
+         }
+         else if (event.value) {
+            outs() << " " << event.value << " bytes";
+         }
+         outs() << "\n";
+         });
+      if (Reader.getLost() != lost) {
+         outs() << "(" << (Reader.getLost() - lost) << " events lost)\n";
+         lost = Reader.getLost();
+      }
+      outs().flush();
+      if (!count) {
+         Sleep(100);
+      }
+   }
+}
+
+/// Compile modules for the engines of the other processes of the host, with
+/// the code generation settings of this one.
+int runCompileServer(const RTEngineOptions& Options) {
+   JITTargetMachineBuilder JTMB = RTExecutionEngine::getHostTarget();
+   auto TM = ExitOnErr(JTMB.createTargetMachine());
+   std::string target = getCompileTarget(*TM);
+   RTModuleCompiler Compiler(JTMB, std::move(TM), Options.cacheDir);
+   RTCompileServer Server(Options.compileServer, target, [&](Module& M) {
+      return Compiler.withTargetMachine([&](TargetMachine& TM) {
+         return Compiler.emitObject(M, TM);
+         });
+      }, Options.cacheDir, Options.compileThreads);
+   printf("Compile server: %s\n", Options.compileServer);
+   Server.run();
+   return 1;
+}
+
+static uint64_t getPrivateBytes() {
+   PROCESS_MEMORY_COUNTERS_EX counters;
+   if (!GetProcessMemoryInfo(GetCurrentProcess(), (PPROCESS_MEMORY_COUNTERS)&counters, sizeof(counters))) {
+      return 0;
+   }
+   return counters.PrivateUsage;
+}
+
+/// Compare the link latency and the memory per object of the linkers: the
+/// objects are compiled ahead, then linked one by one, each on its lookup.
+int benchmarkLinkers(unsigned count) {
+   const unsigned functions = 16;
+   for (RTObjectLinker linker : { RTObjectLinker::RuntimeDyld, RTObjectLinker::JITLink }) {
+      if (linker == RTObjectLinker::JITLink && !canRegisterEHFrames()) {
+         outs() << "JITLink: skipped, its code cannot unwind with this runtime\n";
+         continue;
+      }
+      RTEngineOptions Options;
+      Options.objectLinker = linker;
+      Options.crossModuleInlining = false;
+      Options.speculation = false;
+      auto exec = std::make_unique<RTExecutionEngine>(Options);
+
+      std::vector<std::unique_ptr<MemoryBuffer>> Objects;
+      for (unsigned i = 0; i < count; i++) {
+         auto TSM = createBenchModule(i, functions);
+         auto Object = TSM.withModuleDo([&](Module& M) {
+            M.setDataLayout(exec->JIT->getDataLayout());
+            M.setTargetTriple(exec->JIT->getTargetTriple().str());
+            return exec->Compiler->withTargetMachine([&](TargetMachine& TM) {
+               return exec->Compiler->emitObject(M, TM);
+               });
+            });
+         Objects.push_back(ExitOnErr(std::move(Object)));
+      }
+
+      std::vector<double> latencies;
+      uint64_t privateBytes = getPrivateBytes();
+      for (unsigned i = 0; i < count; i++) {
+         auto start = std::chrono::steady_clock::now();
+         ExitOnErr(exec->JIT->addObjectFile(std::move(Objects[i])));
+         ExitOnErr(exec->JIT->lookup("bench" + std::to_string(i) + "_0"));
+         latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+      }
+      privateBytes = getPrivateBytes() - privateBytes;
+
+      std::sort(latencies.begin(), latencies.end());
+      double total = 0;
+      for (double latency : latencies) total += latency;
+      outs() << (linker == RTObjectLinker::JITLink ? "JITLink" : "RuntimeDyld") << ": " << count << " objects of "
+         << functions << " functions, link " << format("%.1f", total / count) << " us mean, "
+         << format("%.1f", latencies[count / 2]) << " us median, " << format("%.1f", latencies[count * 99 / 100])
+         << " us p99, " << format("%.1f", privateBytes / 1024.0 / count) << " KB per object\n";
+      exec->printStatistics(outs());
+   }
+   return 0;
+}
+
+/// Measure the bring-up of engines: host detection, which engines share, the
+/// first engine and the next ones, and engines from a factory, either paced
+/// so that it keeps up or in a burst which drains it.
+int benchmarkBringUp(unsigned count) {
+   using Clock = std::chrono::steady_clock;
+   auto elapsed = [](Clock::time_point start) {
+      return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+   };
+   RTEngineOptions Options;
+
+   auto start = Clock::now();
+   ExitOnErr(JITTargetMachineBuilder::detectHost());
+   outs() << format("Host detection: %.2f ms, shared by engines\n", elapsed(start));
+
+   start = Clock::now();
+   std::make_unique<RTExecutionEngine>(Options).reset();
+   outs() << format("First engine: %.2f ms\n", elapsed(start));
+
+   double built = 0;
+   for (unsigned i = 0; i < count; i++) {
+      start = Clock::now();
+      auto exec = std::make_unique<RTExecutionEngine>(Options);
+      built += elapsed(start);
+   }
+   outs() << format("Engine built: %.2f ms mean\n", built / count);
+
+   for (bool paced : { true, false }) {
+      RTEngineFactory Factory(Options);
+      double acquired = 0;
+      for (unsigned i = 0; i < count; i++) {
+         if (paced) {
+            Factory.waitUntilPrewarmed();
+         }
+         start = Clock::now();
+         auto exec = Factory.create();
+         acquired += elapsed(start);
+      }
+      outs() << "Engine from factory, " << (paced ? "paced" : "burst") << format(": %.3f ms mean\n", acquired / count);
+      Factory.printStatistics(outs());
+   }
+   return 0;
+}
+
+/// Check hot-swapping: threads call a function through its stub while it is
+/// redefined, and must only see a version at least as new as the last one
+/// whose redefinition returned. Returns the count of failures.
+unsigned runHotSwapTest(const char* cacheDir) {
+   const int versions = 50;
+   RTEngineOptions Options;
+   Options.speculation = false;
+   Options.cacheDir = cacheDir;
+   RTExecutionEngine exec(Options);
+
+   ExitOnErr(exec.redefine("swapped", createVersionModule("swapped", 1)).get());
+   auto swapped = (int (*)(int))exec.getSymbolAddress("swapped");
+
+   std::atomic<int> latest{ 1 };
+   std::atomic<bool> stopping{ false };
+   std::atomic<unsigned> calls{ 0 };
+   std::atomic<unsigned> failures{ 0 };
+   std::vector<std::thread> callers;
+   for (unsigned i = 0; i < 4; i++) {
+      callers.emplace_back([&]() {
+         while (!stopping) {
+            auto guard = exec.enterCode();
+            int oldest = latest.load();
+            int version = swapped(0);
+            if (version < oldest || version > versions) {
+               failures++;
+            }
+            calls++;
+         }
+         });
+   }
+   for (int version = 2; version <= versions; version++) {
+      ExitOnErr(exec.redefine("swapped", createVersionModule("swapped", version)).get());
+      latest = version;
+   }
+   stopping = true;
+   for (auto& caller : callers) {
+      caller.join();
+   }
+   {
+      auto guard = exec.enterCode();
+      if (swapped(0) != versions) {
+         failures++;
+      }
+   }
+
+   outs() << "Hot-swap: " << versions << " versions, " << calls << " calls, " << failures << " failures: "
+      << (failures ? "FAILED" : "passed") << "\n";
+   return failures;
+}
+
+/// Check speculation: looking up 'callerA' compiles 'hot', defined in another
+/// module, on an idle compile thread, but not 'local', defined with the
+/// caller; 'callerB' does the same for 'cold'. 'hot' is then looked up, a hit,
+/// and 'cold' never is, wasted. Returns the count of failures.
+unsigned runSpeculationTest(const char* cacheDir) {
+   RTEngineOptions Options;
+   Options.speculation = true;
+   Options.crossModuleInlining = false;
+   Options.cacheDir = cacheDir;
+   RTExecutionEngine exec(Options);
+
+   exec.addModule(createCallerModule("callerA", { "local", "hot" }, { "local" }));
+   exec.addModule(createCallerModule("callerB", { "cold" }));
+   exec.addModule(createVersionModule("hot", 1));
+   exec.addModule(createVersionModule("cold", 2));
+
+   // Speculation only runs on idle threads: wait for them, and for its end
+   auto waitFor = [](auto condition) {
+      auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+      while (!condition()) {
+         if (std::chrono::steady_clock::now() > deadline) return false;
+         std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      return true;
+   };
+   unsigned failures = 0;
+   unsigned expectedCompleted = 0;
+   for (const char* caller : { "callerA", "callerB" }) {
+      failures += !waitFor([&]() { return exec.Pool.hasIdleWorkers(); });
+      if (auto Err = exec.lookup(caller).takeError()) {
+         logAllUnhandledErrors(std::move(Err), errs(), "Cannot look up caller: ");
+         failures++;
+      }
+      expectedCompleted++;
+      failures += !waitFor([&]() {
+         auto stats = exec.Speculator->getStatistics();
+         return stats.completed + stats.failed >= expectedCompleted;
+         });
+   }
+   if (auto Err = exec.lookup("hot").takeError()) {
+      logAllUnhandledErrors(std::move(Err), errs(), "Cannot look up hot: ");
+      failures++;
+   }
+
+   auto stats = exec.Speculator->getStatistics();
+   failures += stats.speculated != 2;
+   failures += stats.completed != 2;
+   failures += stats.failed != 0;
+   failures += stats.skipped != 0;
+   failures += stats.hits != 1;
+   failures += stats.wasted != 1;
+   exec.Speculator->printStatistics(outs());
+   outs() << "Speculation: " << failures << " failures: " << (failures ? "FAILED" : "passed") << "\n";
+   return failures;
+}
+
+/// Run the self-test with a cache directory of its own, removed after, so
+/// that every version is compiled rather than loaded. Returns 0 when it passes.
+int runSelfTest() {
+   SmallString<128> cacheDir;
+   if (auto EC = sys::fs::createUniqueDirectory("rt-self-test", cacheDir)) {
+      errs() << "Cannot create cache directory: " << EC.message() << "\n";
+      return 1;
+   }
+   unsigned failures = runHotSwapTest(cacheDir.c_str()) + runSpeculationTest(cacheDir.c_str());
+   sys::fs::remove_directories(cacheDir);
+   return failures ? 1 : 0;
+}
+
 int main(int argc, char* argv[]) {
+   if (argc == 3 && StringRef(argv[1]) == "--tail-trace") {
+      return tailTrace(atoi(argv[2]));
+   }
    printf("Process: %d\n\n", GetCurrentProcessId());
 
    if (!SymInitialize(GetCurrentProcess(), 0, FALSE)) throw "Cannot init symbols";
@@ -327,19 +1862,39 @@ int main(int argc, char* argv[]) {
    InitializeNativeTarget();
    InitializeNativeTargetAsmPrinter();
 
-   RTExecutionEngine exec;
+   RTEngineOptions Options;
+   Options.startupManifest = "d:/dump/startup.manifest";
+   Options.trace = true;
+   Options.snapshotFile = "d:/dump/snapshots.log";
+   if (argc == 2 && StringRef(argv[1]) == "--compile-server") {
+      Options.compileServer = RTCompileServer::DefaultPipeName;
+      return runCompileServer(Options);
+   }
+   if (argc >= 2 && StringRef(argv[1]) == "--bench-bringup") {
+      return benchmarkBringUp(argc == 3 ? std::max(atoi(argv[2]), 1) : 20);
+   }
+   if (argc >= 2 && StringRef(argv[1]) == "--bench-linkers") {
+      return benchmarkLinkers(argc == 3 ? std::max(atoi(argv[2]), 1) : 1000);
+   }
+   if (argc == 2 && StringRef(argv[1]) == "--self-test") {
+      return runSelfTest();
+   }
+   RTExecutionEngine exec(Options);
 
    //fib(4);
 
    auto M = createDemoModule(exec.JIT.get());
    exec.addModule(std::move(M));
+   ExitOnErr(exec.warmup());
 
    try {
       // Look up the JIT'd function, cast it to a function pointer, then call it.
+      auto guard = exec.enterCode();
       int (*fibF)(int) = (int (*)(int))exec.getSymbolAddress("fib");
       int n = 4;
       int Result = fibF(n);
       outs() << "fib(" << n << ") = " << Result << "\n";
+      exec.printStatistics(outs());
 
    }
    catch (std::exception e) {
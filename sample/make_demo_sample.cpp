@@ -40,66 +40,6 @@ BOOL UpdateModulesList() {
    return moduleCount > 0;
 }
 
-void printStack() {
-   //UpdateModulesList();
-   SymRefreshModuleList(GetCurrentProcess());
-
-#if defined(_WIN64)
-   CONTEXT context;
-   memset(&context, 0, sizeof(CONTEXT));
-   context.ContextFlags = CONTEXT_FULL;
-   context.Rsp = (DWORD64)_AddressOfReturnAddress();
-   if (context.Rip == 0 && context.Rsp != 0) {
-      context.Rip = (ULONG64)(*(PULONG64)context.Rsp);
-      context.Rsp += 8;
-   }
-   for (int i = 0; i < 4096 && context.Rip; i++)
-   {
-      DWORD64 ImageBase, BaseAddress, InsAddress;
-      PRUNTIME_FUNCTION pFunctionEntry = ::RtlLookupFunctionEntry(context.Rip, &ImageBase, NULL);
-      if (pFunctionEntry) {
-         PVOID HandlerData;
-         DWORD64 EstablisherFrame;
-         InsAddress = context.Rip;
-         BaseAddress = ImageBase + pFunctionEntry->BeginAddress;
-         ::RtlVirtualUnwind(UNW_FLAG_NHANDLER,
-            ImageBase,
-            InsAddress,
-            pFunctionEntry,
-            &context,
-            &HandlerData,
-            &EstablisherFrame,
-            NULL);
-      }
-      else {
-         InsAddress = context.Rip;
-         BaseAddress = context.Rip;
-         context.Rip = (ULONG64)(*(PULONG64)context.Rsp);
-         context.Rsp += 8;
-      }
-
-
-      struct tSymbol : IMAGEHLP_SYMBOL64 {
-         char SymBytes[1024];
-         tSymbol() {
-            memset(this, 0, sizeof(IMAGEHLP_SYMBOL64) + 1024);
-            SizeOfStruct = sizeof(IMAGEHLP_SYMBOL64);
-            MaxNameLength = 1024;
-            Name[0] = 0;
-         }
-      };
-      tSymbol symbol;
-      DWORD64 offsetFromSymbol;
-      if (SymGetSymFromAddr64(GetCurrentProcess(), InsAddress, &offsetFromSymbol, &symbol)) {
-         printf("> %p: %s\n", BaseAddress, symbol.Name);
-      }
-      else {
-         printf("> %p\n", BaseAddress);
-      }
-   }
-#endif
-}
-
 DIType* DBGetDoubleTy(DIBuilder* DBuilder) {
    return DBuilder->createBasicType("double", 64, dwarf::DW_ATE_float);
 }
@@ -228,3 +168,64 @@ ThreadSafeModule createDemoModule(LLJIT* J) {
 
    return ThreadSafeModule(std::move(M), std::move(Context));
 }
+
+/// A module of 'functions' fib functions, 'bench<index>_<n>', to measure
+/// the linking of objects of a realistic shape.
+ThreadSafeModule createBenchModule(unsigned index, unsigned functions) {
+   auto Context = std::make_unique<LLVMContext>();
+   auto M = std::make_unique<Module>("bench" + std::to_string(index), *Context);
+
+   auto Builder = std::make_unique<IRBuilder<>>(*Context);
+   auto DBuilder = std::make_unique<DIBuilder>(*M);
+
+   DIFile* DUnit = DBuilder->createFile("bench.txt", "d:/sources");
+   DBuilder->createCompileUnit(dwarf::DW_LANG_C, DUnit, "Kaleidoscope Compiler", 0, "", 0);
+
+   for (unsigned i = 0; i < functions; i++) {
+      std::string name = "bench" + std::to_string(index) + "_" + std::to_string(i);
+      CreateFibFunction(name.c_str(), M.get(), Builder.get(), DBuilder.get(), DUnit, *Context);
+   }
+
+   DBuilder->finalize();
+   return ThreadSafeModule(std::move(M), std::move(Context));
+}
+
+/// A module defining 'int name(int)', returning its argument plus version,
+/// to tell the versions of a redefined function apart.
+ThreadSafeModule createVersionModule(const char* name, int version) {
+   auto Context = std::make_unique<LLVMContext>();
+   auto M = std::make_unique<Module>(std::string(name) + "_v" + std::to_string(version), *Context);
+
+   FunctionType* FTy = FunctionType::get(Type::getInt32Ty(*Context), { Type::getInt32Ty(*Context) }, false);
+   Function* F = Function::Create(FTy, Function::ExternalLinkage, name, M.get());
+   BasicBlock* BB = BasicBlock::Create(*Context, "EntryBlock", F);
+   auto Sum = BinaryOperator::CreateAdd(&*F->arg_begin(), ConstantInt::get(Type::getInt32Ty(*Context), version), "sum", BB);
+   ReturnInst::Create(*Context, Sum, BB);
+
+   return ThreadSafeModule(std::move(M), std::move(Context));
+}
+
+/// A module defining 'int name(int)', returning the sum of its callees
+/// called with its argument. The callees in 'locals' are defined in the
+/// module as returning their argument, the others only declared.
+ThreadSafeModule createCallerModule(const char* name, ArrayRef<const char*> callees, ArrayRef<const char*> locals) {
+   auto Context = std::make_unique<LLVMContext>();
+   auto M = std::make_unique<Module>(name, *Context);
+
+   FunctionType* FTy = FunctionType::get(Type::getInt32Ty(*Context), { Type::getInt32Ty(*Context) }, false);
+   for (const char* local : locals) {
+      Function* L = Function::Create(FTy, Function::ExternalLinkage, local, M.get());
+      ReturnInst::Create(*Context, &*L->arg_begin(), BasicBlock::Create(*Context, "EntryBlock", L));
+   }
+   Function* F = Function::Create(FTy, Function::ExternalLinkage, name, M.get());
+   BasicBlock* BB = BasicBlock::Create(*Context, "EntryBlock", F);
+   Value* Sum = ConstantInt::get(Type::getInt32Ty(*Context), 0);
+   for (const char* callee : callees) {
+      auto CalleeF = M->getOrInsertFunction(callee, FTy);
+      auto Call = CallInst::Create(CalleeF, { &*F->arg_begin() }, callee, BB);
+      Sum = BinaryOperator::CreateAdd(Sum, Call, "sum", BB);
+   }
+   ReturnInst::Create(*Context, Sum, BB);
+
+   return ThreadSafeModule(std::move(M), std::move(Context));
+}